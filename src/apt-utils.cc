@@ -21,6 +21,8 @@
  *
  */
 
+#include <string.h>
+
 #include <apt-pkg/debversion.h>
 
 #include "apt-utils.h"
@@ -35,3 +37,89 @@ compare_deb_versions (const gchar *a, const gchar *b)
 
   return debVS.CmpVersion (a,b);
 }
+
+/* The bytes of a sort key.  A version is a sequence of non-digit and
+   digit parts.  In a non-digit part, '~' sorts before the end of the
+   part, which sorts before letters, which sort before everything
+   else.  A digit part is a number, written as its number of digits
+   followed by the digits without leading zeros.
+*/
+#define KEY_TILDE       0x01
+#define KEY_END         0x02
+#define KEY_NON_LETTER  0x80
+
+static void
+append_digits (GString *key, const gchar *start, const gchar *end)
+{
+  while (start < end && *start == '0')
+    start++;
+
+  gsize len = MIN (end - start, 0xFF - KEY_TILDE);
+  g_string_append_c (key, KEY_TILDE + len);
+  g_string_append_len (key, start, len);
+}
+
+/* Encode the upstream version or the revision from START to END.
+   An empty fragment is encoded like "0", and the final KEY_END makes
+   a fragment sort like itself followed by empty parts.
+*/
+static void
+append_version_fragment (GString *key, const gchar *start, const gchar *end)
+{
+  const gchar *p = start;
+
+  do
+    {
+      while (p < end && !g_ascii_isdigit (*p))
+	{
+	  if (*p == '~')
+	    g_string_append_c (key, KEY_TILDE);
+	  else if (g_ascii_isalpha (*p))
+	    g_string_append_c (key, *p);
+	  else
+	    g_string_append_c (key, KEY_NON_LETTER | *p);
+	  p++;
+	}
+      g_string_append_c (key, KEY_END);
+
+      const gchar *digits = p;
+      while (p < end && g_ascii_isdigit (*p))
+	p++;
+      append_digits (key, digits, p);
+    }
+  while (p < end);
+
+  g_string_append_c (key, KEY_END);
+}
+
+gchar *
+deb_version_sort_key (const gchar *version)
+{
+  if (version == NULL)
+    return NULL;
+
+  GString *key = g_string_new ("");
+  const gchar *end = version + strlen (version);
+
+  const gchar *upstream = version;
+  const gchar *colon = strchr (version, ':');
+  if (colon)
+    {
+      append_digits (key, version, colon);
+      upstream = colon + 1;
+    }
+  else
+    append_digits (key, version, version);
+
+  /* A missing revision is the same as "0".
+   */
+  const gchar *dash = strrchr (upstream, '-');
+  const gchar *zero = "0";
+  append_version_fragment (key, upstream, dash? dash : end);
+  if (dash)
+    append_version_fragment (key, dash + 1, end);
+  else
+    append_version_fragment (key, zero, zero + 1);
+
+  return g_string_free (key, FALSE);
+}
@@ -35,4 +35,10 @@
 
 gint compare_deb_versions (const gchar *a, const gchar *b);
 
+/* Return a newly allocated string such that comparing the keys of
+   two versions with strcmp gives the same order as
+   compare_deb_versions.  Returns NULL for NULL.
+*/
+gchar *deb_version_sort_key (const gchar *version);
+
 #endif /* !APT_UTILS_H */
@@ -0,0 +1,1067 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* apt-worker-bench measures how long the apt-worker takes to answer
+   requests.  It works on a fake root with generated packages, so it
+   runs on any Linux box without network access and without being
+   root.
+
+   apt-worker-bench generate ROOT N
+
+     Creates a fake root in ROOT with N user/ packages, some of which
+     are installed with an update available.  The packages have icons,
+     pretty names and localized descriptions, and ROOT/domains
+     contains a certified domain for their repository.
+
+   apt-worker-bench script N FILE
+
+     Writes a request stream to FILE that resembles what the frontend
+     sends when it starts up and the user looks around: the package
+     list, the infos for all packages, and details and install checks
+     for some of them.
+
+   apt-worker-bench replay ROOT FILE [ROUNDS]
+
+     Starts the apt-worker in "bench" mode on ROOT, sends it all
+     requests in FILE ROUNDS times, one after the other, and reports
+     the latency percentiles and the response sizes per command, as
+     well as the peak RSS of the apt-worker.
+
+   apt-worker-bench strings N [ROUNDS]
+
+     Encodes a package list reply with N packages, decodes the strings
+     of its entries ROUNDS times the way the frontend does, and frees
+     them again.  This is done once with a separate allocation for
+     each string, as the frontend used to do, and once with all
+     strings in one GStringChunk, as it does now.  The average time
+     for decoding and for freeing is reported for each.
+
+   apt-worker-bench control DEB [ROUNDS]
+
+     Reads the control record of DEB ROUNDS times, both by running
+     "dpkg-deb -f" through popen and reading its output into a buffer
+     that grows by 2000 bytes at a time, as the apt-worker used to do,
+     and with the in-process reader of deb-control.cc that it uses
+     now, and reports the average time for each.
+
+   apt-worker-bench lookup N
+
+     Compares looking up N names in a list of N strings by scanning a
+     GList with looking them up in a GHashTable.  This only shows the
+     cost of the two data structures, which the frontend used for
+     search results and named installs before and after the change;
+     it does not run the frontend's find_package_in_lists or
+     search_packages_reply, which need GTK.
+
+   The frontend writes the requests it sends to the file named by the
+   HAM_RECORD_REQUESTS environment variable, if it is set.  Such
+   recordings can be replayed as well.  The apt-worker binary is taken
+   from the APT_WORKER environment variable, or ./apt-worker.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+
+#include <glib.h>
+
+#include <apt-pkg/init.h>
+#include <apt-pkg/error.h>
+
+#include "apt-worker-proto.h"
+#include "deb-control.h"
+
+#define BENCH_URI "file:/bench"
+#define BENCH_DIST "bench"
+#define BENCH_COMPONENT "user"
+
+#define BENCH_INFO_BATCH 50
+#define BENCH_DETAILS 20
+
+static const char *sections[] = {
+  "user/office",
+  "user/games",
+  "user/multimedia",
+  "user/network",
+  "user/utilities",
+  "user/navigation",
+  "user/system",
+  NULL
+};
+
+static void
+fail (const char *fmt, ...)
+{
+  va_list args;
+  va_start (args, fmt);
+  fprintf (stderr, "apt-worker-bench: ");
+  vfprintf (stderr, fmt, args);
+  va_end (args);
+  fprintf (stderr, "\n");
+  exit (1);
+}
+
+static void
+usage ()
+{
+  fprintf (stderr, "Usage: apt-worker-bench generate ROOT N\n");
+  fprintf (stderr, "       apt-worker-bench script N FILE\n");
+  fprintf (stderr, "       apt-worker-bench replay ROOT FILE [ROUNDS]\n");
+  fprintf (stderr, "       apt-worker-bench strings N [ROUNDS]\n");
+  fprintf (stderr, "       apt-worker-bench control DEB [ROUNDS]\n");
+  fprintf (stderr, "       apt-worker-bench lookup N\n");
+  exit (1);
+}
+
+/** GENERATING THE FAKE ROOT
+ */
+
+static void
+make_dirs (const char *root, const char *dir)
+{
+  char *path = g_build_filename (root, dir, NULL);
+  if (g_mkdir_with_parents (path, 0755) < 0)
+    fail ("%s: %s", path, strerror (errno));
+  g_free (path);
+}
+
+static FILE *
+open_file (const char *root, const char *name)
+{
+  char *path = g_build_filename (root, name, NULL);
+  FILE *f = fopen (path, "w");
+  if (f == NULL)
+    fail ("%s: %s", path, strerror (errno));
+  g_free (path);
+  return f;
+}
+
+static void
+close_file (FILE *f)
+{
+  if (ferror (f) | fclose (f))
+    fail ("write error: %s", strerror (errno));
+}
+
+static bool
+is_installed (int i)
+{
+  return i % 10 == 0;
+}
+
+static int
+n_libs (int n)
+{
+  return n / 20 + 1;
+}
+
+/* Write the fields that the Packages file and the status file have
+   in common for the I-th application.
+*/
+static void
+write_app_stanza (FILE *f, int i, int n, const char *version)
+{
+  fprintf (f, "Package: bench-app-%05d\n", i);
+  fprintf (f, "Version: %s\n", version);
+  fprintf (f, "Architecture: %s\n", DEB_HOST_ARCH);
+  fprintf (f, "Section: %s\n", sections[i % (G_N_ELEMENTS (sections) - 1)]);
+  fprintf (f, "Maintainer: Bench <bench@example.com>\n");
+  fprintf (f, "Installed-Size: %d\n", 100 + i % 900);
+  fprintf (f, "Depends: bench-lib-%04d\n", i % n_libs (n));
+  fprintf (f, "Maemo-Display-Name: Bench App %d\n", i);
+  fprintf (f, "Maemo-Display-Name-de: Testprogramm %d\n", i);
+  fprintf (f, "Maemo-Display-Name-fi: Testiohjelma %d\n", i);
+
+  /* Not a real PNG, but of the usual size.
+   */
+  fprintf (f, "Maemo-Icon-26:\n");
+  for (int line = 0; line < 16; line++)
+    {
+      fprintf (f, " ");
+      for (int c = 0; c < 64; c++)
+	fputc ("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+	       [(i * 7 + line * 13 + c) % 64], f);
+      fprintf (f, "\n");
+    }
+
+  fprintf (f, "Description: Benchmark application number %d\n", i);
+  fprintf (f, " This package has been generated by apt-worker-bench.\n"
+	   " It does nothing, but it does so in a very realistic way.\n");
+  fprintf (f, "Description-de: Testanwendung Nummer %d\n", i);
+  fprintf (f, " Dieses Paket wurde von apt-worker-bench erzeugt.\n");
+  fprintf (f, "Description-fi: Testisovellus numero %d\n", i);
+  fprintf (f, " Taman paketin on luonut apt-worker-bench.\n");
+}
+
+static void
+write_lib_stanza (FILE *f, int i, const char *version)
+{
+  fprintf (f, "Package: bench-lib-%04d\n", i);
+  fprintf (f, "Version: %s\n", version);
+  fprintf (f, "Architecture: %s\n", DEB_HOST_ARCH);
+  fprintf (f, "Section: libs\n");
+  fprintf (f, "Maintainer: Bench <bench@example.com>\n");
+  fprintf (f, "Installed-Size: 50\n");
+  fprintf (f, "Description: Benchmark library number %d\n", i);
+}
+
+static void
+write_archive_fields (FILE *f, const char *package, const char *version)
+{
+  fprintf (f, "Filename: pool/%s_%s_%s.deb\n", package, version,
+	   DEB_HOST_ARCH);
+  fprintf (f, "Size: %d\n", 10000 + (int) strlen (package) * 100);
+  fprintf (f, "SHA256: ");
+  for (int i = 0; i < 64; i++)
+    fputc ("0123456789abcdef"[(package[i % strlen (package)] + i) % 16], f);
+  fprintf (f, "\n");
+}
+
+static void
+generate (const char *root, int n)
+{
+  char *abs_root;
+  FILE *f;
+
+  if (n <= 0)
+    fail ("need at least one package");
+
+  make_dirs (root, "etc/apt/apt.conf.d");
+  make_dirs (root, "etc/apt/sources.list.d");
+  make_dirs (root, "etc/apt/preferences.d");
+  make_dirs (root, "var/lib/dpkg/updates");
+  make_dirs (root, "var/lib/dpkg/info");
+  make_dirs (root, "var/lib/apt/lists/partial");
+  make_dirs (root, "var/cache/apt/archives/partial");
+  make_dirs (root, "var/log");
+  make_dirs (root, "domains");
+
+  if (g_path_is_absolute (root))
+    abs_root = g_strdup (root);
+  else
+    {
+      char *cwd = g_get_current_dir ();
+      abs_root = g_build_filename (cwd, root, NULL);
+      g_free (cwd);
+    }
+
+  f = open_file (root, "etc/apt/apt.conf");
+  fprintf (f, "Dir \"%s/\";\n", abs_root);
+  fprintf (f, "Dir::State::status \"%s/var/lib/dpkg/status\";\n", abs_root);
+  fprintf (f, "Dir::Bin::dpkg \"/bin/false\";\n");
+  fprintf (f, "Debug::NoLocking \"true\";\n");
+  close_file (f);
+
+  f = open_file (root, "etc/apt/sources.list");
+  fprintf (f, "deb [trusted=yes] %s %s %s\n",
+	   BENCH_URI, BENCH_DIST, BENCH_COMPONENT);
+  close_file (f);
+
+  f = open_file (root, "domains/bench.xexp");
+  fprintf (f,
+	   "<domains>\n"
+	   " <domain>\n"
+	   "  <name>bench</name>\n"
+	   "  <uri>%s/</uri>\n"
+	   "  <trust-level>100</trust-level>\n"
+	   "  <certified/>\n"
+	   " </domain>\n"
+	   "</domains>\n", BENCH_URI);
+  close_file (f);
+
+  f = open_file (root, "var/lib/apt/lists/_bench_dists_bench_Release");
+  fprintf (f, "Origin: bench\nLabel: bench\nSuite: %s\nCodename: %s\n"
+	   "Architectures: %s\nComponents: %s\n",
+	   BENCH_DIST, BENCH_DIST, DEB_HOST_ARCH, BENCH_COMPONENT);
+  close_file (f);
+
+  char *packages_name =
+    g_strdup_printf ("var/lib/apt/lists/_bench_dists_%s_%s_binary-%s_Packages",
+		     BENCH_DIST, BENCH_COMPONENT, DEB_HOST_ARCH);
+  f = open_file (root, packages_name);
+  g_free (packages_name);
+
+  for (int i = 0; i < n_libs (n); i++)
+    {
+      char *name = g_strdup_printf ("bench-lib-%04d", i);
+      write_lib_stanza (f, i, "1.0");
+      write_archive_fields (f, name, "1.0");
+      fprintf (f, "\n");
+      g_free (name);
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+      char *name = g_strdup_printf ("bench-app-%05d", i);
+      write_app_stanza (f, i, n, "2.0");
+      write_archive_fields (f, name, "2.0");
+      fprintf (f, "\n");
+      g_free (name);
+    }
+  close_file (f);
+
+  f = open_file (root, "var/lib/dpkg/status");
+  for (int i = 0; i < n_libs (n); i++)
+    {
+      write_lib_stanza (f, i, "1.0");
+      fprintf (f, "Status: install ok installed\n\n");
+    }
+  for (int i = 0; i < n; i++)
+    if (is_installed (i))
+      {
+	write_app_stanza (f, i, n, "1.0");
+	fprintf (f, "Status: install ok installed\n\n");
+      }
+  close_file (f);
+
+  f = open_file (root, "var/lib/dpkg/available");
+  close_file (f);
+
+  g_free (abs_root);
+}
+
+/** WRITING A REQUEST STREAM
+ */
+
+static apt_proto_encoder request;
+
+static void
+write_request (FILE *f, int cmd, int priority)
+{
+  apt_request_header req = { cmd, 0, request.get_len (), priority };
+  fwrite (&req, sizeof (req), 1, f);
+  fwrite (request.get_buf (), 1, request.get_len (), f);
+  request.reset ();
+}
+
+static void
+script (int n, const char *file)
+{
+  FILE *f = fopen (file, "w");
+  if (f == NULL)
+    fail ("%s: %s", file, strerror (errno));
+
+  request.reset ();
+  write_request (f, APTCMD_NOOP, APT_PRIORITY_INTERACTIVE);
+
+  request.encode_int (1);  // only_user
+  request.encode_int (0);  // only_installed
+  request.encode_int (0);  // only_available
+  request.encode_int (0);  // show_magic_sys
+  request.encode_int (0);  // known_generation
+  write_request (f, APTCMD_GET_PACKAGE_LIST_DELTA, APT_PRIORITY_INTERACTIVE);
+
+  for (int i = 0; i < n; i += BENCH_INFO_BATCH)
+    {
+      request.encode_int (0);  // only_installable_info
+      for (int j = i; j < n && j < i + BENCH_INFO_BATCH; j++)
+	{
+	  char *name = g_strdup_printf ("bench-app-%05d", j);
+	  request.encode_string (name);
+	  g_free (name);
+	}
+      request.encode_string (NULL);
+      write_request (f, APTCMD_GET_PACKAGE_INFOS, APT_PRIORITY_BACKGROUND);
+    }
+
+  for (int i = 0; i < BENCH_DETAILS; i++)
+    {
+      char *name = g_strdup_printf ("bench-app-%05d", (i * 37) % n);
+
+      request.encode_string (name);
+      request.encode_string ("2.0");
+      request.encode_int (1);  // summary_kind: install
+      write_request (f, APTCMD_GET_PACKAGE_DETAILS, APT_PRIORITY_INTERACTIVE);
+
+      request.encode_string (name);
+      write_request (f, APTCMD_INSTALL_CHECK, APT_PRIORITY_INTERACTIVE);
+
+      g_free (name);
+    }
+
+  write_request (f, APTCMD_GET_CATALOGUES, APT_PRIORITY_INTERACTIVE);
+  write_request (f, APTCMD_GET_FREE_SPACE, APT_PRIORITY_INTERACTIVE);
+
+  if (ferror (f) | fclose (f))
+    fail ("%s: %s", file, strerror (errno));
+}
+
+/** REPLAYING A REQUEST STREAM
+ */
+
+struct recorded_request {
+  apt_request_header hdr;
+  char *data;
+};
+
+struct command_stats {
+  GArray *latencies;    // of double, in milliseconds
+  long long response_bytes;
+};
+
+static GArray *
+read_requests (const char *file)
+{
+  GArray *requests = g_array_new (FALSE, FALSE, sizeof (recorded_request));
+  FILE *f = fopen (file, "r");
+  recorded_request r;
+
+  if (f == NULL)
+    fail ("%s: %s", file, strerror (errno));
+
+  while (fread (&r.hdr, sizeof (r.hdr), 1, f) == 1)
+    {
+      if (r.hdr.cmd < 0 || r.hdr.cmd >= APTCMD_MAX || r.hdr.len < 0)
+	fail ("%s: corrupted", file);
+
+      r.data = new char[r.hdr.len + 1];
+      if (fread (r.data, 1, r.hdr.len, f) != (size_t) r.hdr.len)
+	fail ("%s: truncated", file);
+      g_array_append_val (requests, r);
+    }
+
+  fclose (f);
+  return requests;
+}
+
+static int to_fd, from_fd, status_fd, cancel_fd;
+static pid_t worker_pid;
+
+static void
+must_write (int fd, const void *buf, size_t n)
+{
+  const char *ptr = (const char *) buf;
+
+  while (n > 0)
+    {
+      ssize_t r = write (fd, ptr, n);
+      if (r < 0 && errno == EINTR)
+	continue;
+      if (r <= 0)
+	fail ("write: %s", strerror (errno));
+      ptr += r;
+      n -= r;
+    }
+}
+
+/* Read N bytes from FROM_FD.  Whatever comes in on STATUS_FD in the
+   mean time, which is the dpkg progress, is thrown away.
+*/
+static void
+must_read (void *buf, size_t n)
+{
+  char *ptr = (char *) buf;
+
+  while (n > 0)
+    {
+      fd_set set;
+      FD_ZERO (&set);
+      FD_SET (from_fd, &set);
+      FD_SET (status_fd, &set);
+
+      if (select (MAX (from_fd, status_fd) + 1, &set, NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  fail ("select: %s", strerror (errno));
+	}
+
+      if (FD_ISSET (status_fd, &set))
+	{
+	  char junk[1024];
+	  if (read (status_fd, junk, sizeof (junk)) < 0 && errno != EAGAIN)
+	    fail ("read: %s", strerror (errno));
+	}
+
+      if (FD_ISSET (from_fd, &set))
+	{
+	  ssize_t r = read (from_fd, ptr, n);
+	  if (r < 0 && (errno == EINTR || errno == EAGAIN))
+	    continue;
+	  if (r < 0)
+	    fail ("read: %s", strerror (errno));
+	  if (r == 0)
+	    fail ("apt-worker has exited");
+	  ptr += r;
+	  n -= r;
+	}
+    }
+}
+
+/* Read responses until the one for SEQ arrives and return its
+   length.  Status responses are skipped.
+*/
+static int
+read_response (int seq)
+{
+  static char *buf = NULL;
+  static int buf_len = 0;
+
+  while (true)
+    {
+      apt_response_header res;
+
+      must_read (&res, sizeof (res));
+      if (res.len > buf_len)
+	{
+	  delete[] buf;
+	  buf_len = res.len;
+	  buf = new char[buf_len];
+	}
+      must_read (buf, res.len);
+
+      if (res.seq == seq)
+	return res.len;
+    }
+}
+
+static void
+start_worker (const char *root)
+{
+  const char *worker = getenv ("APT_WORKER");
+  char tmpl[] = "/tmp/apt-worker-bench.XXXXXX";
+  char *dir, *to, *from, *status, *cancel, *domains, *apt_config;
+
+  if (worker == NULL)
+    worker = "./apt-worker";
+
+  dir = mkdtemp (tmpl);
+  if (dir == NULL)
+    fail ("mkdtemp: %s", strerror (errno));
+
+  to = g_build_filename (dir, "to", NULL);
+  from = g_build_filename (dir, "from", NULL);
+  status = g_build_filename (dir, "status", NULL);
+  cancel = g_build_filename (dir, "cancel", NULL);
+
+  if (mkfifo (to, 0600) < 0 || mkfifo (from, 0600) < 0
+      || mkfifo (status, 0600) < 0 || mkfifo (cancel, 0600) < 0)
+    fail ("mkfifo: %s", strerror (errno));
+
+  domains = g_strconcat (root, "/domains/", NULL);
+  apt_config = g_build_filename (root, "etc/apt/apt.conf", NULL);
+
+  if ((worker_pid = fork ()) < 0)
+    fail ("fork: %s", strerror (errno));
+
+  if (worker_pid == 0)
+    {
+      setenv ("APT_CONFIG", apt_config, 1);
+      execl (worker, worker, "bench", to, from, status, cancel, "",
+	     domains, (char *) NULL);
+      fprintf (stderr, "apt-worker-bench: %s: %s\n", worker, strerror (errno));
+      _exit (1);
+    }
+
+  /* This follows the dance in apt-worker-client.cc.
+   */
+  from_fd = open (from, O_RDONLY | O_NONBLOCK);
+  status_fd = open (status, O_RDONLY | O_NONBLOCK);
+  if (from_fd < 0 || status_fd < 0)
+    fail ("open: %s", strerror (errno));
+
+  /* The first status tells us that the apt-worker has opened its
+     fifos.
+  */
+  read_response (-1);
+
+  to_fd = open (to, O_WRONLY);
+  cancel_fd = open (cancel, O_WRONLY);
+  if (to_fd < 0 || cancel_fd < 0)
+    fail ("open: %s", strerror (errno));
+
+  unlink (to);
+  unlink (from);
+  unlink (status);
+  unlink (cancel);
+  rmdir (dir);
+
+  g_free (to);
+  g_free (from);
+  g_free (status);
+  g_free (cancel);
+  g_free (domains);
+  g_free (apt_config);
+}
+
+/* Return the peak resident set size of the apt-worker in kilobytes,
+   or -1 if it can't be found out.
+*/
+static int
+worker_peak_rss ()
+{
+  char *file = g_strdup_printf ("/proc/%d/status", worker_pid);
+  char *contents = NULL;
+  int kb = -1;
+
+  if (g_file_get_contents (file, &contents, NULL, NULL))
+    {
+      char *line = strstr (contents, "VmHWM:");
+      if (line)
+	kb = atoi (line + strlen ("VmHWM:"));
+      g_free (contents);
+    }
+
+  g_free (file);
+  return kb;
+}
+
+static void
+stop_worker ()
+{
+  apt_request_header req = { APTCMD_EXIT, -2, 0, APT_PRIORITY_INTERACTIVE };
+  int status;
+
+  must_write (to_fd, &req, sizeof (req));
+  close (to_fd);
+  close (cancel_fd);
+
+  while (waitpid (worker_pid, &status, 0) < 0 && errno == EINTR)
+    ;
+}
+
+static double
+send_request (int seq, apt_request_header *hdr, const char *data, int *len)
+{
+  GTimer *timer = g_timer_new ();
+  apt_request_header req = *hdr;
+  double elapsed;
+
+  req.seq = seq;
+  must_write (to_fd, &req, sizeof (req));
+  must_write (to_fd, data, req.len);
+  *len = read_response (seq);
+
+  elapsed = g_timer_elapsed (timer, NULL) * 1000.0;
+  g_timer_destroy (timer);
+  return elapsed;
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile (GArray *sorted, double p)
+{
+  int i = (int) (p * sorted->len + 0.999999) - 1;
+  if (i < 0)
+    i = 0;
+  return g_array_index (sorted, double, i);
+}
+
+static void
+replay (const char *root, const char *file, int rounds)
+{
+  GArray *requests = read_requests (file);
+  command_stats stats[APTCMD_MAX];
+  apt_request_header noop = { APTCMD_NOOP, 0, 0, APT_PRIORITY_INTERACTIVE };
+  int seq = 0, len;
+  double startup;
+
+  if (geteuid () == 0)
+    fail ("don't run this as root");
+
+  for (int i = 0; i < APTCMD_MAX; i++)
+    {
+      stats[i].latencies = g_array_new (FALSE, FALSE, sizeof (double));
+      stats[i].response_bytes = 0;
+    }
+
+  start_worker (root);
+
+  /* The apt-worker opens the cache before handling the first
+     request.
+  */
+  startup = send_request (seq++, &noop, NULL, &len);
+
+  for (int r = 0; r < rounds; r++)
+    for (guint i = 0; i < requests->len; i++)
+      {
+	recorded_request *req = &g_array_index (requests, recorded_request, i);
+	int cmd = req->hdr.cmd;
+
+	if (cmd == APTCMD_EXIT)
+	  continue;
+
+	double ms = send_request (seq++, &req->hdr, req->data, &len);
+	g_array_append_val (stats[cmd].latencies, ms);
+	stats[cmd].response_bytes += len;
+      }
+
+  int peak_rss = worker_peak_rss ();
+  stop_worker ();
+
+  printf ("startup: %.3f ms\n", startup);
+  if (peak_rss >= 0)
+    printf ("peak RSS: %d kB\n", peak_rss);
+  else
+    printf ("peak RSS: unknown\n");
+  printf ("\n%-28s %6s %10s %10s %10s %12s\n",
+	  "command", "count", "p50 ms", "p95 ms", "p99 ms", "bytes/resp");
+
+  for (int i = 0; i < APTCMD_MAX; i++)
+    {
+      GArray *l = stats[i].latencies;
+
+      if (l->len > 0)
+	{
+	  qsort (l->data, l->len, sizeof (double), compare_doubles);
+	  printf ("%-28s %6d %10.3f %10.3f %10.3f %12lld\n",
+		  apt_proto_command_name (i), l->len,
+		  percentile (l, 0.50), percentile (l, 0.95),
+		  percentile (l, 0.99),
+		  stats[i].response_bytes / l->len);
+	}
+
+      g_array_free (l, TRUE);
+    }
+
+  for (guint i = 0; i < requests->len; i++)
+    delete[] g_array_index (requests, recorded_request, i).data;
+  g_array_free (requests, TRUE);
+}
+
+/** DECODING PACKAGE LIST STRINGS
+ */
+
+/* The strings of one entry of a package list reply that the frontend
+   keeps, see get_package_list_entry_1 in main.cc.  The icons are
+   turned into pixbufs there and are not kept here.
+*/
+#define BENCH_ENTRY_STRINGS 9
+
+struct bench_entry {
+  char *strings[BENCH_ENTRY_STRINGS];
+};
+
+static void
+encode_package_list (apt_proto_encoder *enc, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      char *name = g_strdup_printf ("bench-app-%05d", i);
+      char *pretty = g_strdup_printf ("Bench App %d", i);
+      char *desc = g_strdup_printf ("Does useful thing number %d", i);
+
+      enc->encode_string (name);
+      enc->encode_int (0);                     // broken
+      enc->encode_string (is_installed (i)? "1.0-1" : NULL);
+      enc->encode_int64 (is_installed (i)? 1024 * i : 0);
+      enc->encode_string (is_installed (i)? sections[i % 7] : NULL);
+      enc->encode_string (is_installed (i)? pretty : NULL);
+      enc->encode_string (is_installed (i)? desc : NULL);
+      enc->encode_string (NULL);               // installed icon
+      enc->encode_string ("1.1-1");
+      enc->encode_string (sections[i % 7]);
+      enc->encode_string (pretty);
+      enc->encode_string (desc);
+      enc->encode_string (NULL);               // available icon
+      enc->encode_int (0);                     // flags
+
+      g_free (desc);
+      g_free (pretty);
+      g_free (name);
+    }
+}
+
+/* Decode the entries from DEC into ENTRIES with the same decoder as
+   the frontend, copying the strings with COPY.
+*/
+static void
+decode_package_list (apt_proto_decoder *dec, bench_entry *entries,
+		     char *(*copy) (const char *str, void *data), void *data)
+{
+  apt_proto_package_list_entry e;
+
+  for (int i = 0; !dec->at_end (); i++)
+    {
+      char **s = entries[i].strings;
+
+      apt_proto_decode_package_list_entry (dec,
+					   dec->decode_string_in_place (),
+					   &e);
+      s[0] = copy (e.name, data);
+      s[1] = copy (e.installed_version, data);
+      s[2] = copy (e.installed_section, data);
+      s[3] = copy (e.installed_pretty_name, data);
+      s[4] = copy (e.installed_short_description, data);
+      s[5] = copy (e.available_version, data);
+      s[6] = copy (e.available_section, data);
+      s[7] = copy (e.available_pretty_name, data);
+      s[8] = copy (e.available_short_description, data);
+    }
+}
+
+static char *
+copy_with_strdup (const char *str, void *data)
+{
+  return g_strdup (str);
+}
+
+static char *
+copy_into_chunk (const char *str, void *data)
+{
+  if (str == NULL)
+    return NULL;
+  return g_string_chunk_insert ((GStringChunk *) data, str);
+}
+
+static void
+strings (int n, int rounds)
+{
+  apt_proto_encoder enc;
+  bench_entry *entries = g_new (bench_entry, n);
+  double decode_ms[2] = { 0, 0 }, free_ms[2] = { 0, 0 };
+
+  if (n < 1)
+    usage ();
+  if (rounds < 1)
+    rounds = 1;
+
+  encode_package_list (&enc, n);
+
+  GTimer *timer = g_timer_new ();
+  for (int r = 0; r < rounds; r++)
+    {
+      apt_proto_decoder dec (enc.get_buf (), enc.get_len ());
+
+      g_timer_start (timer);
+      decode_package_list (&dec, entries, copy_with_strdup, NULL);
+      decode_ms[0] += g_timer_elapsed (timer, NULL) * 1000.0;
+
+      g_timer_start (timer);
+      for (int i = 0; i < n; i++)
+	for (int j = 0; j < BENCH_ENTRY_STRINGS; j++)
+	  g_free (entries[i].strings[j]);
+      free_ms[0] += g_timer_elapsed (timer, NULL) * 1000.0;
+
+      dec.reset (enc.get_buf (), enc.get_len ());
+
+      g_timer_start (timer);
+      GStringChunk *chunk = g_string_chunk_new (16 * 1024);
+      decode_package_list (&dec, entries, copy_into_chunk, chunk);
+      decode_ms[1] += g_timer_elapsed (timer, NULL) * 1000.0;
+
+      g_timer_start (timer);
+      g_string_chunk_free (chunk);
+      free_ms[1] += g_timer_elapsed (timer, NULL) * 1000.0;
+    }
+  g_timer_destroy (timer);
+  g_free (entries);
+
+  const char *names[] = { "strdup/free", "GStringChunk" };
+  printf ("%d packages, %d bytes\n", n, enc.get_len ());
+  printf ("%-14s %14s %14s\n", "method", "decode avg ms", "free avg ms");
+  for (int i = 0; i < 2; i++)
+    printf ("%-14s %14.3f %14.3f\n", names[i],
+	    decode_ms[i] / rounds, free_ms[i] / rounds);
+}
+
+/** READING CONTROL RECORDS
+ */
+
+/* The old way, as get_deb_record did it, including growing the
+   buffer by 2000 bytes at a time, but without the quoting since this
+   is only a benchmark.
+*/
+static size_t
+control_with_dpkg_deb (const char *deb)
+{
+  char *cmd = g_strdup_printf ("/usr/bin/dpkg-deb -f '%s'", deb);
+  FILE *f = popen (cmd, "r");
+
+  g_free (cmd);
+  if (f == NULL)
+    fail ("can't run dpkg-deb: %s", strerror (errno));
+
+  const size_t incr = 2000;
+  char *record = NULL;
+  size_t size = 0;
+
+  do
+    {
+      char *new_record = new char[size + incr + 3];
+      if (record)
+	{
+	  memcpy (new_record, record, size);
+	  delete [] record;
+	}
+      record = new_record;
+
+      size += fread (record + size, 1, incr, f);
+    }
+  while (!feof (f));
+
+  if (pclose (f) != 0)
+    fail ("dpkg-deb -f %s failed", deb);
+
+  delete [] record;
+  return size;
+}
+
+static size_t
+control_in_process (const char *deb)
+{
+  debDebFile::MemControlExtract control ("control");
+  int fd = open (deb, O_RDONLY);
+
+  if (fd < 0)
+    fail ("%s: %s", deb, strerror (errno));
+
+  if (!read_deb_control (fd, control))
+    {
+      _error->DumpErrors ();
+      fail ("%s: can't read control record", deb);
+    }
+
+  close (fd);
+  return control.Length;
+}
+
+static void
+control (const char *deb, int rounds)
+{
+  struct {
+    const char *name;
+    size_t (*read) (const char *deb);
+  } readers[] = {
+    { "dpkg-deb -f", control_with_dpkg_deb },
+    { "in-process", control_in_process },
+  };
+
+  pkgInitConfig (*_config);
+  pkgInitSystem (*_config, _system);
+
+  if (rounds < 1)
+    rounds = 1;
+
+  printf ("%-12s %10s %10s\n", "reader", "avg ms", "bytes");
+  for (size_t i = 0; i < G_N_ELEMENTS (readers); i++)
+    {
+      GTimer *timer = g_timer_new ();
+      size_t size = 0;
+
+      for (int r = 0; r < rounds; r++)
+	size = readers[i].read (deb);
+
+      printf ("%-12s %10.3f %10d\n", readers[i].name,
+	      g_timer_elapsed (timer, NULL) * 1000.0 / rounds, (int) size);
+      g_timer_destroy (timer);
+    }
+}
+
+/** LOOKING UP PACKAGES BY NAME
+ */
+
+static void
+lookup (int n)
+{
+  GList *list = NULL;
+  GHashTable *table = g_hash_table_new (g_str_hash, g_str_equal);
+  char **names = g_new (char *, n);
+  int found;
+
+  if (n < 1)
+    usage ();
+
+  /* The frontend looks up the names of search results, which come in
+     no particular order relative to the list.
+  */
+  for (int i = 0; i < n; i++)
+    {
+      names[i] = g_strdup_printf ("bench-app-%05d", i);
+      list = g_list_prepend (list, names[i]);
+      g_hash_table_replace (table, names[i], names[i]);
+    }
+
+  GTimer *timer = g_timer_new ();
+  found = 0;
+  for (int i = 0; i < n; i++)
+    {
+      const char *name = names[(i * 7919) % n];
+      for (GList *l = list; l; l = l->next)
+	if (!strcmp ((const char *) l->data, name))
+	  found++;
+    }
+  double list_ms = g_timer_elapsed (timer, NULL) * 1000.0;
+  if (found != n)
+    fail ("GList lookup found %d of %d", found, n);
+
+  g_timer_start (timer);
+  found = 0;
+  for (int i = 0; i < n; i++)
+    if (g_hash_table_lookup (table, names[(i * 7919) % n]))
+      found++;
+  double table_ms = g_timer_elapsed (timer, NULL) * 1000.0;
+  g_timer_destroy (timer);
+  if (found != n)
+    fail ("GHashTable lookup found %d of %d", found, n);
+
+  printf ("%d lookups in %d packages\n", n, n);
+  printf ("%-12s %12s %12s\n", "method", "total ms", "us/lookup");
+  printf ("%-12s %12.3f %12.3f\n", "GList", list_ms, list_ms * 1000.0 / n);
+  printf ("%-12s %12.3f %12.3f\n", "GHashTable", table_ms,
+	  table_ms * 1000.0 / n);
+
+  g_hash_table_destroy (table);
+  g_list_free (list);
+  for (int i = 0; i < n; i++)
+    g_free (names[i]);
+  g_free (names);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc < 2)
+    usage ();
+
+  if (!strcmp (argv[1], "generate") && argc == 4)
+    generate (argv[2], atoi (argv[3]));
+  else if (!strcmp (argv[1], "script") && argc == 4)
+    script (atoi (argv[2]), argv[3]);
+  else if (!strcmp (argv[1], "replay") && (argc == 4 || argc == 5))
+    replay (argv[2], argv[3], argc == 5 ? atoi (argv[4]) : 1);
+  else if (!strcmp (argv[1], "strings") && (argc == 3 || argc == 4))
+    strings (atoi (argv[2]), argc == 4 ? atoi (argv[3]) : 1);
+  else if (!strcmp (argv[1], "control") && (argc == 3 || argc == 4))
+    control (argv[2], argc == 4 ? atoi (argv[3]) : 1);
+  else if (!strcmp (argv[1], "lookup") && argc == 3)
+    lookup (atoi (argv[2]));
+  else
+    usage ();
+
+  return 0;
+}
@@ -22,6 +22,7 @@
  */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
@@ -40,6 +41,8 @@
 #include "settings.h"
 #include "apt-worker-client.h"
 #include "apt-worker-proto.h"
+#include "main.h"
+#include "trace.h"
 
 #define _(x) gettext (x)
 
@@ -189,6 +192,40 @@ add_apt_worker_handler ()
   g_io_channel_unref (channel);
 }
 
+struct cache_changed_cont {
+  void (*cont) (void *data);
+  void *data;
+};
+
+static GSList *cache_changed_conts = NULL;
+
+void
+apt_worker_when_cache_changed (void (*cont) (void *data), void *data)
+{
+  cache_changed_cont *c = new cache_changed_cont;
+  c->cont = cont;
+  c->data = data;
+  cache_changed_conts = g_slist_append (cache_changed_conts, c);
+}
+
+/* The continuations might register themselves again, for the next
+   time.
+*/
+static void
+run_cache_changed_conts ()
+{
+  GSList *conts = cache_changed_conts;
+  cache_changed_conts = NULL;
+
+  for (GSList *l = conts; l; l = l->next)
+    {
+      cache_changed_cont *c = (cache_changed_cont *)l->data;
+      c->cont (c->data);
+      delete c;
+    }
+  g_slist_free (conts);
+}
+
 static void
 notice_apt_worker_failure ()
 {
@@ -204,6 +241,10 @@ notice_apt_worker_failure ()
 
   cancel_all_pending_worker_calls ();
 
+  /* A new apt-worker will open a fresh cache.
+   */
+  run_cache_changed_conts ();
+
   what_the_fock_p ();
 }
 
@@ -336,6 +377,38 @@ apt_status_callback (int cmd, apt_proto_decoder *dec, void *unused)
   int already = dec->decode_int ();
   int total = dec->decode_int ();
 
+  if (op == op_catalogue)
+    {
+      dec->decode_int ();  // catalogue
+      int failed = dec->decode_int ();
+      int elapsed = dec->decode_int ();
+      bool finished = dec->decode_int ();
+      const char *name = dec->decode_string_in_place ();
+
+      if (finished && !dec->corrupted ())
+	add_log ("%s: %d files, %d failed, %d.%03d s\n", name,
+		 total, failed, elapsed / 1000, elapsed % 1000);
+      return;
+    }
+
+  if (op == op_cache_changed)
+    {
+      run_cache_changed_conts ();
+      package_cache_changed ();
+      return;
+    }
+
+  if (op == op_verifying)
+    {
+      int elapsed = dec->decode_int ();
+      bool finished = dec->decode_int ();
+
+      if (finished && !dec->corrupted ())
+	add_log ("verified %d archives in %d.%03d s\n",
+		 total, elapsed / 1000, elapsed % 1000);
+      return;
+    }
+
   if (total > 0)
     {
       if (op == op_downloading)
@@ -350,6 +423,11 @@ apt_status_callback (int cmd, apt_proto_decoder *dec, void *unused)
     }
 }
 
+static void
+ignore_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+}
+
 void
 maybe_start_apt_worker (void)
 {
@@ -364,6 +442,11 @@ maybe_start_apt_worker (void)
 
   /* Everything went fine if reached */
   apt_worker_set_status_callback (apt_status_callback, NULL);
+
+  /* Let the new apt-worker add its events to our trace.
+   */
+  if (trace_file ())
+    apt_worker_set_trace_file (trace_file (), ignore_reply, NULL);
 }
 
 void
@@ -431,10 +514,43 @@ apt_worker_is_running ()
   return apt_worker_in_fd > 0;
 }
 
+/* When the environment variable HAM_RECORD_REQUESTS names a file,
+   all requests are appended to it in the same format as they are
+   sent to the apt-worker.  Such a recording can be replayed with
+   apt-worker-bench.
+*/
+static void
+record_apt_worker_request (apt_request_header *req, char *data, int len)
+{
+  static FILE *record_file = NULL;
+  static bool record_file_opened = false;
+
+  if (!record_file_opened)
+    {
+      const char *name = getenv ("HAM_RECORD_REQUESTS");
+      record_file_opened = true;
+      if (name)
+	{
+	  record_file = fopen (name, "a");
+	  if (record_file == NULL)
+	    add_log ("%s: %s\n", name, strerror (errno));
+	}
+    }
+
+  if (record_file)
+    {
+      fwrite (req, sizeof (*req), 1, record_file);
+      fwrite (data, 1, len, record_file);
+      fflush (record_file);
+    }
+}
+
 static bool
-send_apt_worker_request (int cmd, int seq, char *data, int len)
+send_apt_worker_request (int cmd, int seq, int priority,
+			 char *data, int len)
 {
-  apt_request_header req = { cmd, seq, len };
+  apt_request_header req = { cmd, seq, len, priority };
+  record_apt_worker_request (&req, data, len);
   return must_write (&req, sizeof (req)) &&  must_write (data, len);
 }
 
@@ -453,6 +569,7 @@ struct worker_call {
 
   int cmd;
   int seq;
+  int priority;
   char *data;
   int len;
 
@@ -460,8 +577,28 @@ struct worker_call {
   void *done_data;
 };
 
-static worker_call *pending_calls, **pending_tail = &pending_calls;
-static worker_call *active_call;
+/* Requests are sent to the apt-worker as soon as possible, without
+   waiting for the replies to the earlier ones.  This keeps the
+   apt-worker busy while we are handling a reply.  The replies are
+   matched to their calls via ACTIVE_CALLS, which maps sequence
+   numbers to calls, since the apt-worker lets more urgent requests
+   overtake less urgent ones.  Requests that are waiting to be sent
+   are kept in PENDING_CALLS, most urgent first.
+
+   Writing a request must never block: the apt-worker might be
+   blocked itself on writing a reply that we would not read.  Thus, at
+   most MAX_CALLS_IN_FLIGHT requests with at most MAX_BYTES_IN_FLIGHT
+   bytes are outstanding, which fits into the pipe buffer.  Bigger
+   requests are only sent when nothing else is outstanding, and
+   writing them might block, just as before.
+*/
+
+#define MAX_CALLS_IN_FLIGHT  8
+#define MAX_BYTES_IN_FLIGHT  (16 * 1024)
+
+static worker_call *pending_calls;
+static GHashTable *active_calls;
+static int bytes_in_flight;
 
 static worker_call *
 get_next_pending_worker_call ()
@@ -471,8 +608,6 @@ get_next_pending_worker_call ()
     {
       pending_calls = c->next;
       c->next = NULL;
-      if (pending_tail == &(c->next))
-	pending_tail = &pending_calls;
     }
   return c;
 }
@@ -487,38 +622,97 @@ cancel_worker_call (worker_call *c)
   delete c;
 }
 
-static void
-maybe_send_one_worker_call ()
+static int
+n_active_calls ()
+{
+  return active_calls ? g_hash_table_size (active_calls) : 0;
+}
+
+static bool
+can_send_worker_call (int len)
 {
+  int n = n_active_calls ();
+
   if (!apt_worker_ready)
-    return;
+    return false;
+
+  return (n == 0
+	  || (n < MAX_CALLS_IN_FLIGHT
+	      && (bytes_in_flight + len + (int) sizeof (apt_request_header)
+		  <= MAX_BYTES_IN_FLIGHT)));
+}
+
+/* Send the request for C from DATA and LEN, which might or might not
+   be C->data and C->len.  Returns false when C has been cancelled.
+*/
+static bool
+send_worker_call (worker_call *c, char *data, int len)
+{
+  const char *name = apt_proto_command_name (c->cmd);
+
+  trace_begin (name, c->seq);
+  trace_request_sent (c->seq);
+  bool sent = send_apt_worker_request (c->cmd, c->seq, c->priority,
+				       data, len);
+  trace_end (name);
+
+  if (!sent)
+    {
+      what_the_fock_p ();
+      cancel_worker_call (c);
+      return false;
+    }
+
+  g_free (c->data);
+  c->data = NULL;
+  c->len = len + sizeof (apt_request_header);
+  bytes_in_flight += c->len;
+
+  if (active_calls == NULL)
+    active_calls = g_hash_table_new (NULL, NULL);
+  g_hash_table_insert (active_calls, GINT_TO_POINTER (c->seq), c);
+  return true;
+}
 
-  while (active_call == NULL)
+static void
+maybe_send_one_worker_call ()
+{
+  while (pending_calls && can_send_worker_call (pending_calls->len))
     {
       worker_call *c = get_next_pending_worker_call ();
-      if (c == NULL)
-        return;
-
-      if (!send_apt_worker_request (c->cmd, c->seq, c->data, c->len))
-        {
-          what_the_fock_p ();
-          cancel_worker_call (c);
-        }
-      else
-        {
-          g_free (c->data);
-          c->data = NULL;
-          active_call = c;
-        }
+      send_worker_call (c, c->data, c->len);
     }
 }
 
+/* Queue C behind all pending calls that are at least as urgent.
+ */
+static void
+queue_worker_call (worker_call *c)
+{
+  worker_call **p = &pending_calls;
+
+  while (*p && (*p)->priority <= c->priority)
+    p = &((*p)->next);
+
+  c->next = *p;
+  *p = c;
+}
+
 // @todo should this function be exported? It used to have a different
 // signature!! 
 void
 call_apt_worker (int cmd, char *data, int len,
                  apt_worker_callback *done_callback,
                  void *done_data)
+{
+  call_apt_worker_with_priority (cmd, APT_PRIORITY_INTERACTIVE,
+				 data, len, done_callback, done_data);
+}
+
+void
+call_apt_worker_with_priority (int cmd, int priority, char *data, int len,
+			       apt_worker_callback *done_callback,
+			       void *done_data)
 {
   assert (cmd >= 0 && cmd < APTCMD_MAX);
 
@@ -536,12 +730,20 @@ call_apt_worker (int cmd, char *data, int len,
   worker_call *c = new worker_call;
   c->cmd = cmd;
   c->seq = next_seq ();
+  c->priority = priority;
   c->done_callback = done_callback;
   c->done_data = done_data;
+  c->data = NULL;
+  c->next = NULL;
 
-  /* XXX - If we can send the request immediately, we don't need to
-           copy DATA.
+  /* If we can send the request immediately, we don't need to copy
+     DATA.
   */
+  if (pending_calls == NULL && can_send_worker_call (len))
+    {
+      send_worker_call (c, data, len);
+      return;
+    }
 
   c->len = len;
   if (len > 0)
@@ -549,31 +751,53 @@ call_apt_worker (int cmd, char *data, int len,
       c->data = (char *)g_malloc (len);
       memcpy (c->data, data, len);
     }
-  else
-    c->data = NULL;
 
-  c->next = NULL;
-  *pending_tail = c;
-  pending_tail = &(c->next);
+  queue_worker_call (c);
+}
 
-  maybe_send_one_worker_call ();
+static void
+collect_active_call (gpointer key, gpointer value, gpointer data)
+{
+  GList **calls = (GList **)data;
+  *calls = g_list_prepend (*calls, value);
 }
 
+static gint
+compare_call_seqs (gconstpointer a, gconstpointer b)
+{
+  return ((worker_call *)a)->seq - ((worker_call *)b)->seq;
+}
 
 static void
 cancel_all_pending_worker_calls ()
 {
-  if (active_call)
+  GList *calls = NULL;
+
+  if (active_calls)
     {
-      cancel_worker_call (active_call);
-      active_call = NULL;
+      g_hash_table_foreach (active_calls, collect_active_call, &calls);
+      g_hash_table_remove_all (active_calls);
+      bytes_in_flight = 0;
     }
 
+  calls = g_list_sort (calls, compare_call_seqs);
+  for (GList *l = calls; l; l = l->next)
+    cancel_worker_call ((worker_call *)l->data);
+  g_list_free (calls);
+
   worker_call *c;
   while ((c = get_next_pending_worker_call ()))
     cancel_worker_call (c);
 }
 
+static bool reply_is_stale = false;
+
+bool
+apt_worker_reply_is_stale ()
+{
+  return reply_is_stale;
+}
+
 void
 handle_one_apt_worker_response ()
 {
@@ -622,20 +846,35 @@ handle_one_apt_worker_response ()
       return;
     }
 
-  if (active_call == NULL || active_call->seq != res.seq)
+  worker_call *c = NULL;
+  if (active_calls)
+    c = (worker_call *) g_hash_table_lookup (active_calls,
+					     GINT_TO_POINTER (res.seq));
+  if (c == NULL)
     {
-      fprintf (stderr, "ignoring out of sequence reply.\n");
+      fprintf (stderr, "ignoring reply for unknown request %d.\n", res.seq);
       return;
     }
-  
+
+  g_hash_table_remove (active_calls, GINT_TO_POINTER (res.seq));
+  bytes_in_flight -= c->len;
+
+  /* The apt-worker has read the request, so there is room for the
+     next ones.
+  */
+  maybe_send_one_worker_call ();
+
+  const char *name = apt_proto_command_name (res.cmd);
+
   running = true;
-  worker_call *c = active_call;
-  active_call = NULL;
+  reply_is_stale = (res.flags & APT_RESPONSE_STALE) != 0;
+  trace_begin (name, res.seq);
+  trace_reply_received (res.seq);
   c->done_callback (res.cmd, &dec, c->done_data);
+  trace_end (name);
   delete c;
+  reply_is_stale = false;
   running = false;
-
-  maybe_send_one_worker_call ();
 }
 
 static apt_proto_encoder request;
@@ -679,6 +918,25 @@ apt_worker_get_package_list (bool only_user,
                    callback, data);
 }
 
+void
+apt_worker_get_package_list_delta (bool only_user,
+				   bool only_installed,
+				   bool only_available,
+				   bool show_magic_sys,
+				   int known_generation,
+				   apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (only_user);
+  request.encode_int (only_installed);
+  request.encode_int (only_available);
+  request.encode_int (show_magic_sys);
+  request.encode_int (known_generation);
+  call_apt_worker (APTCMD_GET_PACKAGE_LIST_DELTA,
+                   request.get_buf (), request.get_len (),
+                   callback, data);
+}
+
 static void
 apt_worker_update_cache_cont (int cmd, apt_proto_decoder *dec, void *data)
 {
@@ -754,6 +1012,21 @@ apt_worker_get_package_info (const char *package,
                    callback, data);
 }
 
+void
+apt_worker_get_package_infos (const char **packages,
+			      bool only_installable_info, int priority,
+			      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (only_installable_info);
+  for (int i = 0; packages[i]; i++)
+    request.encode_string (packages[i]);
+  request.encode_string (NULL);
+  call_apt_worker_with_priority (APTCMD_GET_PACKAGE_INFOS, priority,
+				 request.get_buf (), request.get_len (),
+				 callback, data);
+}
+
 void
 apt_worker_get_package_details (const char *package,
 				const char *version,
@@ -996,6 +1269,23 @@ apt_worker_autoremove (apt_worker_callback *callback,
                    callback, data);
 }
 
+void
+apt_worker_get_stats (apt_worker_callback *callback, void *data)
+{
+  call_apt_worker (APTCMD_GET_STATS, NULL, 0, callback, data);
+}
+
+void
+apt_worker_set_trace_file (const char *file,
+			   apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_string (file);
+  call_apt_worker (APTCMD_SET_TRACE_FILE,
+		   request.get_buf (), request.get_len (),
+		   callback, data);
+}
+
 static void exit_apt_worker_callback(int cmd, apt_proto_decoder *dec, void *data)
 {
 }
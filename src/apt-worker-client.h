@@ -50,10 +50,31 @@ void call_apt_worker (int cmd, char *data, int len,
 		      apt_worker_callback *done,
 		      void *done_data);
 
+/* Like call_apt_worker, but with a PRIORITY from apt_proto_priority
+   instead of APT_PRIORITY_INTERACTIVE.  More urgent requests are sent
+   first and the apt-worker lets them overtake less urgent ones.
+*/
+void call_apt_worker_with_priority (int cmd, int priority,
+				    char *data, int len,
+				    apt_worker_callback *done,
+				    void *done_data);
+
 bool apt_worker_is_running ();
 void send_apt_request (int cmd, int seq, char *data, int len);
 void handle_one_apt_worker_response ();
 
+/* Whether the reply that is being passed to a DONE callback has been
+   marked with APT_RESPONSE_STALE by the apt-worker.  Such a reply
+   comes from an old package cache, and the request can be repeated
+   from a continuation registered with apt_worker_when_cache_changed.
+*/
+bool apt_worker_reply_is_stale ();
+
+/* Call CONT with DATA once, when the next op_cache_changed status
+   arrives or when the apt-worker has failed.
+*/
+void apt_worker_when_cache_changed (void (*cont) (void *data), void *data);
+
 /* Specific commands.
  */
 
@@ -71,6 +92,14 @@ void apt_worker_get_package_list (bool only_user,
 				  apt_worker_callback *callback,
 				  void *data);
 
+void apt_worker_get_package_list_delta (bool only_user,
+					bool only_installed,
+					bool only_available,
+					bool show_magic_sys,
+					int known_generation,
+					apt_worker_callback *callback,
+					void *data);
+
 void apt_worker_update_cache (apt_worker_callback *callback,
 			      void *data);
 
@@ -93,6 +122,15 @@ void apt_worker_get_package_info (const char *package,
 				  apt_worker_callback *callback,
 				  void *data);
 
+/* PACKAGES is a NULL terminated array of package names.  PRIORITY is
+   from apt_proto_priority.
+ */
+void apt_worker_get_package_infos (const char **packages,
+				   bool only_installable_info,
+				   int priority,
+				   apt_worker_callback *callback,
+				   void *data);
+
 void apt_worker_get_package_details (const char *package,
 				     const char *version,
 				     int summary_kind,
@@ -158,6 +196,13 @@ void apt_worker_third_party_policy_check (const char *package,
 void apt_worker_autoremove (apt_worker_callback *callback,
                             void *data);
 
+void apt_worker_get_stats (apt_worker_callback *callback,
+			   void *data);
+
+void apt_worker_set_trace_file (const char *file,
+				apt_worker_callback *callback,
+				void *data);
+
 void exit_apt_worker ();
 
 #endif /* !APT_WORKER_CLIENT_H */
@@ -29,6 +29,48 @@
 
 #include "apt-worker-proto.h"
 
+static const char *command_names[] = {
+  "NOOP",
+  "STATUS",
+  "GET_PACKAGE_LIST",
+  "GET_PACKAGE_INFO",
+  "GET_PACKAGE_DETAILS",
+  "CHECK_UPDATES",
+  "GET_CATALOGUES",
+  "SET_CATALOGUES",
+  "ADD_TEMP_CATALOGUES",
+  "RM_TEMP_CATALOGUES",
+  "GET_FREE_SPACE",
+  "INSTALL_CHECK",
+  "DOWNLOAD_PACKAGE",
+  "INSTALL_PACKAGE",
+  "REMOVE_CHECK",
+  "REMOVE_PACKAGE",
+  "GET_FILE_DETAILS",
+  "INSTALL_FILE",
+  "CLEAN",
+  "SAVE_BACKUP_DATA",
+  "GET_SYSTEM_UPDATE_PACKAGES",
+  "FLASH_AND_REBOOT",
+  "SET_OPTIONS",
+  "SET_ENV",
+  "THIRD_PARTY_POLICY_CHECK",
+  "AUTOREMOVE",
+  "GET_PACKAGE_INFOS",
+  "GET_PACKAGE_LIST_DELTA",
+  "GET_STATS",
+  "SET_TRACE_FILE",
+  "EXIT"
+};
+
+const char *
+apt_proto_command_name (int cmd)
+{
+  if (cmd < 0 || cmd >= APTCMD_MAX)
+    return "UNKNOWN";
+  return command_names[cmd];
+}
+
 apt_proto_encoder::apt_proto_encoder ()
 {
   buf = NULL;
@@ -47,6 +89,13 @@ apt_proto_encoder::reset ()
   len = 0;
 }
 
+void
+apt_proto_encoder::truncate (int new_len)
+{
+  if (new_len < len)
+    len = new_len;
+}
+
 char *
 apt_proto_encoder::get_buf ()
 {
@@ -294,3 +343,24 @@ apt_proto_decoder::decode_xexp ()
   else
     return xexp_text_new (tag, decode_string_in_place ());
 }
+
+void
+apt_proto_decode_package_list_entry (apt_proto_decoder *dec,
+				     const char *name,
+				     apt_proto_package_list_entry *entry)
+{
+  entry->name = name;
+  entry->broken = dec->decode_int ();
+  entry->installed_version = dec->decode_string_in_place ();
+  entry->installed_size = dec->decode_int64 ();
+  entry->installed_section = dec->decode_string_in_place ();
+  entry->installed_pretty_name = dec->decode_string_in_place ();
+  entry->installed_short_description = dec->decode_string_in_place ();
+  entry->installed_icon = dec->decode_string_in_place ();
+  entry->available_version = dec->decode_string_in_place ();
+  entry->available_section = dec->decode_string_in_place ();
+  entry->available_pretty_name = dec->decode_string_in_place ();
+  entry->available_short_description = dec->decode_string_in_place ();
+  entry->available_icon = dec->decode_string_in_place ();
+  entry->flags = dec->decode_int ();
+}
@@ -70,21 +70,56 @@ enum apt_command {
 
   APTCMD_AUTOREMOVE,
 
+  APTCMD_GET_PACKAGE_INFOS,
+  APTCMD_GET_PACKAGE_LIST_DELTA,
+
+  APTCMD_GET_STATS,
+  APTCMD_SET_TRACE_FILE,
+
   APTCMD_EXIT,
 
   APTCMD_MAX
 };
 
+// The name of CMD, for debugging output.
+
+const char *apt_proto_command_name (int cmd);
+
+// Each request carries a priority.  The apt-worker handles more
+// urgent requests first: long running requests of a lower priority,
+// such as the GET_PACKAGE_INFOS sweeps, check between packages whether
+// a more urgent request has arrived and step aside for it.  They are
+// resumed where they stopped once all more urgent requests have been
+// handled.  Thus, responses might arrive in a different order than
+// the requests were sent.
+
+enum apt_proto_priority {
+  APT_PRIORITY_INTERACTIVE,    // the user is waiting for it
+  APT_PRIORITY_BACKGROUND,     // visible soon, e.g. infos for a view
+  APT_PRIORITY_BULK            // nobody is waiting for it
+};
+
 struct apt_request_header {
   int cmd;
   int seq;
   int len;
+  int priority;
 };
 
 struct apt_response_header {
   int cmd;
   int seq;
   int len;
+  int flags;
+};
+
+// A response has APT_RESPONSE_STALE in its FLAGS when it has been
+// computed from the package cache while a new one was being built in
+// the background.  It might not reflect the latest changes, such as a
+// just finished installation.  A op_cache_changed status follows it.
+
+enum apt_proto_response_flags {
+  APT_RESPONSE_STALE = 1
 };
 
 enum apt_proto_result_code {
@@ -117,6 +152,10 @@ struct apt_proto_encoder {
   void encode_stringn (const char *, int len);
   void encode_xexp (xexp *x);
 
+  // Forget everything that has been encoded after the first LEN
+  // bytes.  LEN must be a value previously returned by get_len.
+  void truncate (int len);
+
   char *get_buf ();
   int get_len ();
 
@@ -166,10 +205,38 @@ private:
 // - operation (int).  See enum below.
 // - already (int).    Amount of work already done.
 // - total (int).      Total amount of work to do.
+//
+// While the indexes are downloaded for CHECK_UPDATES, there are also
+// op_catalogue responses for the individual catalogues.  For them,
+// ALREADY and TOTAL count the files of the catalogue, and they are
+// followed by:
+//
+// - catalogue (int).  Position in the list of catalogues.
+// - failed (int).     Number of files that could not be downloaded.
+// - elapsed (int).    Milliseconds since the first file was started.
+// - finished (int).   Whether this is the final report.
+// - name (string).    URI and distribution of the catalogue.
+//
+// Before INSTALL_PACKAGE runs dpkg, it checks the hashes of the
+// archives that have not just been downloaded.  This is reported with
+// op_verifying responses where ALREADY and TOTAL count the archives,
+// followed by:
+//
+// - elapsed (int).    Milliseconds since the check was started.
+// - finished (int).   Whether this is the final report.
+//
+// When the package cache has been rebuilt in the background after a
+// request, there is a op_cache_changed response with ALREADY and
+// TOTAL set to zero.  The results of GET_PACKAGE_LIST etc might have
+// changed.  Responses that have been marked with APT_RESPONSE_STALE
+// before it should be asked for again if they matter.
 
 enum apt_proto_operation {
   op_downloading,
-  op_general
+  op_general,
+  op_catalogue,
+  op_cache_changed,
+  op_verifying
 };
 
 // GET_PACKAGE_LIST - get a list of packages with their names,
@@ -182,6 +249,10 @@ enum apt_proto_operation {
 // - only_installed (int). Include only packages that are installed.
 // - only_available (int). Include only packages that are available.
 // - pattern (string).     Include only packages that match pattern.
+//                         All space separated words of the pattern
+//                         must appear, ignoring case, in the name,
+//                         display name or description of one of the
+//                         versions of the package.
 // - show_magic_sys (int). Include the artificial "magic:sys" package.
 //
 // The response starts with an int that tells whether the request
@@ -207,6 +278,95 @@ enum apt_proto_operation {
 // installed_short_description, it is set to null.  Likewise for the
 // icon.
 
+struct apt_proto_package_list_entry {
+  const char *name;
+  int broken;
+  const char *installed_version;
+  int64_t installed_size;
+  const char *installed_section;
+  const char *installed_pretty_name;
+  const char *installed_short_description;
+  const char *installed_icon;
+  const char *available_version;
+  const char *available_section;
+  const char *available_pretty_name;
+  const char *available_short_description;
+  const char *available_icon;
+  int flags;
+};
+
+// Decode the rest of a package list entry whose NAME has already been
+// decoded from DEC into ENTRY.  The strings in ENTRY point into the
+// buffer of DEC.
+
+void apt_proto_decode_package_list_entry (apt_proto_decoder *dec,
+					  const char *name,
+					  apt_proto_package_list_entry *entry);
+
+// GET_PACKAGE_LIST_DELTA - get the changes to the package list since
+//                          a previous GET_PACKAGE_LIST_DELTA.
+//
+// Each time the package cache is reopened, it gets a new generation
+// number.  The backend remembers what it has sent in its last reply
+// to this command, and when the frontend says that it still has the
+// list from that reply, only the entries that have changed are sent.
+// Otherwise the full list is sent.
+//
+// Parameters:
+//
+// - only_user (int).
+// - only_installed (int).
+// - only_available (int).
+// - show_magic_sys (int).   As for GET_PACKAGE_LIST.
+// - known_generation (int). The generation of the list that the
+//                           frontend has, or 0 if it has none.
+//
+// The response starts with an int that tells whether the request
+// succeeded.  When that int is 0, no data follows.  Otherwise:
+//
+// - generation (int).       The generation of the resulting list.
+// - is_delta (int).         When 0, the entries below are the complete
+//                           list and the frontend should forget its
+//                           old one.
+// - entries (entry)*,(NULL). Entries that have been added or changed,
+//                           in the format of GET_PACKAGE_LIST.  The
+//                           list is terminated by a NULL name.
+// - removed (string)*,(NULL). Names of packages that are no longer in
+//                           the list.
+
+// The package list snapshot
+//
+// Whenever the backend has computed a complete package list for
+// GET_PACKAGE_LIST_DELTA, it also stores it in
+// PACKAGE_LIST_SNAPSHOT_FILE.  The frontend reads that file when it
+// starts so that it has something to show before the backend is up.
+//
+// The file contains a apt_proto_snapshot_header, followed by LEN bytes
+// of package list entries in the format of GET_PACKAGE_LIST,
+// terminated by a NULL name.  FILTER tells for which parameters the
+// list has been made, see apt_proto_package_list_filter.
+
+#define PACKAGE_LIST_SNAPSHOT_FILE \
+  "/var/lib/hildon-application-manager/package-list-snapshot"
+
+#define APT_PROTO_SNAPSHOT_MAGIC   "HAMPLST"
+#define APT_PROTO_SNAPSHOT_VERSION 1
+
+struct apt_proto_snapshot_header {
+  char magic[8];
+  int version;
+  int filter;
+  int len;
+};
+
+inline int
+apt_proto_package_list_filter (bool only_user, bool only_installed,
+			       bool only_available, bool show_magic_sys)
+{
+  return (only_user | only_installed << 1 | only_available << 2
+	  | show_magic_sys << 3);
+}
+
 // UPDATE_PACKAGE_CACHE - recreate package cache
 //
 // Parameters:
@@ -312,6 +472,24 @@ struct apt_proto_package_info {
   int64_t remove_user_size_delta;
 };
 
+// GET_PACKAGE_INFOS - like GET_PACKAGE_INFO, but for a whole batch
+//                     of packages at once.  This saves one round trip
+//                     per package when filling in the list views.
+//
+// Parameters:
+//
+// - only_installable_info (int).
+// - names (string)*,(NULL).       Names of the packages.
+//
+// Response:
+//
+// - infos (apt_proto_package_info)*.  One for each requested name, in
+//                                     the same order.
+//
+// This request yields to more urgent ones between packages, see
+// apt_proto_priority.  When it is cancelled, the response contains
+// only the infos that have been computed so far.
+
 // GET_PACKAGE_DETAILS - get a lot of details about a specific
 //                       package.  This is intended for the "Details"
 //                       dialog, of course.
@@ -513,4 +691,47 @@ enum third_party_policy_status {
   third_party_incompatible
 };
 
+// GET_STATS - get the statistics collected by the backend since it
+//             was started.
+//
+// Parameters: none.
+//
+// Response:
+//
+// - cache_inits (int).            How often the cache has been opened.
+// - cache_init_time (int64).      Microseconds spent opening it.
+// - cache_init_max_time (int64).  The longest time it took, in us.
+// - record_lookups (int64).       Number of package records looked up.
+// - buckets (int).                Number of histogram buckets, see below.
+// - command (command_stats)*,(-1).
+//
+// A command_stats entry is only sent for commands that have been
+// handled at least once.  It is:
+//
+// - cmd (int).
+// - count (int).                  How often it has been handled.
+// - wall_time (int64).            Microseconds from the start of
+//                                 handling it to sending the
+//                                 response, added up.
+// - cpu_time (int64).             Microseconds of CPU time, added up.
+// - max_wall_time (int64).        The longest wall_time, in us.
+// - response_bytes (int64).       Size of the responses, added up.
+// - record_lookups (int64).       Package records looked up, added up.
+// - histogram (int)*.             BUCKETS counts of wall_time.  The
+//                                 first bucket counts the times
+//                                 below 1 ms, bucket N the times below
+//                                 2^N ms, the last one the rest.
+//
+// When a request steps aside for a more urgent one, the time it has
+// to wait is not included in its wall_time.
+
+// SET_TRACE_FILE - write trace events to a file, see trace.h.
+//
+// Parameters:
+//
+// - file (string).  The file to append the events to.  It must exist.
+//                   When this is NULL, no events are written.
+//
+// No response.
+
 #endif /* !APT_WORKER_PROTO_H */
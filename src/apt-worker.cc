@@ -58,12 +58,19 @@
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <dirent.h>
 #include <signal.h>
 #include <ftw.h>
+#include <pthread.h>
+#include <pwd.h>
 
 #include <fstream>
+#include <vector>
+#include <set>
 
 #include <apt-pkg/init.h>
 #include <apt-pkg/error.h>
@@ -93,6 +100,8 @@
 #include <glib.h>
 
 #include "apt-worker-proto.h"
+#include "trace.h"
+#include "deb-control.h"
 #include "confutils.h"
 
 #include "update-notifier-conf.h"
@@ -129,7 +138,18 @@ static xexp *read_operation_record ();
 */
 #define ENABLE_OLD_MAEMO_SECTION_TEST 1
 
-/* Requests up to this size are put into a stack allocated buffer.
+/* The indexes of the catalogues are downloaded from up to
+   DOWNLOAD_LISTS_MAX_HOSTS hosts in parallel, with up to
+   DOWNLOAD_LISTS_PIPELINE_DEPTH requests in flight per host.  These
+   are only defaults for Acquire::QueueHost::Limit and
+   Acquire::http::Pipeline-Depth and can be tuned in the APT
+   configuration.
+*/
+#define DOWNLOAD_LISTS_MAX_HOSTS      4
+#define DOWNLOAD_LISTS_PIPELINE_DEPTH 3
+
+/* Requests up to this size are kept in the fixed buffer of their
+   worker_request instead of a separately allocated one.
  */
 #define FIXED_REQUEST_BUF_SIZE 4096
 
@@ -234,6 +254,7 @@ struct domain_info {
 
 xexp *domain_conf = NULL;
 domain_info *domains = NULL;
+const char *package_domains_dir = PACKAGE_DOMAINS;
 int domains_number = 0;
 time_t domains_last_modified = -1;
 
@@ -257,13 +278,17 @@ file_last_modified (const char *file_name)
   return buf.st_mtime;
 }
 
+static void forget_simulation_results ();
+
 static void
 read_domain_conf ()
 {
+  forget_simulation_results ();
+
   delete[] domains;
   xexp_free (domain_conf);
 
-  domain_conf = read_domains ();
+  domain_conf = read_domains (package_domains_dir);
 
   int n_domains = 2;
   if (domain_conf)
@@ -305,7 +330,7 @@ read_domain_conf ()
 
   /* Update domains number and last modified timestamp */
   domains_number = i;
-  domains_last_modified = file_last_modified (PACKAGE_DOMAINS);
+  domains_last_modified = file_last_modified (package_domains_dir);
 }
 
 static domain_t
@@ -354,6 +379,24 @@ public:
   bool init_cache_after_request;  
   myCacheFile *cache;
   pkgDepCache::ActionGroup *action_group;
+
+  /* Scheduling state of the command dispatcher, see handle_request.
+     PENDING_REQUESTS are the requests that have been read ahead, in
+     order of arrival, SUSPENDED_REQUESTS are the requests that have
+     stepped aside for them, the most recently suspended one first.
+  */
+  GList *pending_requests;
+  GSList *suspended_requests;
+  int current_priority;
+  bool suspend_current_request;
+
+  /* The child process that generates the binary caches for the next
+     cache, and the reading end of a pipe that is closed when it
+     exits.  See start_cache_rebuild.
+  */
+  pid_t cache_builder;
+  int cache_builder_fd;
+
   static AptWorkerCache *current;
   static bool global_initialized;
 };
@@ -363,7 +406,11 @@ AptWorkerCache *AptWorkerCache::current = 0;
 bool AptWorkerCache::global_initialized = false;
 
 AptWorkerCache::AptWorkerCache ()
-  : init_cache_after_request (false), cache (0)
+  : init_cache_after_request (false), cache (0),
+    pending_requests (NULL), suspended_requests (NULL),
+    current_priority (APT_PRIORITY_INTERACTIVE),
+    suspend_current_request (false),
+    cache_builder (-1), cache_builder_fd (-1)
 {
 }
 
@@ -406,7 +453,12 @@ struct extra_info_struct
   bool autoinst : 1;
   bool related : 1;
   bool soft : 1;
+  bool dirty : 1;
+  bool saved_autoinst : 1;
   domain_t cur_domain, new_domain;
+
+  /* The state as last written to PACKAGE_STATE_FILE. */
+  domain_t saved_domain;
 };
 
 class myPolicy : public pkgPolicy {
@@ -427,6 +479,9 @@ public:
   virtual pkgCache::VerIterator GetCandidateVer(pkgCache::PkgIterator Pkg);
 };
 
+struct search_index;
+void search_index_free (search_index *idx);
+
 class myCacheFile : public pkgCacheFile {
 
 public:
@@ -437,14 +492,43 @@ public:
 
   extra_info_struct *extra_info;
 
+  /* The packages that have been changed since the last cache_reset,
+     as pkgCache::Package pointers, see mark_dirty.  When DIRTY_ALL is
+     true, the changes have not been tracked and all packages need to
+     be looked at.
+  */
+  GPtrArray *dirty;
+  bool dirty_all;
+
+  /* Set when this cache is about to be replaced because the package
+     lists or the dpkg status have changed.  The records are then only
+     read from files that are still the ones the cache was built
+     from, see package_record::lookup.  FILE_STATES remembers the
+     result of checking a file, indexed by its ID: 0 when not checked
+     yet, 1 when unchanged, -1 when changed.
+  */
+  bool superseded;
+  std::vector<signed char> file_states;
+
+  /* Built on demand by search_index_match. */
+  search_index *search;
+
   myCacheFile ()
   {
     extra_info = NULL;
+    dirty = g_ptr_array_new ();
+    dirty_all = true;
+    superseded = false;
+    search = NULL;
   }
 
+  bool file_unchanged (pkgCache::PkgFileIterator file);
+
   ~myCacheFile ()
   {
     delete[] extra_info;
+    g_ptr_array_free (dirty, TRUE);
+    search_index_free (search);
   }
 };
 
@@ -594,6 +678,23 @@ myCacheFile::Open (OpProgress &Progress, bool WithLock)
   return true;
 }
 
+/* Return whether FILE is still the one that the cache has been built
+   from.  This is only checked once per file.
+*/
+bool
+myCacheFile::file_unchanged (pkgCache::PkgFileIterator file)
+{
+  unsigned long id = file->ID;
+
+  if (file_states.size () <= id)
+    file_states.resize (id + 1, 0);
+
+  if (file_states[id] == 0)
+    file_states[id] = file.IsOk () ? 1 : -1;
+
+  return file_states[id] > 0;
+}
+
 static bool
 create_extra_info_dir()
 {
@@ -607,81 +708,363 @@ create_extra_info_dir()
   return true;
 }
 
-/* Save the 'extra_info' of the cache.  We first make a copy of the
-   Auto flags in our own extra_info storage so that CACHE_RESET
-   will reset the Auto flags to the state last saved with this
-   function.
+/* The 'extra_info' that needs to survive a restart, the autoinst
+   flags and the domains of the installed packages, is kept in a
+   single binary journal, PACKAGE_STATE_FILE.  After a small header,
+   it contains a sequence of fixed-size records.  A record gives the
+   complete state of one package, identified by a hash of its name,
+   and later records override earlier ones.
+
+   Saving the state only appends records for the packages whose state
+   has changed, with a single fdatasync.  When the journal contains
+   too many overridden records, it is compacted by writing a fresh
+   one and renaming it over the old one.
+
+   The old text files, autoinst and one domain.<name> file per domain,
+   are imported when there is no journal yet, and are removed
+   afterwards.
+
+   The domains in the journal are ignored when
+   PACKAGE_STATE_RESET_DOMAINS_FILE exists, see
+   hildon-application-manager-util.
 */
 
-void
-myCacheFile::save_extra_info ()
+#define PACKAGE_STATE_FILE "/var/lib/hildon-application-manager/package-state"
+#define PACKAGE_STATE_TEMP_FILE PACKAGE_STATE_FILE ".new"
+#define PACKAGE_STATE_RESET_DOMAINS_FILE "/var/lib/hildon-application-manager/reset.domains"
+#define PACKAGE_STATE_MAGIC 0x4a534148 /* "HASJ" */
+#define PACKAGE_STATE_VERSION 1
+
+#define PACKAGE_STATE_AUTOINST 1
+
+/* Compact the journal when it has more than this many records per
+   package with a state, plus the slack.
+*/
+#define PACKAGE_STATE_COMPACT_FACTOR 2
+#define PACKAGE_STATE_COMPACT_SLACK 256
+
+struct package_state_header {
+  guint32 magic;
+  guint32 version;
+};
+
+struct package_state_record {
+  guint64 name_hash;
+  guint32 domain_hash;  // 0 when the package has no domain
+  guint32 flags;
+};
+
+/* The number of records in the journal, or -1 when it needs to be
+   rewritten completely before anything can be appended.
+*/
+static int package_state_records = -1;
+
+static guint64
+package_state_hash (const char *str)
 {
-  if (!create_extra_info_dir())
-    return;
+  /* FNV-1a
+   */
+  guint64 h = 14695981039346656037ULL;
+  while (*str)
+    {
+      h ^= (unsigned char)*str++;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
 
-  FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "w");
-  if (f)
+static guint64
+package_name_hash (pkgCache::PkgIterator &pkg)
+{
+  return package_state_hash (pkg.FullName (true).c_str ());
+}
+
+static guint32
+domain_hash (domain_t domain)
+{
+  if (domain == DOMAIN_INVALID)
+    return 0;
+
+  guint32 h = (guint32) package_state_hash (domains[domain].name);
+  return h ? h : 1;
+}
+
+static domain_t
+find_domain_by_hash (guint32 hash)
+{
+  if (hash == 0)
+    return DOMAIN_INVALID;
+
+  for (domain_t i = 0; i < domains_number; i++)
+    if (domain_hash (i) == hash)
+      return i;
+
+  return DOMAIN_INVALID;
+}
+
+static void
+make_package_state_record (package_state_record *rec,
+			   pkgCache::PkgIterator &pkg,
+			   extra_info_struct &extra)
+{
+  rec->name_hash = package_name_hash (pkg);
+  rec->domain_hash = domain_hash (extra.saved_domain);
+  rec->flags = extra.saved_autoinst ? PACKAGE_STATE_AUTOINST : 0;
+}
+
+static bool
+write_all (int fd, const void *buf, size_t len)
+{
+  const char *ptr = (const char *)buf;
+
+  while (len > 0)
     {
-      pkgDepCache &cache = *DCache;
+      ssize_t n = write (fd, ptr, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return false;
+	}
+      ptr += n;
+      len -= n;
+    }
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+  return true;
+}
+
+/* Write the complete saved state of all packages in CACHE into a
+   fresh journal.
+*/
+static bool
+write_package_state (pkgCache &cache, extra_info_struct *extra_info)
+{
+  GArray *records = g_array_new (FALSE, FALSE, sizeof (package_state_record));
+  package_state_header header = { PACKAGE_STATE_MAGIC,
+				  PACKAGE_STATE_VERSION };
+  bool success = false;
+  int fd;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      extra_info_struct &extra = extra_info[pkg->ID];
+      if (extra.saved_autoinst || extra.saved_domain != DOMAIN_INVALID)
 	{
-	  if (cache[pkg].Flags & pkgCache::Flag::Auto)
-	    {
-	      extra_info[pkg->ID].autoinst = true;
-	      fprintf (f, "%s\n", pkg.Name ());
-	    }
-	  else
-	    extra_info[pkg->ID].autoinst = false;
+	  package_state_record rec;
+	  make_package_state_record (&rec, pkg, extra);
+	  g_array_append_val (records, rec);
 	}
-      fflush (f);
-      fsync (fileno (f));
-      fclose (f);
     }
 
-  for (domain_t i = 0; i < domains_number; i++)
+  fd = open (PACKAGE_STATE_TEMP_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0)
     {
-      char *name =
-	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-			 domains[i].name);
-      
-      FILE *f = fopen (name, "w");
-      if (f)
+      if (write_all (fd, &header, sizeof (header))
+	  && write_all (fd, records->data,
+			records->len * sizeof (package_state_record))
+	  && fdatasync (fd) == 0)
+	success = true;
+
+      if (close (fd) < 0)
+	success = false;
+    }
+
+  if (success && rename (PACKAGE_STATE_TEMP_FILE, PACKAGE_STATE_FILE) < 0)
+    success = false;
+
+  if (success)
+    {
+      DBG ("package state: %d records", records->len);
+      package_state_records = records->len;
+    }
+  else
+    {
+      log_stderr ("%s: %m", PACKAGE_STATE_FILE);
+      unlink (PACKAGE_STATE_TEMP_FILE);
+    }
+
+  g_array_free (records, TRUE);
+  return success;
+}
+
+/* Append RECORDS to the journal.
+*/
+static bool
+append_package_state (GArray *records)
+{
+  bool success = false;
+  int fd;
+
+  if (records->len == 0)
+    return true;
+
+  fd = open (PACKAGE_STATE_FILE, O_WRONLY | O_APPEND);
+  if (fd >= 0)
+    {
+      if (write_all (fd, records->data,
+		     records->len * sizeof (package_state_record))
+	  && fdatasync (fd) == 0)
+	success = true;
+
+      if (close (fd) < 0)
+	success = false;
+    }
+
+  if (success)
+    package_state_records += records->len;
+  else
+    {
+      log_stderr ("%s: %m", PACKAGE_STATE_FILE);
+
+      /* We don't know how much of it has made it to disk.
+       */
+      package_state_records = -1;
+    }
+
+  return success;
+}
+
+/* Bring the journal up-to-date with the 'autoinst' and 'cur_domain'
+   fields of EXTRA_INFO.
+*/
+static void
+save_package_state (pkgCache &cache, extra_info_struct *extra_info)
+{
+  GArray *records = g_array_new (FALSE, FALSE, sizeof (package_state_record));
+  int n_live = 0;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      extra_info_struct &extra = extra_info[pkg->ID];
+
+      if (extra.autoinst != extra.saved_autoinst
+	  || extra.cur_domain != extra.saved_domain)
 	{
-	  pkgDepCache &cache = *DCache;
+	  package_state_record rec;
 
-	  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	       !pkg.end (); pkg++)
-	    {
-	      if (extra_info[pkg->ID].cur_domain == i)
-		fprintf (f, "%s\n", pkg.Name ());
-	    }
-	  fflush (f);
-	  fsync (fileno (f));
-	  fclose (f);
+	  extra.saved_autoinst = extra.autoinst;
+	  extra.saved_domain = extra.cur_domain;
+	  make_package_state_record (&rec, pkg, extra);
+	  g_array_append_val (records, rec);
 	}
+
+      if (extra.saved_autoinst || extra.saved_domain != DOMAIN_INVALID)
+	n_live++;
     }
+
+  if (package_state_records < 0
+      || (package_state_records + (int)records->len
+	  > PACKAGE_STATE_COMPACT_FACTOR * n_live
+	  + PACKAGE_STATE_COMPACT_SLACK))
+    write_package_state (cache, extra_info);
+  else
+    append_package_state (records);
+
+  g_array_free (records, TRUE);
 }
 
-/* Load the 'extra_info'.  You need to call CACHE_RESET to
-   transfer the auto flag into the actual cache.  */
+/* Move a journal that can not be read out of the way, so that the
+   next save does not overwrite it and it can be looked at later.
+*/
+static void
+set_aside_package_state ()
+{
+  log_stderr ("%s: corrupted, keeping it as %s.bad",
+	      PACKAGE_STATE_FILE, PACKAGE_STATE_FILE);
+  if (rename (PACKAGE_STATE_FILE, PACKAGE_STATE_FILE ".bad") < 0)
+    log_stderr ("%s.bad: %m", PACKAGE_STATE_FILE);
+}
 
-void
-myCacheFile::load_extra_info (const pkgSourceList &sources)
+/* Read the journal into EXTRA_INFO, without the domains when
+   IGNORE_DOMAINS is true.  Return false when there is no usable
+   journal.
+*/
+static bool
+load_package_state (pkgCache &cache, extra_info_struct *extra_info,
+		    bool ignore_domains)
 {
-  pkgCache &cache = *Cache;
+  package_state_header header;
+  package_state_record *records;
+  struct stat buf;
+  int fd, n_records;
 
-  int package_count = cache.Head().PackageCount;
+  package_state_records = -1;
 
-  DBG ("package_count: %d", package_count);
+  fd = open (PACKAGE_STATE_FILE, O_RDONLY);
+  if (fd < 0)
+    {
+      if (errno != ENOENT)
+	log_stderr ("%s: %m", PACKAGE_STATE_FILE);
+      return false;
+    }
 
-  extra_info = new extra_info_struct[package_count];
+  if (fstat (fd, &buf) < 0
+      || buf.st_size < (off_t)sizeof (header)
+      || read (fd, &header, sizeof (header)) != sizeof (header)
+      || header.magic != PACKAGE_STATE_MAGIC
+      || header.version != PACKAGE_STATE_VERSION)
+    {
+      /* Fall back to the old text files, if they are still there.
+       */
+      close (fd);
+      set_aside_package_state ();
+      return false;
+    }
 
-  for (int i = 0; i < package_count; i++)
+  /* A partially written record at the end is ignored.  The next save
+     will then rewrite the journal.
+  */
+  n_records = (buf.st_size - sizeof (header)) / sizeof (package_state_record);
+  records = new package_state_record[n_records];
+
+  size_t len = n_records * sizeof (package_state_record);
+  if (read (fd, records, len) != (ssize_t)len)
     {
-      extra_info[i].autoinst = false;
-      extra_info[i].cur_domain = DOMAIN_INVALID;
+      log_stderr ("%s: %m", PACKAGE_STATE_FILE);
+      close (fd);
+      delete[] records;
+      set_aside_package_state ();
+      return false;
     }
+  else if ((buf.st_size - sizeof (header)) % sizeof (package_state_record) == 0)
+    package_state_records = n_records;
+
+  close (fd);
+
+  /* Later records override earlier ones.
+   */
+  GHashTable *states = g_hash_table_new (g_int64_hash, g_int64_equal);
+  for (int i = 0; i < n_records; i++)
+    g_hash_table_insert (states, &records[i].name_hash, &records[i]);
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      guint64 hash = package_name_hash (pkg);
+      package_state_record *rec =
+	(package_state_record *) g_hash_table_lookup (states, &hash);
+
+      if (rec)
+	{
+	  extra_info_struct &extra = extra_info[pkg->ID];
+	  extra.autoinst = (rec->flags & PACKAGE_STATE_AUTOINST) != 0;
+	  if (!ignore_domains)
+	    extra.cur_domain = find_domain_by_hash (rec->domain_hash);
+	}
+    }
+
+  g_hash_table_destroy (states);
+  delete[] records;
+
+  return true;
+}
+
+/* Read the old text files into EXTRA_INFO.  Return true when there
+   was anything to import.
+*/
+static bool
+import_extra_info_text (pkgCache &cache, extra_info_struct *extra_info)
+{
+  bool found = false;
 
   FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "r");
   if (f)
@@ -690,6 +1073,7 @@ myCacheFile::load_extra_info (const pkgSourceList &sources)
       size_t len = 0;
       ssize_t n;
 
+      found = true;
       while ((n = getline (&line, &len, f)) != -1)
 	{
 	  if (n > 0 && line[n-1] == '\n')
@@ -720,6 +1104,7 @@ myCacheFile::load_extra_info (const pkgSourceList &sources)
 	  size_t len = 0;
 	  ssize_t n;
 
+	  found = true;
 	  while ((n = getline (&line, &len, f)) != -1)
 	    {
 	      if (n > 0 && line[n-1] == '\n')
@@ -740,6 +1125,79 @@ myCacheFile::load_extra_info (const pkgSourceList &sources)
       g_free (name);
     }
 
+  return found;
+}
+
+static void
+remove_extra_info_text ()
+{
+  unlink ("/var/lib/hildon-application-manager/autoinst");
+
+  for (domain_t i = 0; i < domains_number; i++)
+    {
+      char *name =
+	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
+			 domains[i].name);
+      unlink (name);
+      g_free (name);
+    }
+}
+
+/* Save the 'extra_info' of the cache.  We first make a copy of the
+   Auto flags in our own extra_info storage so that CACHE_RESET
+   will reset the Auto flags to the state last saved with this
+   function.
+*/
+
+void
+myCacheFile::save_extra_info ()
+{
+  if (!create_extra_info_dir())
+    return;
+
+  pkgDepCache &cache = *DCache;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    extra_info[pkg->ID].autoinst =
+      (cache[pkg].Flags & pkgCache::Flag::Auto) != 0;
+
+  save_package_state (*Cache, extra_info);
+}
+
+/* Load the 'extra_info'.  You need to call CACHE_RESET to
+   transfer the auto flag into the actual cache.  */
+
+void
+myCacheFile::load_extra_info (const pkgSourceList &sources)
+{
+  pkgCache &cache = *Cache;
+
+  int package_count = cache.Head().PackageCount;
+
+  DBG ("package_count: %d", package_count);
+
+  extra_info = new extra_info_struct[package_count];
+
+  for (int i = 0; i < package_count; i++)
+    {
+      extra_info[i].autoinst = false;
+      extra_info[i].dirty = false;
+      extra_info[i].cur_domain = DOMAIN_INVALID;
+    }
+
+  bool reset_domains = access (PACKAGE_STATE_RESET_DOMAINS_FILE, F_OK) == 0;
+  bool rewrite = reset_domains;
+
+  if (!load_package_state (cache, extra_info, reset_domains)
+      && import_extra_info_text (cache, extra_info))
+    rewrite = true;
+
+  for (int i = 0; i < package_count; i++)
+    {
+      extra_info[i].saved_autoinst = extra_info[i].autoinst;
+      extra_info[i].saved_domain = extra_info[i].cur_domain;
+    }
+
   bool domains_changed = false;
   set_sources_for_get_domain(&sources);
 
@@ -781,32 +1239,28 @@ myCacheFile::load_extra_info (const pkgSourceList &sources)
 
   set_sources_for_get_domain(NULL);
 
-  if (!domains_changed)
+  if (!domains_changed && !rewrite)
     return;
 
   if (!create_extra_info_dir())
     return;
 
-  for (domain_t i = 0; i < domains_number; i++)
+  if (rewrite)
     {
-      char *name =
-          g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-                           domains[i].name);
-      FILE *f = fopen (name, "w");
-
-      if (f)
-        {
-          for (pkgCache::PkgIterator pkg = cache.PkgBegin (); !pkg.end (); pkg++)
-            {
-              if (extra_info[pkg->ID].cur_domain == i)
-                fprintf (f, "%s\n", pkg.Name ());
-            }
-
-	  fflush (f);
-	  fsync (fileno (f));
-	  fclose (f);
+      /* The journal has to contain everything that has been
+	 imported, not just the changes, and must not contain the old
+	 domains anymore.
+      */
+      package_state_records = -1;
+      save_package_state (*Cache, extra_info);
+      if (package_state_records >= 0)
+	{
+	  remove_extra_info_text ();
+	  unlink (PACKAGE_STATE_RESET_DOMAINS_FILE);
 	}
     }
+  else
+    save_package_state (*Cache, extra_info);
 }
 
 /* ALLOC_BUF and FREE_BUF can be used to manage a temporary buffer of
@@ -931,8 +1385,10 @@ ForceLock (string File, bool Errors = true)
  
    The communication with the frontend happens over four
    unidirectional fifos: requests are read from INPUT_FD and responses
-   are sent back via OUTPUT_FD.  No new request is read until the
-   response to the current one has been completely sent.
+   are sent back via OUTPUT_FD.  Normally, no new request is read
+   until the response to the current one has been completely sent.
+   Only requests with a background or bulk priority look ahead for
+   more urgent requests, see handle_request.
 
    The data read from INPUT_FD must follow the request format
    specified in <apt-worker-proto.h>.  The data written to OUTPUT_FD
@@ -996,13 +1452,13 @@ must_write (void *buf, ssize_t n)
     }
 }
 
-/* This function sends a response on OUTPUT_FD with the given CMD and
-   SEQ.  It either succeeds or does not return.
+/* This function sends a response on OUTPUT_FD with the given CMD,
+   SEQ, and FLAGS.  It either succeeds or does not return.
 */
 void
-send_response_raw (int cmd, int seq, void *response, int len)
+send_response_raw (int cmd, int seq, int flags, void *response, int len)
 {
-  apt_response_header res = { cmd, seq, len };
+  apt_response_header res = { cmd, seq, len, flags };
   must_write (&res, sizeof (res));
   must_write (response, len);
 }
@@ -1039,7 +1495,7 @@ send_status (int op, int already, int total, int min_change)
       status_response.encode_int (op);
       status_response.encode_int (already);
       status_response.encode_int (total);
-      send_response_raw (APTCMD_STATUS, -1, 
+      send_response_raw (APTCMD_STATUS, -1, 0,
 			 status_response.get_buf (),
 			 status_response.get_len ());
     }
@@ -1061,8 +1517,21 @@ send_status (int op, int already, int total, int min_change)
 apt_proto_decoder request;
 apt_proto_encoder response;
 
+/* A handler that steps aside for a more urgent request calls
+   SUSPEND_REQUEST and then puts the parameters for resuming it into
+   CONTINUATION.  Whatever it has put into RESPONSE so far is kept and
+   will be in RESPONSE again when the handler is called with the
+   parameters from CONTINUATION.
+*/
+apt_proto_encoder continuation;
+
+bool higher_priority_request_waiting ();
+void suspend_request ();
+
 void cmd_get_package_list ();
 void cmd_get_package_info ();
+void cmd_get_package_infos ();
+void cmd_get_package_list_delta ();
 void cmd_get_package_details ();
 int cmd_check_updates (bool with_status = true);
 void cmd_get_catalogues ();
@@ -1085,6 +1554,8 @@ void cmd_set_options ();
 void cmd_set_env ();
 void cmd_third_party_policy_check ();
 void cmd_autoremove ();
+void cmd_get_stats ();
+void cmd_set_trace_file ();
 
 int cmdline_check_updates (char **argv);
 int cmdline_rescue (char **argv);
@@ -1097,100 +1568,447 @@ int cmdline_rescue (char **argv);
    to take care of the writting/reading to/from disk process.
 */
 
-static void save_failed_catalogues (xexp *catalogues);
-static xexp *load_failed_catalogues ();
-static void clean_failed_catalogues ();
-static void clean_temp_catalogues ();
-static xexp *merge_catalogues_with_errors (xexp *catalogues);
+static void save_failed_catalogues (xexp *catalogues);
+static xexp *load_failed_catalogues ();
+static void clean_failed_catalogues ();
+static void clean_temp_catalogues ();
+static xexp *merge_catalogues_with_errors (xexp *catalogues);
+
+/** MANAGEMENT OF FILE WITH INFO ABOUT AVAILABLE UPDATES */
+
+static void write_available_updates_file ();
+
+/** MAPPING FUNCTION TO FILTER ERROR DETAILS
+    IN CATALOGUES CONFIGURATION FILE
+*/
+static xexp *map_catalogue_error_details (xexp *x);
+
+
+/* Commands can request the package cache to be refreshed by calling
+   NEED_CACHE_INIT before they return.  The cache will then be
+   reconstructed after sending the response, see
+   START_CACHE_REBUILD.  In this way, the cache reconstruction happens
+   in the background.
+
+   The expensive part of the reconstruction, generating the binary
+   caches from the package lists and the dpkg status, is done by a
+   forked child process.  Meanwhile, the requests that only read the
+   package cache are answered from the old one, see
+   REQUEST_CAN_USE_OLD_CACHE.  Their responses are marked with
+   APT_RESPONSE_STALE, since the old cache does not know about the
+   changes that have made the rebuild necessary, such as a just
+   finished installation.  All other requests wait for the child.
+   When it is done, the new cache is opened from the files it has
+   generated and swapped in for the old one, and the frontend is told
+   about it with a op_cache_changed status.  It can then ask again
+   for what it has received stale.
+*/
+
+void cache_init (bool with_status = true);
+void start_cache_rebuild ();
+void finish_cache_rebuild ();
+
+static bool
+request_can_use_old_cache (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_NOOP:
+    case APTCMD_GET_PACKAGE_LIST:
+    case APTCMD_GET_PACKAGE_LIST_DELTA:
+    case APTCMD_GET_PACKAGE_INFO:
+    case APTCMD_GET_PACKAGE_INFOS:
+    case APTCMD_GET_PACKAGE_DETAILS:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+    case APTCMD_SET_OPTIONS:
+    case APTCMD_SET_ENV:
+    case APTCMD_GET_STATS:
+    case APTCMD_SET_TRACE_FILE:
+      return true;
+    default:
+      return false;
+    }
+}
+
+void
+need_cache_init ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  awc->init_cache_after_request = true;
+}
+
+/** STATISTICS
+
+   For each command, we count how often it has been handled and add
+   up the wall clock and CPU time spent on it, the size of its
+   responses and the number of package records it has looked up.  A
+   histogram of the wall clock times is kept as well.  Opening the
+   cache is counted separately.  APTCMD_GET_STATS returns all this.
+*/
+
+#define STATS_HISTOGRAM_BUCKETS 16
+
+struct command_stats {
+  int count;
+  int64_t wall_time;
+  int64_t cpu_time;
+  int64_t max_wall_time;
+  int64_t response_bytes;
+  int64_t record_lookups;
+  int histogram[STATS_HISTOGRAM_BUCKETS];
+};
+
+static command_stats stats[APTCMD_MAX];
+
+static int stats_cache_inits = 0;
+static int64_t stats_cache_init_time = 0;
+static int64_t stats_cache_init_max_time = 0;
+
+/* Incremented by package_record::lookup.
+ */
+static int64_t stats_record_lookups = 0;
+
+/* The current time, in microseconds.
+ */
+static int64_t
+wall_time ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* The CPU time used by this process so far, in microseconds.
+ */
+static int64_t
+cpu_time ()
+{
+  struct rusage ru;
+
+  if (getrusage (RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ((int64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+	  + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static void
+record_command_stats (int cmd, int64_t wall_time, int64_t cpu_time,
+		      int response_len, int64_t record_lookups)
+{
+  if (cmd < 0 || cmd >= APTCMD_MAX)
+    return;
+
+  command_stats &s = stats[cmd];
+  int bucket = 0;
+
+  s.count++;
+  s.wall_time += wall_time;
+  s.cpu_time += cpu_time;
+  s.response_bytes += response_len;
+  s.record_lookups += record_lookups;
+  if (wall_time > s.max_wall_time)
+    s.max_wall_time = wall_time;
+
+  while (bucket < STATS_HISTOGRAM_BUCKETS - 1
+	 && wall_time >= ((int64_t) 1000 << bucket))
+    bucket++;
+  s.histogram[bucket]++;
+}
+
+static void
+record_cache_init_stats (int64_t time)
+{
+  stats_cache_inits++;
+  stats_cache_init_time += time;
+  if (time > stats_cache_init_max_time)
+    stats_cache_init_max_time = time;
+}
+
+void
+cmd_get_stats ()
+{
+  response.encode_int (stats_cache_inits);
+  response.encode_int64 (stats_cache_init_time);
+  response.encode_int64 (stats_cache_init_max_time);
+  response.encode_int64 (stats_record_lookups);
+  response.encode_int (STATS_HISTOGRAM_BUCKETS);
+
+  for (int cmd = 0; cmd < APTCMD_MAX; cmd++)
+    {
+      command_stats &s = stats[cmd];
+
+      if (s.count == 0)
+	continue;
+
+      response.encode_int (cmd);
+      response.encode_int (s.count);
+      response.encode_int64 (s.wall_time);
+      response.encode_int64 (s.cpu_time);
+      response.encode_int64 (s.max_wall_time);
+      response.encode_int64 (s.response_bytes);
+      response.encode_int64 (s.record_lookups);
+      for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+	response.encode_int (s.histogram[i]);
+    }
+  response.encode_int (-1);
+}
+
+/* Requests are normally handled one after the other, in the order
+   they arrive.  However, a handler for a long running request can
+   check with HIGHER_PRIORITY_REQUEST_WAITING whether a request with a
+   more urgent priority is waiting.  Doing this reads all waiting
+   requests into PENDING_REQUESTS.  The handler can then suspend
+   itself, and the dispatcher will handle the most urgent pending
+   request next.  A suspended request is resumed when no pending
+   request is more urgent than it.
+*/
+
+struct worker_request {
+  apt_request_header hdr;
+  char *buf;
+  char *response;
+  int response_len;
+  char fixed_buf[FIXED_REQUEST_BUF_SIZE];
+
+  /* Added up over all the times that the request has been worked on,
+     see record_command_stats.
+  */
+  int64_t wall_time, cpu_time, record_lookups;
+
+  /* Whether some of the response has been computed from a cache that
+     is being rebuilt.
+  */
+  bool stale;
+};
+
+static worker_request *
+read_worker_request ()
+{
+  worker_request *wr = new worker_request;
+
+  must_read (&wr->hdr, sizeof (wr->hdr));
+  wr->buf = alloc_buf (wr->hdr.len, wr->fixed_buf, FIXED_REQUEST_BUF_SIZE);
+  must_read (wr->buf, wr->hdr.len);
+  wr->response = NULL;
+  wr->response_len = 0;
+  wr->wall_time = wr->cpu_time = wr->record_lookups = 0;
+  wr->stale = false;
+
+  return wr;
+}
+
+static void
+free_worker_request (worker_request *wr)
+{
+  free_buf (wr->buf, wr->fixed_buf);
+  delete[] wr->response;
+  delete wr;
+}
+
+static bool
+input_available (int fd)
+{
+  fd_set set;
+  struct timeval timeout = { 0, 0 };
+
+  FD_ZERO (&set);
+  FD_SET (fd, &set);
+
+  return select (fd+1, &set, NULL, NULL, &timeout) > 0;
+}
+
+/* Block until a request arrives.  When the cache is being rebuilt
+   in the mean time, the new cache is swapped in as soon as it is
+   ready.
+*/
+static void
+wait_for_request ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  while (awc->cache_builder_fd >= 0)
+    {
+      fd_set set;
+      FD_ZERO (&set);
+      FD_SET (input_fd, &set);
+      FD_SET (awc->cache_builder_fd, &set);
+
+      if (select (MAX (input_fd, awc->cache_builder_fd) + 1,
+		  &set, NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("apt-worker select");
+	  exit (1);
+	}
+
+      if (!FD_ISSET (awc->cache_builder_fd, &set))
+	break;
+
+      finish_cache_rebuild ();
+    }
+}
+
+static void
+read_waiting_requests ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  while (input_available (input_fd))
+    awc->pending_requests = g_list_append (awc->pending_requests,
+					   read_worker_request ());
+}
+
+/* Return the earliest of the most urgent pending requests that are
+   more urgent than PRIORITY, or NULL when there is none.
+*/
+static GList *
+find_pending_request (int priority)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  GList *best = NULL;
+
+  for (GList *l = awc->pending_requests; l; l = l->next)
+    {
+      worker_request *wr = (worker_request *)l->data;
+      if (wr->hdr.priority < priority)
+	{
+	  best = l;
+	  priority = wr->hdr.priority;
+	}
+    }
+
+  return best;
+}
+
+bool
+higher_priority_request_waiting ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  if (awc->current_priority == APT_PRIORITY_INTERACTIVE)
+    return false;
+
+  read_waiting_requests ();
+  return find_pending_request (awc->current_priority) != NULL;
+}
 
-/** MANAGEMENT OF FILE WITH INFO ABOUT AVAILABLE UPDATES */
+void
+suspend_request ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
 
-static void write_available_updates_file ();
+  awc->suspend_current_request = true;
+  continuation.reset ();
+}
 
-/** MAPPING FUNCTION TO FILTER ERROR DETAILS
-    IN CATALOGUES CONFIGURATION FILE
-*/
-static xexp *map_catalogue_error_details (xexp *x);
+static worker_request *
+next_worker_request ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  worker_request *suspended = NULL;
+  GList *l;
 
+  if (awc->suspended_requests)
+    {
+      suspended = (worker_request *)awc->suspended_requests->data;
+      read_waiting_requests ();
+    }
 
-/* Commands can request the package cache to be refreshed by calling
-   NEED_CACHE_INIT before they return.  The cache will then be
-   reconstructed after sending the response and before starting to
-   handle the next command.  In this way, the cache reconstruction
-   happens in the background.
+  l = find_pending_request (suspended? suspended->hdr.priority : G_MAXINT);
+  if (l)
+    {
+      worker_request *wr = (worker_request *)l->data;
+      awc->pending_requests = g_list_delete_link (awc->pending_requests, l);
+      return wr;
+    }
 
-   XXX - However, APTCMD_STATUS messages are still being sent when the
-         cache is reconstructed in the background and the UI has some
-         ugly logic to deal with that.
-*/
+  if (suspended)
+    {
+      awc->suspended_requests =
+	g_slist_delete_link (awc->suspended_requests,
+			     awc->suspended_requests);
+      return suspended;
+    }
 
-void cache_init (bool with_status = true);
+  wait_for_request ();
+  return read_worker_request ();
+}
 
-void
-need_cache_init ()
+/* Keep the partial response of WR and replace its parameters with
+   CONTINUATION.
+*/
+static void
+suspend_worker_request (worker_request *wr)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  awc->init_cache_after_request = true;
-}
 
-#ifdef DEBUG_COMMANDS
-static const char *cmd_names[] = {
-  "NOOP",
-  "STATUS",
-  "GET_PACKAGE_LIST",
-  "GET_PACKAGE_INFO",
-  "GET_PACKAGE_DETAILS",
-  "CHECK_UPDATES",
-  "GET_CATALOGUES",
-  "SET_CATALOGUES",
-  "ADD_TEMP_CATALOGUES",
-  "RM_TEMP_CATALOGUES",
-  "GET_FREE_SPACE",
-  "INSTALL_CHECK",
-  "INSTALL_PACKAGE",
-  "REMOVE_CHECK",
-  "REMOVE_PACKAGE",
-  "GET_FILE_DETAILS",
-  "INSTALL_FILE",
-  "CLEAN",
-  "SAVE_BACKUP_DATA",
-  "GET_SYSTEM_UPDATE_PACKAGES",
-  "FLASH_AND_REBOOT",
-  "SET_OPTIONS",
-  "SET_ENV",
-  "THIRD_PARTY_POLICY_CHECK",
-  "AUTOREMOVE"
-};
-#endif
+  free_buf (wr->buf, wr->fixed_buf);
+  wr->hdr.len = continuation.get_len ();
+  wr->buf = alloc_buf (wr->hdr.len, wr->fixed_buf, FIXED_REQUEST_BUF_SIZE);
+  memcpy (wr->buf, continuation.get_buf (), wr->hdr.len);
+
+  wr->response_len = response.get_len ();
+  wr->response = new char[wr->response_len];
+  memcpy (wr->response, response.get_buf (), wr->response_len);
+
+  awc->suspended_requests = g_slist_prepend (awc->suspended_requests, wr);
+}
 
 void
 handle_request ()
 {
-  apt_request_header req;
-  char stack_reqbuf[FIXED_REQUEST_BUF_SIZE];
-  char *reqbuf;
+  worker_request *wr;
   AptWorkerCache * awc = 0;
   time_t last_modified = -1;
 
-  must_read (&req, sizeof (req));
+  wr = next_worker_request ();
+  apt_request_header &req = wr->hdr;
+
+  int64_t start_wall_time = wall_time ();
+  int64_t start_cpu_time = cpu_time ();
+  int64_t start_record_lookups = stats_record_lookups;
 
 #ifdef DEBUG_COMMANDS
-  DBG ("got req %s/%d/%d", cmd_names[req.cmd], req.seq, req.len);
+  DBG ("%s req %s/%d/%d/%d", wr->response? "resumed" : "got",
+       apt_proto_command_name (req.cmd), req.seq, req.len, req.priority);
 #endif
 
-  reqbuf = alloc_buf (req.len, stack_reqbuf, FIXED_REQUEST_BUF_SIZE);
-  must_read (reqbuf, req.len);
+  const char *cmd_name = apt_proto_command_name (req.cmd);
+  trace_begin (cmd_name, req.seq);
+  if (wr->response == NULL)
+    trace_request_received (req.seq);
 
   drain_fd (cancel_fd);
 
-  request.reset (reqbuf, req.len);
+  request.reset (wr->buf, req.len);
   response.reset ();
+  if (wr->response)
+    {
+      response.encode_mem (wr->response, wr->response_len);
+      delete[] wr->response;
+      wr->response = NULL;
+    }
 
   awc = AptWorkerCache::GetCurrent ();
+
+  if (awc->cache_builder_fd >= 0
+      && (!request_can_use_old_cache (req.cmd)
+	  || input_available (awc->cache_builder_fd)))
+    finish_cache_rebuild ();
+
+  if (awc->cache_builder_fd >= 0)
+    wr->stale = true;
+
   awc->init_cache_after_request = false; // let's reset it now
+  awc->current_priority = req.priority;
+  awc->suspend_current_request = false;
 
   /* Re-read domains conf file if modified */
-  last_modified = file_last_modified (PACKAGE_DOMAINS);
+  last_modified = file_last_modified (package_domains_dir);
   if (last_modified != domains_last_modified)
     read_domain_conf ();
 
@@ -1297,6 +2115,22 @@ handle_request ()
       cmd_autoremove ();
       break;
 
+    case APTCMD_GET_PACKAGE_INFOS:
+      cmd_get_package_infos ();
+      break;
+
+    case APTCMD_GET_PACKAGE_LIST_DELTA:
+      cmd_get_package_list_delta ();
+      break;
+
+    case APTCMD_GET_STATS:
+      cmd_get_stats ();
+      break;
+
+    case APTCMD_SET_TRACE_FILE:
+      cmd_set_trace_file ();
+      break;
+
     case APTCMD_EXIT:
       exit(0);
       break;
@@ -1308,19 +2142,40 @@ handle_request ()
 
   _error->DumpErrors ();
 
-  send_response_raw (req.cmd, req.seq,
-		     response.get_buf (), response.get_len ());
+  wr->wall_time += wall_time () - start_wall_time;
+  wr->cpu_time += cpu_time () - start_cpu_time;
+  wr->record_lookups += stats_record_lookups - start_record_lookups;
+
+  if (awc->suspend_current_request)
+    {
+#ifdef DEBUG_COMMANDS
+      DBG ("suspended req %s/%d", apt_proto_command_name (req.cmd), req.seq);
+#endif
+      suspend_worker_request (wr);
+    }
+  else
+    {
+      send_response_raw (req.cmd, req.seq,
+			 wr->stale ? APT_RESPONSE_STALE : 0,
+			 response.get_buf (), response.get_len ());
+
+      record_command_stats (req.cmd, wr->wall_time, wr->cpu_time,
+			    response.get_len (), wr->record_lookups);
+      trace_reply_sent (req.seq);
 
 #ifdef DEBUG_COMMANDS
-  DBG ("sent resp %s/%d/%d",
-       cmd_names[req.cmd], req.seq, response.get_len ());
+      DBG ("sent resp %s/%d/%d",
+	   apt_proto_command_name (req.cmd), req.seq, response.get_len ());
 #endif
 
-  free_buf (reqbuf, stack_reqbuf);
+      free_worker_request (wr);
+    }
+
+  trace_end (cmd_name);
 
   if (awc->init_cache_after_request)
     {
-      cache_init (false);
+      start_cache_rebuild ();
       _error->DumpErrors ();
     }
 }
@@ -1335,6 +2190,7 @@ usage ()
 {
   fprintf (stderr, "Usage: apt-worker check-for-updates [http_proxy]\n");
   fprintf (stderr, "       apt-worker rescue [package] [archives]\n");
+  fprintf (stderr, "       apt-worker bench to from status cancel options domains\n");
   exit (1);
 }
 
@@ -1508,6 +2364,8 @@ misc_init ()
 void
 set_options (const char *options)
 {
+  forget_simulation_results ();
+
   if (strchr (options, 'B'))
     flag_break_locks = true;
 
@@ -1528,6 +2386,61 @@ cmd_set_options ()
   set_options (options);
 }
 
+/* APTCMD_SET_TRACE_FILE
+ */
+
+/* The user that has started us via sudo.
+ */
+static int
+invoking_user ()
+{
+  const char *sudo_uid = getenv ("SUDO_UID");
+  if (sudo_uid)
+    return atoi (sudo_uid);
+  return getuid ();
+}
+
+/* Whether FILE is in the home directory of USER or in /tmp.
+ */
+static bool
+trace_file_allowed (const char *file, int user)
+{
+  if (file == NULL || *file != '/'
+      || strstr (file, "/../") || g_str_has_suffix (file, "/.."))
+    return false;
+
+  if (g_str_has_prefix (file, "/tmp/"))
+    return true;
+
+  struct passwd *pw = getpwuid (user);
+  if (pw == NULL || pw->pw_dir == NULL)
+    return false;
+
+  size_t len = strlen (pw->pw_dir);
+  return (len > 1
+	  && !strncmp (file, pw->pw_dir, len)
+	  && file[len] == '/');
+}
+
+void
+cmd_set_trace_file ()
+{
+  const char *file = request.decode_string_in_place ();
+  int user = invoking_user ();
+
+  if (file && *file && !trace_file_allowed (file, user))
+    {
+      log_stderr ("Refusing to trace to %s", file);
+      file = NULL;
+    }
+
+  /* The GUI has created the file already.  We only append to it so
+     that we don't leave files owned by root behind, and only when it
+     belongs to the user of the GUI.
+  */
+  trace_open (file, "apt-worker", false, user);
+}
+
 void
 cmd_set_env ()
 {
@@ -1536,6 +2449,8 @@ cmd_set_env ()
   const char *internal_mmc = request.decode_string_in_place ();
   const char *removable_mmc = request.decode_string_in_place ();
 
+  forget_simulation_results ();
+
   if (http_proxy)
     {
       setenv ("http_proxy", http_proxy, 1);
@@ -1592,11 +2507,19 @@ main (int argc, char **argv)
   argv += 1;
   argc -= 1;
 
-  if (!strcmp (argv[0], "backend"))
+  /* The "bench" mode is the "backend" mode for apt-worker-bench.  It
+     does not take the apt-worker lock, since it works on a fake root
+     that is configured via APT_CONFIG, and reads the domains from the
+     given directory.  It refuses to run as root so that it can't touch
+     the real system.
+  */
+  bool bench = !strcmp (argv[0], "bench");
+
+  if (!strcmp (argv[0], "backend") || bench)
     {
       const char *options;
 
-      if (argc != 6)
+      if (argc != (bench ? 7 : 6))
 	{
 	  log_stderr ("wrong invocation");
 	  exit (1);
@@ -1653,13 +2576,26 @@ main (int argc, char **argv)
 
       set_options (options);
 
-      /* Don't let our heavy lifting starve the UI.
-       */
-      errno = 0;
-      if (nice (20) == -1 && errno != 0)
-	log_stderr ("nice: %m");
+      if (bench)
+	{
+	  if (geteuid () == 0)
+	    {
+	      log_stderr ("refusing to run a benchmark as root");
+	      exit (1);
+	    }
+	  package_domains_dir = argv[6];
+	}
+      else
+	{
+	  /* Don't let our heavy lifting starve the UI.
+	   */
+	  errno = 0;
+	  if (nice (20) == -1 && errno != 0)
+	    log_stderr ("nice: %m");
+
+	  get_apt_worker_lock (false);
+	}
 
-      get_apt_worker_lock (false);
       misc_init ();
 
       while (true)
@@ -1780,6 +2716,18 @@ public:
   UpdateProgress (bool ws) : with_status (ws) { }
 };
 
+struct catalogue_map;
+
+enum catalogue_item_event {
+  catalogue_item_fetch,
+  catalogue_item_done,
+  catalogue_item_fail
+};
+
+static void report_catalogue_item (catalogue_map *map,
+				   pkgAcquire::ItemDesc &Itm,
+				   catalogue_item_event event);
+
 class DownloadStatus : public pkgAcquireStatus
 {
   virtual bool
@@ -1788,6 +2736,30 @@ class DownloadStatus : public pkgAcquireStatus
     return false;
   }
 
+  virtual void
+  Fetch (pkgAcquire::ItemDesc &Itm)
+  {
+    report_catalogue_item (catalogues, Itm, catalogue_item_fetch);
+  }
+
+  virtual void
+  IMSHit (pkgAcquire::ItemDesc &Itm)
+  {
+    report_catalogue_item (catalogues, Itm, catalogue_item_done);
+  }
+
+  virtual void
+  Done (pkgAcquire::ItemDesc &Itm)
+  {
+    report_catalogue_item (catalogues, Itm, catalogue_item_done);
+  }
+
+  virtual void
+  Fail (pkgAcquire::ItemDesc &Itm)
+  {
+    report_catalogue_item (catalogues, Itm, catalogue_item_fail);
+  }
+
   virtual bool
   Pulse (pkgAcquire *Owner)
   {
@@ -1802,6 +2774,14 @@ class DownloadStatus : public pkgAcquireStatus
 
     return true;
   }
+
+public:
+  /* When downloading indexes, the catalogues that the items belong
+     to.  Their progress is reported with op_catalogue.
+   */
+  catalogue_map *catalogues;
+
+  DownloadStatus () : catalogues (NULL) { }
 };
 
 bool
@@ -1895,6 +2875,160 @@ check_cache_state (const char *package, bool is_install)
   return false;
 }
 
+/* Incremented each time the cache has been reopened.  See
+   APTCMD_GET_PACKAGE_LIST_DELTA.
+*/
+static int cache_generation = 0;
+
+/* The results of simulated operations are remembered so that
+   repeated questions about the same package do not need to mark the
+   cache again.  This happens a lot when browsing: the list views, the
+   details dialog and the confirmation dialogs all ask about the same
+   packages in turn.
+
+   A result is whatever the command computes from the marked cache,
+   as raw bytes.  It is identified by the kind of simulation, the
+   cache generation, and the package and version.  At most
+   SIMULATION_RESULTS_MAX results are kept; the least recently used
+   one is dropped first.  The results are forgotten when the domains
+   or options change.
+*/
+
+#define SIMULATION_RESULTS_MAX 64
+
+enum simulation_kind {
+  sim_package_info,
+  sim_package_info_installable,
+  sim_install_check,
+  sim_third_party_policy,
+  sim_package_details    // plus the summary kind, must be last
+};
+
+struct simulation_result {
+  char *key;
+  char *data;
+  int len;
+  GList *lru_link;
+};
+
+static GHashTable *simulation_results;
+static GQueue simulation_results_lru = G_QUEUE_INIT;
+static int simulation_results_hits, simulation_results_misses;
+
+static void
+free_simulation_result (gpointer data)
+{
+  simulation_result *r = (simulation_result *)data;
+  g_queue_delete_link (&simulation_results_lru, r->lru_link);
+  g_free (r->key);
+  g_free (r->data);
+  delete r;
+}
+
+static char *
+simulation_result_key (int kind, const char *package, const char *version)
+{
+  return g_strdup_printf ("%d %d %s %s", kind, cache_generation,
+			  package, version? version : "");
+}
+
+static void
+forget_simulation_results ()
+{
+  if (simulation_results)
+    g_hash_table_remove_all (simulation_results);
+}
+
+/* Return the result of KIND for PACKAGE and VERSION and store its
+   length in LEN, or return NULL when it is not known.
+*/
+static const char *
+find_simulation_result (int kind, const char *package, const char *version,
+			int *len)
+{
+  simulation_result *r = NULL;
+
+  if (simulation_results)
+    {
+      char *key = simulation_result_key (kind, package, version);
+      r = (simulation_result *) g_hash_table_lookup (simulation_results, key);
+      g_free (key);
+    }
+
+  if (r == NULL)
+    {
+      simulation_results_misses++;
+      DBG ("simulation results: miss %d %s (%d hits, %d misses)",
+	   kind, package, simulation_results_hits, simulation_results_misses);
+      return NULL;
+    }
+
+  simulation_results_hits++;
+  DBG ("simulation results: hit %d %s (%d hits, %d misses)",
+       kind, package, simulation_results_hits, simulation_results_misses);
+
+  g_queue_unlink (&simulation_results_lru, r->lru_link);
+  g_queue_push_head_link (&simulation_results_lru, r->lru_link);
+
+  *len = r->len;
+  return r->data;
+}
+
+static void
+remember_simulation_result (int kind, const char *package,
+			    const char *version, const void *data, int len)
+{
+  if (simulation_results == NULL)
+    simulation_results = g_hash_table_new_full (g_str_hash, g_str_equal,
+						NULL, free_simulation_result);
+
+  simulation_result *r = new simulation_result;
+  r->key = simulation_result_key (kind, package, version);
+  r->data = (char *) g_malloc (len);
+  memcpy (r->data, data, len);
+  r->len = len;
+  g_queue_push_head (&simulation_results_lru, r);
+  r->lru_link = simulation_results_lru.head;
+
+  g_hash_table_replace (simulation_results, r->key, r);
+
+  while (g_queue_get_length (&simulation_results_lru)
+	 > SIMULATION_RESULTS_MAX)
+    {
+      simulation_result *old =
+	(simulation_result *) g_queue_peek_tail (&simulation_results_lru);
+      g_hash_table_remove (simulation_results, old->key);
+    }
+}
+
+/* Append the known result of KIND for PACKAGE and VERSION to
+   RESPONSE.  Returns false when the result is not known.
+*/
+static bool
+replay_simulation_result (int kind, const char *package, const char *version)
+{
+  int len;
+  const char *data = find_simulation_result (kind, package, version, &len);
+
+  if (data == NULL)
+    return false;
+
+  response.encode_mem (data, len);
+  return true;
+}
+
+/* Remember everything that has been put into RESPONSE after the
+   first START bytes as the result of KIND for PACKAGE and VERSION.
+*/
+static void
+remember_simulation_response (int kind, const char *package,
+			      const char *version, int start)
+{
+  remember_simulation_result (kind, package, version,
+			      response.get_buf () + start,
+			      response.get_len () - start);
+}
+
 /* Initialize libapt-pkg if this has not been done already and
    (re-)create PACKAGE_CACHE.  If the cache can not be created,
    PACKAGE_CACHE is set to NULL and an appropriate message is output.
@@ -1932,6 +3066,8 @@ cache_init (bool with_status)
   awc->cache = new myCacheFile;
 
   DBG ("init.");
+  trace_begin ("cache_init");
+  int64_t start_time = wall_time ();
   if (!awc->cache->Open (progress))
     {
       DBG ("failed.");
@@ -1939,22 +3075,127 @@ cache_init (bool with_status)
       delete awc->cache;
       awc->cache = 0;
     }
+  record_cache_init_stats (wall_time () - start_time);
+  trace_end ("cache_init");
+
+  if (awc->cache)
+    {
+      /* We create a ActionGroup here that is active for the whole
+	 lifetime of the cache.  This prevents libapt-pkg from
+	 performing certain expensive operations that we don't need to
+	 be done intermediately, such as garbage collection.
+      */
+      pkgDepCache &cache = *awc->cache;
+      awc->action_group = new pkgDepCache::ActionGroup (cache);
+      cache_generation++;
+      forget_simulation_results ();
+    }
+
+  cache_reset ();
+
+  if (awc->cache)
+    write_available_updates_file ();
+}
+
+/* Start generating the binary caches for the next package cache in
+   a child process.  The current cache stays usable for the requests
+   that only read from it.  FINISH_CACHE_REBUILD will open the new
+   cache when the child is done.
+
+   If the child can not be started, the cache is reconstructed right
+   away by CACHE_INIT.
+*/
+void
+start_cache_rebuild ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  int fds[2];
+  pid_t pid;
+
+  if (awc->cache_builder_fd >= 0)
+    finish_cache_rebuild ();
+
+  if (awc->cache == NULL)
+    {
+      cache_init (false);
+      return;
+    }
+
+  _error->DumpErrors ();
+  clear_dpkg_updates ();
+
+  if (pipe (fds) < 0)
+    {
+      perror ("pipe");
+      cache_init (false);
+      return;
+    }
+
+  if ((pid = fork ()) < 0)
+    {
+      perror ("fork");
+      close (fds[0]);
+      close (fds[1]);
+      cache_init (false);
+      return;
+    }
+
+  if (pid == 0)
+    {
+      OpProgress progress;
+      pkgSourceList List;
+
+      close (fds[0]);
+      if (List.ReadMainList ()
+	  && pkgCacheGenerator::MakeStatusCache (List, &progress))
+	_exit (0);
+      _error->DumpErrors ();
+      _exit (1);
+    }
+
+  close (fds[1]);
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+
+  DBG ("cache builder %d started", pid);
+
+  awc->cache_builder = pid;
+  awc->cache_builder_fd = fds[0];
+  awc->cache->superseded = true;
+}
+
+/* Wait for the child started by START_CACHE_REBUILD and replace the
+   current cache with a new one.  Opening the new cache is quick
+   since the binary caches are up-to-date.  If the child has failed,
+   CACHE_INIT will do all the work itself.
+*/
+void
+finish_cache_rebuild ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  int status;
+
+  if (awc->cache_builder_fd < 0)
+    return;
 
-  if (awc->cache)
+  close (awc->cache_builder_fd);
+  awc->cache_builder_fd = -1;
+
+  while (waitpid (awc->cache_builder, &status, 0) < 0)
     {
-      /* We create a ActionGroup here that is active for the whole
-	 lifetime of the cache.  This prevents libapt-pkg from
-	 performing certain expensive operations that we don't need to
-	 be done intermediately, such as garbage collection.
-      */
-      pkgDepCache &cache = *awc->cache;
-      awc->action_group = new pkgDepCache::ActionGroup (cache);
+      if (errno != EINTR)
+	{
+	  perror ("waitpid");
+	  break;
+	}
     }
+  awc->cache_builder = -1;
 
-  cache_reset ();
+  DBG ("cache builder done");
 
-  if (awc->cache)
-    write_available_updates_file ();
+  cache_init (false);
+  _error->DumpErrors ();
+
+  send_status (op_cache_changed, 0, 0, -1);
 }
 
 bool
@@ -1990,6 +3231,124 @@ is_related (pkgCache::PkgIterator &pkg)
   return awc->cache->extra_info[pkg->ID].related;
 }
 
+/* Record that the marks or the extra_info of PKG are about to be
+   changed.  The functions that look at the result of an operation
+   only need to consider the dirty packages and their reverse
+   dependencies.
+*/
+static void
+mark_dirty (pkgCache::PkgIterator pkg)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  if (awc->cache->extra_info[pkg->ID].dirty)
+    return;
+
+  awc->cache->extra_info[pkg->ID].dirty = true;
+  g_ptr_array_add (awc->cache->dirty, (pkgCache::Package *) pkg);
+}
+
+/* Record that packages are changed in ways that are not tracked,
+   such as by the pkgProblemResolver.
+*/
+static void
+mark_all_dirty ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  awc->cache->dirty_all = true;
+}
+
+/* Put the dirty packages into PKGS, or all packages when they are
+   not known.
+*/
+static void
+get_dirty_packages (std::vector<pkgCache::PkgIterator> &pkgs)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+
+  pkgs.clear ();
+
+  if (awc->cache->dirty_all)
+    {
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+	pkgs.push_back (pkg);
+    }
+  else
+    {
+      GPtrArray *dirty = awc->cache->dirty;
+      for (guint i = 0; i < dirty->len; i++)
+	pkgs.push_back (pkgCache::PkgIterator (cache.GetCache (),
+					       (pkgCache::Package *)
+					       g_ptr_array_index (dirty, i)));
+    }
+}
+
+static void
+add_affected_package (std::vector<pkgCache::PkgIterator> &pkgs,
+		      GHashTable *seen, pkgCache::PkgIterator pkg)
+{
+  pkgCache::Package *p = pkg;
+
+  if (g_hash_table_lookup (seen, p))
+    return;
+
+  g_hash_table_insert (seen, p, p);
+  pkgs.push_back (pkg);
+}
+
+static void
+add_reverse_dependencies (std::vector<pkgCache::PkgIterator> &pkgs,
+			  GHashTable *seen, pkgCache::PkgIterator pkg)
+{
+  for (pkgCache::DepIterator D = pkg.RevDependsList(); !D.end(); D++)
+    add_affected_package (pkgs, seen, D.ParentPkg ());
+}
+
+static void
+add_reverse_provides (std::vector<pkgCache::PkgIterator> &pkgs,
+		      GHashTable *seen, pkgCache::VerIterator ver)
+{
+  if (ver.end ())
+    return;
+
+  for (pkgCache::PrvIterator P = ver.ProvidesList(); !P.end(); P++)
+    add_reverse_dependencies (pkgs, seen, P.ParentPkg ());
+}
+
+/* Put the packages into PKGS whose state might have been changed by
+   the current operation: the dirty packages and every package that
+   depends on them directly or via something that they provide.  These
+   are the only packages that can be newly broken.
+*/
+static void
+get_affected_packages (std::vector<pkgCache::PkgIterator> &pkgs)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  std::vector<pkgCache::PkgIterator> dirty;
+
+  get_dirty_packages (pkgs);
+  if (awc->cache->dirty_all)
+    return;
+
+  dirty.swap (pkgs);
+  GHashTable *seen = g_hash_table_new (NULL, NULL);
+
+  for (std::vector<pkgCache::PkgIterator>::iterator I = dirty.begin();
+       I != dirty.end(); I++)
+    {
+      pkgCache::PkgIterator &pkg = *I;
+
+      add_affected_package (pkgs, seen, pkg);
+      add_reverse_dependencies (pkgs, seen, pkg);
+      add_reverse_provides (pkgs, seen, pkg.CurrentVer ());
+      add_reverse_provides (pkgs, seen, cache[pkg].InstVerIter (cache));
+    }
+
+  g_hash_table_destroy (seen);
+}
+
 void
 mark_related (const pkgCache::VerIterator &ver)
 {
@@ -1999,6 +3358,7 @@ mark_related (const pkgCache::VerIterator &ver)
   if (awc->cache->extra_info[pkg->ID].related)
     return;
 
+  mark_dirty (pkg);
   awc->cache->extra_info[pkg->ID].related = true;
 
   pkgDepCache &cache = *awc->cache;
@@ -2053,8 +3413,13 @@ any_newly_or_related_broken ()
     return false;
 
   pkgDepCache &cache = *(awc->cache);
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+  std::vector<pkgCache::PkgIterator> pkgs;
+
+  get_affected_packages (pkgs);
+  for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+       I != pkgs.end(); I++)
     {
+      pkgCache::PkgIterator &pkg = *I;
       if (cache[pkg].InstBroken() &&
 	  (!cache[pkg].NowBroken() || is_related (pkg)))
 	return true;
@@ -2062,6 +3427,41 @@ any_newly_or_related_broken ()
   return false;
 }
 
+#ifdef DEBUG
+#define DIRTY_CHECK_SAMPLES 64
+
+/* Check a random sample of the packages that are not dirty and
+   complain about those that are not in their initial state.  This
+   catches places that change marks without calling mark_dirty.
+*/
+static void
+check_dirty_packages ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  int package_count = cache.GetCache ().Head().PackageCount;
+
+  if (awc->cache->dirty_all || package_count == 0)
+    return;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      if (g_random_int_range (0, package_count) >= DIRTY_CHECK_SAMPLES)
+	continue;
+
+      extra_info_struct &extra = awc->cache->extra_info[pkg->ID];
+      if (extra.dirty)
+	continue;
+
+      bool is_auto = (cache[pkg].Flags & pkgCache::Flag::Auto) != 0;
+      if (cache[pkg].Mode != pkgDepCache::ModeKeep
+	  || extra.related || extra.soft
+	  || is_auto != extra.autoinst)
+	log_stderr ("%s changed without being marked dirty", pkg.Name ());
+    }
+}
+#endif
+
 void
 cache_reset ()
 {
@@ -2069,10 +3469,22 @@ cache_reset ()
   if (awc->cache == NULL)
     return;
 
-  pkgDepCache &cache = *(awc->cache);
+  std::vector<pkgCache::PkgIterator> pkgs;
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-    cache_reset_package (pkg);
+#ifdef DEBUG
+  check_dirty_packages ();
+#endif
+
+  get_dirty_packages (pkgs);
+  for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+       I != pkgs.end(); I++)
+    {
+      cache_reset_package (*I);
+      awc->cache->extra_info[(*I)->ID].dirty = false;
+    }
+
+  g_ptr_array_set_size (awc->cache->dirty, 0);
+  awc->cache->dirty_all = false;
 
   g_free (current_cache_package);
   current_cache_package = NULL;
@@ -2096,6 +3508,7 @@ fix_soft_packages ()
     return;
 
   pkgDepCache &cache = *(awc->cache);
+  std::vector<pkgCache::PkgIterator> pkgs;
 
   bool something_changed;
 
@@ -2104,8 +3517,11 @@ fix_soft_packages ()
       DBG ("FIX");
 
       something_changed = false;
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+      get_affected_packages (pkgs);
+      for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+	   I != pkgs.end(); I++)
 	{
+	  pkgCache::PkgIterator &pkg = *I;
 	  if (cache[pkg].InstBroken())
 	    {
 	      pkgCache::DepIterator Dep =
@@ -2252,6 +3668,8 @@ mark_for_install_1 (pkgCache::PkgIterator &pkg, int level)
 
   DBG ("+ %s", pkg.Name());
 
+  mark_dirty (pkg);
+
   /* Now mark it and return if that fails.  Both ModeInstall and
      ModeKeep are fine.  ModeKeep only happens for broken packages.
    */
@@ -2391,6 +3809,7 @@ mark_for_install (pkgCache::PkgIterator &pkg)
 
       pkgProblemResolver Fix(&Cache);
 
+      mark_all_dirty ();
       Fix.Clear(pkg);
       Fix.Protect(pkg);   
 
@@ -2480,6 +3899,7 @@ mark_for_remove_1 (pkgCache::PkgIterator &pkg, bool soft)
 
   DBG ("- %s%s", pkg.Name(), soft? " (soft)" : "");
 
+  mark_dirty (pkg);
   cache.MarkDelete (pkg);
   cache[pkg].Flags &= ~pkgCache::Flag::Auto;
   awc->cache->extra_info[pkg->ID].soft = soft;
@@ -2525,6 +3945,7 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
 
       pkgProblemResolver Fix(&Cache);
 
+      mark_all_dirty ();
       Fix.Clear(pkg);
       Fix.Protect(pkg);   
 
@@ -2562,7 +3983,18 @@ struct package_record {
   void lookup(const pkgCache::VerIterator &ver)
     {
   const char *start, *stop;
-      P = &Recs.Lookup (ver.FileList ());
+      myCacheFile *cache_file = AptWorkerCache::GetCurrent ()->cache;
+      pkgCache::VerFileIterator vf = ver.FileList ();
+
+      if (cache_file->superseded && !cache_file->file_unchanged (vf.File ()))
+	{
+	  P = NULL;
+	  valid = false;
+	  return;
+	}
+
+      P = &Recs.Lookup (vf);
+      stats_record_lookups++;
 
       P->GetRec (start, stop);
 
@@ -2661,57 +4093,6 @@ package_record::get_localized_string (const char *tag)
    version.
  */
 
-bool
-name_matches_pattern (pkgCache::PkgIterator &pkg,
-		      const char *pattern)
-{
-  bool match = false;
-  char **words = g_strsplit (pattern, " ", 0);
-  int i;
-
-  if (words == NULL)
-    return false;
-
-  for (i = 0; words[i] != NULL; i++)
-    if (strcasestr (pkg.Name(), words[i]))
-      match = true;
-    else
-      {
-        match = false;
-        break;
-      }
-
-  g_strfreev (words);
-  return match;
-}
-
-bool
-description_matches_pattern (pkgCache::VerIterator &ver,
-			     const char *pattern)
-{
-  bool match = false;
-  char **words = g_strsplit (pattern, " ", 0);
-  package_record rec;
-  rec.lookup(ver);
-  const char *desc = rec.P->LongDesc().c_str();
-  int i;
-
-  if (words == NULL)
-    return false;
-
-  for (i = 0; words[i] != NULL; i++)
-    if (strcasestr (desc, words[i]))  // XXX - UTF8?
-      match = true;
-    else
-      {
-        match = false;
-        break;
-      }
-
-  g_strfreev (words);
-  return match;
-}
-
 static string
 get_description (int summary_kind,
 		 pkgCache::PkgIterator &pkg,
@@ -2863,29 +4244,324 @@ ssu_packages_set (GSList *ssu_list)
     }
 }
 
+/* The search index.
+
+   Pattern searches used to look up and parse the package record of
+   every version in the cache for every query.  Instead, the first
+   query after opening the cache builds an index of all the words in
+   the names, display names and descriptions (localized and not) of
+   the installed and candidate versions.  The index lives in
+   myCacheFile and is thus thrown away when the cache is reopened.
+
+   A "document" is one field of a package: its name, or the display
+   name, the description or the localized description of one of its
+   versions.  Words are the white space separated parts of its text,
+   lowercased.  Each distinct word has a list of the documents it
+   appears in.
+
+   A pattern matches a package when all the words of the pattern
+   appear as substrings in one of its documents, so the words can not
+   be spread over several fields.  Since the words of a
+   pattern contain no white space, they can only be substrings of
+   single words of a document, and it is enough to look through the
+   list of distinct words instead of through the full texts.
+*/
+
+struct search_index {
+  GHashTable *word_ids;      // word -> id + 1
+  GPtrArray *words;          // id -> word
+  GPtrArray *postings;       // id -> GArray of document ids
+  GArray *doc_pkgs;          // document id -> package id
+  GStringChunk *strings;
+};
+
+static gchar *
+search_index_normalize (const char *text)
+{
+  if (g_utf8_validate (text, -1, NULL))
+    return g_utf8_strdown (text, -1);
+  else
+    return g_ascii_strdown (text, -1);
+}
+
+static void
+search_index_add_text (search_index *idx, int doc, const char *text)
+{
+  gchar *lower = search_index_normalize (text);
+  gchar **words = g_strsplit_set (lower, " \t\n", 0);
+
+  for (int i = 0; words[i]; i++)
+    {
+      if (words[i][0] == '\0')
+	continue;
+
+      int id = GPOINTER_TO_INT (g_hash_table_lookup (idx->word_ids,
+						     words[i])) - 1;
+      if (id < 0)
+	{
+	  gchar *w = g_string_chunk_insert (idx->strings, words[i]);
+	  id = idx->words->len;
+	  g_ptr_array_add (idx->words, w);
+	  g_ptr_array_add (idx->postings,
+			   g_array_new (FALSE, FALSE, sizeof (int)));
+	  g_hash_table_insert (idx->word_ids, w, GINT_TO_POINTER (id + 1));
+	}
+
+      GArray *docs = (GArray *) g_ptr_array_index (idx->postings, id);
+      if (docs->len == 0 || g_array_index (docs, int, docs->len - 1) != doc)
+	g_array_append_val (docs, doc);
+    }
+
+  g_strfreev (words);
+  g_free (lower);
+}
+
+static void
+search_index_add_document (search_index *idx, pkgCache::PkgIterator &pkg,
+			   const char *text)
+{
+  int doc = idx->doc_pkgs->len;
+  int pkg_id = pkg->ID;
+
+  if (text == NULL || *text == '\0')
+    return;
+
+  g_array_append_val (idx->doc_pkgs, pkg_id);
+  search_index_add_text (idx, doc, text);
+}
+
+static void
+search_index_add_version (search_index *idx, package_record &rec,
+			  pkgCache::PkgIterator &pkg,
+			  pkgCache::VerIterator &ver)
+{
+  rec.lookup (ver);
+  if (rec.P)
+    search_index_add_document (idx, pkg, rec.P->LongDesc().c_str());
+  search_index_add_document
+    (idx, pkg, rec.get_localized_string ("Maemo-Display-Name").c_str());
+  if (lc_messages && *lc_messages)
+    search_index_add_document
+      (idx, pkg, rec.get_localized_string ("Description").c_str());
+}
+
+static search_index *
+search_index_build ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  search_index *idx = new search_index;
+  package_record rec;
+
+  idx->word_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  idx->words = g_ptr_array_new ();
+  idx->postings = g_ptr_array_new ();
+  idx->doc_pkgs = g_array_new (FALSE, FALSE, sizeof (int));
+  idx->strings = g_string_chunk_new (16 * 1024);
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+      if (installed.end () && candidate.end ())
+	continue;
+
+      search_index_add_document (idx, pkg, pkg.Name ());
+      if (!installed.end ())
+	search_index_add_version (idx, rec, pkg, installed);
+      if (!candidate.end () && candidate != installed)
+	search_index_add_version (idx, rec, pkg, candidate);
+    }
+
+  DBG ("search index: %d documents, %d words",
+       idx->doc_pkgs->len, idx->words->len);
+
+  return idx;
+}
+
 void
-cmd_get_package_list ()
+search_index_free (search_index *idx)
+{
+  if (idx == NULL)
+    return;
+
+  for (unsigned i = 0; i < idx->postings->len; i++)
+    g_array_free ((GArray *) g_ptr_array_index (idx->postings, i), TRUE);
+  g_ptr_array_free (idx->postings, TRUE);
+  g_ptr_array_free (idx->words, TRUE);
+  g_hash_table_destroy (idx->word_ids);
+  g_array_free (idx->doc_pkgs, TRUE);
+  g_string_chunk_free (idx->strings);
+  delete idx;
+}
+
+/* Return a newly allocated array with one entry per package in the
+   cache, telling whether that package matches PATTERN.  Free it with
+   g_free.
+*/
+static gboolean *
+search_index_match (const char *pattern)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  bool only_user = request.decode_int ();
-  bool only_installed = request.decode_int ();
-  bool only_available = request.decode_int ();
-  const char *pattern = request.decode_string_in_place ();
-  bool show_magic_sys = request.decode_int ();
-  GSList *ssu_pkgs_found = NULL;
+  myCacheFile *cache_file = awc->cache;
+  pkgDepCache &cache = *cache_file;
+  int package_count = cache.Head().PackageCount;
+  gboolean *matches = g_new0 (gboolean, package_count);
+
+  if (cache_file->search == NULL)
+    cache_file->search = search_index_build ();
+  search_index *idx = cache_file->search;
+
+  gchar *lower = search_index_normalize (pattern);
+  gchar **pattern_words = g_strsplit (lower, " ", 0);
+  int n_docs = idx->doc_pkgs->len;
+  int *hits = g_new0 (int, n_docs);
+  int *seen = g_new0 (int, n_docs);
+  int n_words = 0;
+
+  /* HITS counts for each document how many of the pattern words have
+     been found in it.  SEEN avoids counting a document twice for the
+     same pattern word.
+  */
+  for (int i = 0; pattern_words[i]; i++)
+    {
+      /* Empty words match everything.
+       */
+      if (pattern_words[i][0] == '\0')
+	continue;
 
-  if (!ensure_cache (true))
+      n_words++;
+      for (unsigned id = 0; id < idx->words->len; id++)
+	{
+	  if (!strstr ((char *) g_ptr_array_index (idx->words, id),
+		       pattern_words[i]))
+	    continue;
+
+	  GArray *docs = (GArray *) g_ptr_array_index (idx->postings, id);
+	  for (unsigned j = 0; j < docs->len; j++)
+	    {
+	      int doc = g_array_index (docs, int, j);
+	      if (seen[doc] != n_words && hits[doc] == n_words - 1)
+		{
+		  seen[doc] = n_words;
+		  hits[doc]++;
+		}
+	    }
+	}
+    }
+
+  if (pattern_words[0] != NULL)
+    for (int doc = 0; doc < n_docs; doc++)
+      if (hits[doc] == n_words)
+	matches[g_array_index (idx->doc_pkgs, int, doc)] = TRUE;
+
+  g_free (seen);
+  g_free (hits);
+  g_strfreev (pattern_words);
+  g_free (lower);
+
+  return matches;
+}
+
+/* Support for APTCMD_GET_PACKAGE_LIST_DELTA.
+
+   When NEW_HASHES is non-NULL, a hash of the entry for NAME that has
+   just been encoded, starting at START, is stored in it, and the
+   position of the entry is appended to ENTRIES.  When OLD_HASHES is
+   also non-NULL and has the same hash for NAME, the entry is marked
+   as unchanged.  Unchanged entries are taken out of the response by
+   drop_unchanged_entries once the whole list has been encoded.
+*/
+
+struct package_list_entry_pos {
+  int start;
+  bool unchanged;
+};
+
+static guint
+hash_bytes (const char *buf, int len)
+{
+  /* FNV-1a */
+  guint h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char) buf[i]) * 16777619u;
+  return h;
+}
+
+static void
+finish_package_list_entry (const char *name, int start,
+			   GHashTable *old_hashes, GHashTable *new_hashes,
+			   GArray *entries)
+{
+  if (new_hashes == NULL)
+    return;
+
+  guint h = hash_bytes (response.get_buf () + start,
+			response.get_len () - start);
+  g_hash_table_insert (new_hashes, g_strdup (name), GUINT_TO_POINTER (h));
+
+  package_list_entry_pos pos;
+  gpointer old_h;
+
+  pos.start = start;
+  pos.unchanged = (old_hashes
+		   && g_hash_table_lookup_extended (old_hashes, name,
+						    NULL, &old_h)
+		   && GPOINTER_TO_UINT (old_h) == h);
+  g_array_append_val (entries, pos);
+}
+
+static void
+drop_unchanged_entries (GArray *entries)
+{
+  char *buf = response.get_buf ();
+  int end = response.get_len ();
+  int dst = (entries->len > 0
+	     ? g_array_index (entries, package_list_entry_pos, 0).start
+	     : end);
+
+  for (unsigned i = 0; i < entries->len; i++)
     {
-      response.encode_int (0);
-      return;
+      package_list_entry_pos &pos =
+	g_array_index (entries, package_list_entry_pos, i);
+      int len = ((i + 1 < entries->len
+		  ? g_array_index (entries, package_list_entry_pos, i+1).start
+		  : end)
+		 - pos.start);
+
+      if (!pos.unchanged)
+	{
+	  memmove (buf + dst, buf + pos.start, len);
+	  dst += len;
+	}
     }
 
-  response.encode_int (1);
+  response.truncate (dst);
+}
+
+/* Encode the package list entries for GET_PACKAGE_LIST and
+   GET_PACKAGE_LIST_DELTA.  Returns false when the request has been
+   cancelled in the middle.
+*/
+static bool
+encode_package_list (bool only_user, bool only_installed,
+		     bool only_available, const char *pattern,
+		     bool show_magic_sys,
+		     GHashTable *old_hashes, GHashTable *new_hashes,
+		     GArray *entries)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  GSList *ssu_pkgs_found = NULL;
   pkgDepCache &cache = *(awc->cache);
 
   package_record irec;
   package_record crec;
 
+  gboolean *pattern_matches = NULL;
+  if (pattern)
+    pattern_matches = search_index_match (pattern);
+
   for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
     {
       int flags = 0;
@@ -2893,7 +4569,12 @@ cmd_get_package_list ()
       bool irec_looked = false;
 
       if (read_byte (cancel_fd) >= 0)
-        return;
+        {
+          g_free (pattern_matches);
+          g_slist_foreach (ssu_pkgs_found, (GFunc) g_free, NULL);
+          g_slist_free (ssu_pkgs_found);
+          return false;
+        }
 
       /* Get installed and candidate iterators for current package */
       pkgCache::VerIterator installed = pkg.CurrentVer ();
@@ -2934,10 +4615,7 @@ cmd_get_package_list ()
 
       // skip packages that don't match the pattern if requested
       //
-      if (pattern
-	  && !(name_matches_pattern (pkg, pattern)
-	       || (!iend && description_matches_pattern (installed, pattern))
-	       || (!cend && description_matches_pattern (candidate, pattern))))
+      if (pattern_matches && !pattern_matches[pkg->ID])
 	continue;
 
       // Look for the SSU package if needed
@@ -2972,6 +4650,8 @@ cmd_get_package_list ()
             }
         }
 
+      int entry_start = response.get_len ();
+
       // Name
       response.encode_string (pkg.Name ());
 
@@ -3019,6 +4699,9 @@ cmd_get_package_list ()
 	  flags = get_flags (crec);
 	}
       response.encode_int (flags);
+
+      finish_package_list_entry (pkg.Name (), entry_start,
+				 old_hashes, new_hashes, entries);
     }
 
   /* Update the global GArray, if needed */
@@ -3037,12 +4720,16 @@ cmd_get_package_list ()
       ssu_packages_needs_refresh = false;
     }
 
+  g_free (pattern_matches);
+
   if (show_magic_sys)
     {
       // Append the "magic:sys" package that represents all system
       // packages.  This artificial package is identified by its name
       // and handled specially by MARK_NAMED_PACKAGE_FOR_INSTALL, etc.
 
+      int entry_start = response.get_len ();
+
       // Name
       response.encode_string ("magic:sys");
 
@@ -3063,7 +4750,203 @@ cmd_get_package_list ()
       response.encode_string ("Operating System");
       response.encode_string ("Updates to all system packages");
       response.encode_string (NULL);
+
+      // Flags
+      response.encode_int (0);
+
+      finish_package_list_entry ("magic:sys", entry_start,
+				 old_hashes, new_hashes, entries);
+    }
+
+  return true;
+}
+
+void
+cmd_get_package_list ()
+{
+  bool only_user = request.decode_int ();
+  bool only_installed = request.decode_int ();
+  bool only_available = request.decode_int ();
+  const char *pattern = request.decode_string_in_place ();
+  bool show_magic_sys = request.decode_int ();
+
+  if (!ensure_cache (true))
+    {
+      response.encode_int (0);
+      return;
+    }
+
+  response.encode_int (1);
+  encode_package_list (only_user, only_installed, only_available,
+		       pattern, show_magic_sys, NULL, NULL, NULL);
+}
+
+/* APTCMD_GET_PACKAGE_LIST_DELTA
+
+   DELTA_HASHES holds the hashes of the entries sent in the last reply
+   to this command, which was for DELTA_GENERATION and the parameters
+   in DELTA_FILTER.
+*/
+
+static GHashTable *delta_hashes = NULL;
+static int delta_generation = 0;
+static int delta_filter = -1;
+
+/* Whether PACKAGE_LIST_SNAPSHOT_FILE has the list that DELTA_HASHES
+   describes.
+*/
+static bool snapshot_up_to_date = false;
+
+/* Write the package list entries in BUF to PACKAGE_LIST_SNAPSHOT_FILE.
+   See apt-worker-proto.h for the format.  The file is replaced
+   atomically, and only after the new contents are on disk.
+*/
+static bool
+write_package_list_snapshot (int filter, const char *buf, int len)
+{
+  apt_proto_snapshot_header header;
+  int terminator = -1;
+
+  memset (&header, 0, sizeof (header));
+  strncpy (header.magic, APT_PROTO_SNAPSHOT_MAGIC, sizeof (header.magic));
+  header.version = APT_PROTO_SNAPSHOT_VERSION;
+  header.filter = filter;
+  header.len = len + sizeof (terminator);
+
+  char *tmp = g_strdup_printf ("%s.new", PACKAGE_LIST_SNAPSHOT_FILE);
+  FILE *f = fopen (tmp, "w");
+  bool ok = false;
+
+  if (f)
+    {
+      ok = (fwrite (&header, sizeof (header), 1, f) == 1
+	    && fwrite (buf, 1, len, f) == (size_t) len
+	    && fwrite (&terminator, sizeof (terminator), 1, f) == 1
+	    && fflush (f) == 0
+	    && fsync (fileno (f)) == 0);
+      if (fclose (f) != 0)
+	ok = false;
+      if (ok)
+	ok = (rename (tmp, PACKAGE_LIST_SNAPSHOT_FILE) == 0);
+    }
+
+  if (!ok)
+    {
+      log_stderr ("Can't write %s: %m", PACKAGE_LIST_SNAPSHOT_FILE);
+      unlink (tmp);
+    }
+
+  g_free (tmp);
+  return ok;
+}
+
+static void
+collect_removed_package (gpointer key, gpointer value, gpointer data)
+{
+  GHashTable *new_hashes = (GHashTable *)data;
+
+  if (!g_hash_table_lookup_extended (new_hashes, key, NULL, NULL))
+    response.encode_string ((const char *)key);
+}
+
+void
+cmd_get_package_list_delta ()
+{
+  bool only_user = request.decode_int ();
+  bool only_installed = request.decode_int ();
+  bool only_available = request.decode_int ();
+  bool show_magic_sys = request.decode_int ();
+  int known_generation = request.decode_int ();
+  int filter = apt_proto_package_list_filter (only_user, only_installed,
+					      only_available, show_magic_sys);
+
+  if (!ensure_cache (true))
+    {
+      response.encode_int (0);
+      return;
+    }
+
+  response.encode_int (1);
+
+  bool is_delta = (delta_hashes != NULL
+		   && known_generation == delta_generation
+		   && filter == delta_filter);
+
+  /* Nothing can have changed when the cache has not been reopened
+     since the frontend got its list.
+  */
+  if (is_delta
+      && delta_generation == cache_generation
+      && !ssu_packages_needs_refresh)
+    {
+      response.encode_int (cache_generation);
+      response.encode_int (1);
+      response.encode_string (NULL);
+      response.encode_string (NULL);
+      return;
+    }
+
+  GHashTable *new_hashes = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, NULL);
+  GArray *entries = g_array_new (FALSE, FALSE,
+				 sizeof (package_list_entry_pos));
+
+  response.encode_int (cache_generation);
+  response.encode_int (is_delta);
+
+  int entries_start = response.get_len ();
+
+  if (!encode_package_list (only_user, only_installed, only_available,
+			    NULL, show_magic_sys,
+			    is_delta ? delta_hashes : NULL, new_hashes,
+			    entries))
+    {
+      /* Cancelled.  The frontend will not get a usable list, so make
+	 sure that the next request gets a full one.
+      */
+      g_array_free (entries, TRUE);
+      g_hash_table_destroy (new_hashes);
+      if (delta_hashes)
+	g_hash_table_destroy (delta_hashes);
+      delta_hashes = NULL;
+      return;
     }
+
+  /* At this point, the response contains the complete list.  It
+     only needs to be written to the snapshot when it differs from the
+     previous one.  When all entries are unchanged and there are as
+     many as before, none has been removed either.
+  */
+  bool changed = (!is_delta
+		  || (g_hash_table_size (new_hashes)
+		      != g_hash_table_size (delta_hashes)));
+  for (unsigned i = 0; !changed && i < entries->len; i++)
+    if (!g_array_index (entries, package_list_entry_pos, i).unchanged)
+      changed = true;
+
+  if (changed || !snapshot_up_to_date)
+    snapshot_up_to_date =
+      write_package_list_snapshot (filter,
+				   response.get_buf () + entries_start,
+				   response.get_len () - entries_start);
+
+  drop_unchanged_entries (entries);
+  g_array_free (entries, TRUE);
+
+  response.encode_string (NULL);
+
+  if (is_delta)
+    g_hash_table_foreach (delta_hashes, collect_removed_package, new_hashes);
+  response.encode_string (NULL);
+
+  DBG ("package list generation %d, %s, %d bytes",
+       cache_generation, is_delta ? "delta" : "full", response.get_len ());
+
+  if (delta_hashes)
+    g_hash_table_destroy (delta_hashes);
+  delta_hashes = new_hashes;
+  delta_generation = cache_generation;
+  delta_filter = filter;
 }
 
 void
@@ -3150,11 +5033,14 @@ installable_status ()
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
   int installable_status = status_unable;
+  std::vector<pkgCache::PkgIterator> pkgs;
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
+  get_affected_packages (pkgs);
+  for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+       I != pkgs.end(); I++)
     {
+      pkgCache::PkgIterator &pkg = *I;
+
       /* If a non-related package gets newly broken, we report this as
 	 a conflict.  If a related package is broken, we take a closer
 	 look.
@@ -3184,25 +5070,28 @@ removable_status ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
+  std::vector<pkgCache::PkgIterator> pkgs;
+
+  get_affected_packages (pkgs);
+  for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+       I != pkgs.end(); I++)
     {
-      if (cache[pkg].InstBroken())
+      if (cache[*I].InstBroken())
 	return status_needed;
     }
 
   return status_unable;
 }
 
-void
-cmd_get_package_info ()
+/* Fill INFO for PACKAGE.  When HAVE_CACHE is false, only the
+   "unknown" defaults are filled in.  REC is only used as scratch space
+   and can be shared between calls.
+*/
+static void
+get_package_info_1 (const char *package, bool only_installable_info,
+		    bool have_cache, package_record &rec,
+		    apt_proto_package_info &info)
 {
-  const char *package = request.decode_string_in_place ();
-  bool only_installable_info = request.decode_int ();
-
-  apt_proto_package_info info;
-
   info.installable_status = status_unknown;
   info.download_size = 0;
   info.install_user_size_delta = 0;
@@ -3211,12 +5100,25 @@ cmd_get_package_info ()
   info.removable_status = status_unknown;
   info.remove_user_size_delta = 0;
 
-  if (ensure_cache (true))
+  int kind = (only_installable_info
+	      ? sim_package_info_installable : sim_package_info);
+  int len;
+  const char *known;
+
+  if (have_cache
+      && (known = find_simulation_result (kind, package, NULL, &len))
+      && len == sizeof (info))
+    {
+      memcpy (&info, known, sizeof (info));
+      return;
+    }
+
+  if (have_cache)
     {
       AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
       pkgDepCache &cache = *(awc->cache);
       pkgCache::PkgIterator pkg = cache.FindPkg (package);
-      package_record rec;
+      std::vector<pkgCache::PkgIterator> pkgs;
 
       // simulate install
 
@@ -3228,10 +5130,11 @@ cmd_get_package_info ()
       info.download_size = (int64_t) cache.DebSize ();
       info.install_user_size_delta = (int64_t) cache.UsrSize ();
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	   pkg.end() != true;
-	   pkg++)
+      get_dirty_packages (pkgs);
+      for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+	   I != pkgs.end(); I++)
 	{
+	  pkgCache::PkgIterator &pkg = *I;
 	  if (is_related (pkg)
 	      && (cache[pkg].Upgrade()
 		  || pkg.State() != pkgCache::PkgIterator::NeedsNothing))
@@ -3257,10 +5160,12 @@ cmd_get_package_info ()
 	      if (!pkg.end())
 		mark_for_remove (pkg);
 
-	      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-		   pkg.end() != true;
-		   pkg++)
+	      get_dirty_packages (pkgs);
+	      for (std::vector<pkgCache::PkgIterator>::iterator I =
+		     pkgs.begin();
+		   I != pkgs.end(); I++)
 		{
+		  pkgCache::PkgIterator &pkg = *I;
 		  if (cache[pkg].Delete())
 		    {
 		      pkgCache::VerIterator ver = pkg.CurrentVer ();
@@ -3286,11 +5191,71 @@ cmd_get_package_info ()
 	      info.remove_user_size_delta = (int64_t) cache.UsrSize ();
 	    }
 	}
+
+      remember_simulation_result (kind, package, NULL, &info, sizeof (info));
     }
+}
+
+void
+cmd_get_package_info ()
+{
+  const char *package = request.decode_string_in_place ();
+  bool only_installable_info = request.decode_int ();
+
+  apt_proto_package_info info;
+  package_record rec;
+
+  get_package_info_1 (package, only_installable_info,
+		      ensure_cache (true), rec, info);
 
   response.encode_mem (&info, sizeof (apt_proto_package_info));
 }
 
+/* APTCMD_GET_PACKAGE_INFOS
+
+   The batch version of APTCMD_GET_PACKAGE_INFO.  The cache is only
+   checked once and the package records are shared for the whole
+   batch.  Each package still gets its own simulated install and
+   removal, but check_cache_state takes care of not resetting the
+   cache when the same simulation is asked for again.
+
+   Between packages, the batch checks for cancellation and steps
+   aside for more urgent requests.  The names that have not been
+   handled yet are its continuation.
+*/
+
+void
+cmd_get_package_infos ()
+{
+  bool only_installable_info = request.decode_int ();
+  bool have_cache = ensure_cache (true);
+  package_record rec;
+  const char *package;
+
+  while ((package = request.decode_string_in_place ()) != NULL)
+    {
+      apt_proto_package_info info;
+
+      if (read_byte (cancel_fd) >= 0)
+	break;
+
+      if (higher_priority_request_waiting ())
+	{
+	  suspend_request ();
+	  continuation.encode_int (only_installable_info);
+	  do
+	    continuation.encode_string (package);
+	  while ((package = request.decode_string_in_place ()) != NULL);
+	  continuation.encode_string (NULL);
+	  return;
+	}
+
+      get_package_info_1 (package, only_installable_info,
+			  have_cache, rec, info);
+      response.encode_mem (&info, sizeof (apt_proto_package_info));
+    }
+}
+
 /* APTCMD_GET_PACKAGE_DETAILS
    
    Like APTCMD_GET_PACKAGE_INFO, this command performs a simulated
@@ -3735,6 +5700,12 @@ cmd_get_package_details ()
   const char *package = request.decode_string_in_place ();
   const char *version = request.decode_string_in_place ();
   int summary_kind = request.decode_int ();
+  int kind = sim_package_details + summary_kind;
+  int start = response.get_len ();
+  bool have_cache = AptWorkerCache::GetCurrent ()->cache != NULL;
+
+  if (have_cache && replay_simulation_result (kind, package, version))
+    return;
 
   if (!strcmp (package, "magic:sys"))
     {
@@ -3760,7 +5731,8 @@ cmd_get_package_details ()
           package_record rec;
           rec.lookup(ver);
 
-          response.encode_string (rec.P->Maintainer().c_str());
+          response.encode_string (rec.P
+				  ? rec.P->Maintainer().c_str() : NULL);
           response.encode_string 
             (get_long_description (summary_kind, pkg, rec).c_str());
           encode_dependencies (ver);
@@ -3782,6 +5754,9 @@ cmd_get_package_details ()
           response.encode_int (sumtype_end);  // summary
         }
     }
+
+  if (have_cache)
+    remember_simulation_response (kind, package, version, start);
 }
 
 /* APTCMD_THIRD_PARTY_POLICY_CHECK
@@ -3823,6 +5798,11 @@ cmd_third_party_policy_check ()
   const char *package = request.decode_string_in_place ();
   const char *version = request.decode_string_in_place ();
   third_party_policy_status policy_status = third_party_compatible;
+  int start = response.get_len ();
+
+  if (awc->cache
+      && replay_simulation_result (sim_third_party_policy, package, version))
+    return;
 
   if (find_package_version (awc->cache, pkg, ver, package, version))
     {
@@ -3877,127 +5857,297 @@ cmd_third_party_policy_check ()
 
   // return result
   response.encode_int (policy_status);
+
+  if (awc->cache)
+    remember_simulation_response (sim_third_party_policy, package, version,
+				  start);
 }
 
 /* APTCMD_CHECK_UPDATES
 */
 
-static GList *
-find_catalogues_for_item_desc (xexp *catalogues, string desc_uri)
-{
-  /* This is a hack to associate error messages produced during
-     downloading with a specific catalogue so that a good error report
-     can be shown to the user.
+/* The items that the pkgAcquire fetches for the indexes are mapped
+   to the catalogues that they belong to via their descriptions.  The
+   descriptions of all the index targets and the release files of
+   every source are known in advance and they are exact: apt-pkg
+   derives the descriptions of the items from them.  Only the diffs
+   of an index get descriptions of their own, and these are reduced
+   to the description of their index first.
+
+   A source can belong to more than one catalogue, when they differ
+   only in their components, so each description maps to a list of
+   catalogues.
+*/
+
+struct catalogue_progress {
+  xexp *cat;
+  int index;
+  char *name;
+  int n_items, n_done, n_failed;
+  GTimer *timer;
+};
+
+struct catalogue_map {
+  GPtrArray *catalogues;  // catalogue_progress, in order
+  GHashTable *items;      // description -> GList of catalogue_progress
+  GHashTable *states;     // pkgAcquire::Item -> catalogue_item_event
+};
 
-     DESC_URI is matched against all the catalogues and we return the
-     first hit.
+static void
+free_catalogue_progress (gpointer data, gpointer unused)
+{
+  catalogue_progress *cp = (catalogue_progress *)data;
+  g_free (cp->name);
+  if (cp->timer)
+    g_timer_destroy (cp->timer);
+  delete cp;
+}
 
-     DESC_URI matches a catalogue if it is of the form
+static void
+free_catalogue_progress_list (gpointer data)
+{
+  g_list_free ((GList *)data);
+}
 
-        URI/dists/DIST/<no-more-slashes>
+static char *
+strip_trailing_slashes (const char *str)
+{
+  char *res = g_strdup (str);
+  int len = strlen (res);
+  while (len > 0 && res[len-1] == '/')
+    res[--len] = '\0';
+  return res;
+}
 
-     or
+static bool
+catalogue_is_for_source (xexp *cat, metaIndex *meta)
+{
+  const char *dist = xexp_aref_text (cat, "dist");
+  if (dist == NULL)
+    dist = default_distribution;
 
-        URI/dists/DIST/COMP/<rest-with-slashes>
+  if (xexp_aref_text (cat, "uri") == NULL || meta->GetDist () != dist)
+    return false;
 
-     or
+  char *uri1 = strip_trailing_slashes (xexp_aref_text (cat, "uri"));
+  char *uri2 = strip_trailing_slashes (meta->GetURI ().c_str ());
+  bool res = strcmp (uri1, uri2) == 0;
+  g_free (uri1);
+  g_free (uri2);
+  return res;
+}
 
-        URI/DIST<rest-with-slashes>
+static bool
+catalogue_has_component (xexp *cat, const string &comp)
+{
+  const char *comp_element = xexp_aref_text (cat, "components");
+  bool res = false;
 
-     or
+  if (comp.empty ())
+    return true;
 
-        URIDIST (when dist is only a '/')
+  if (comp_element)
+    {
+      gchar **comps = g_strsplit_set (comp_element, " \t\n", 0);
+      for (int i = 0; comps[i] && !res; i++)
+	res = (comp == comps[i]);
+      g_strfreev (comps);
+    }
 
-     where URI and DIST are the respective elements of the catalogue,
-     and COMP is one of the components of the catalogue.
+  return res;
+}
 
-     XXX - This is not the right thing to do, of course.  Apt-pkg
-           should offer a way to easily associate user level objects
-           with acquire items.
-  */
+static void
+add_catalogue_item (catalogue_map *map, const string &desc,
+		    catalogue_progress *cp)
+{
+  GList *cps = (GList *) g_hash_table_lookup (map->items, desc.c_str ());
 
-  if (catalogues == NULL)
-    return NULL;
+  if (cps == NULL)
+    g_hash_table_insert (map->items, g_strdup (desc.c_str ()),
+			 g_list_prepend (NULL, cp));
+  else if (!g_list_find (cps, cp))
+    cps = g_list_append (cps, cp);
+}
 
-  GList *cat_glist = NULL;
+static void
+catalogue_map_init (catalogue_map *map, pkgSourceList &List,
+		    xexp *catalogues)
+{
+  map->catalogues = g_ptr_array_new ();
+  map->items = g_hash_table_new_full (g_str_hash, g_str_equal,
+				      g_free, free_catalogue_progress_list);
+  map->states = g_hash_table_new (NULL, NULL);
 
-  const char *match_uri = desc_uri.c_str ();
+  if (catalogues == NULL)
+    return;
 
-  for (xexp *cat = xexp_first (catalogues); cat; cat = xexp_rest (cat))
+  int index = 0;
+  for (xexp *cat = xexp_first (catalogues); cat;
+       cat = xexp_rest (cat), index++)
     {
-      char *uri = g_strdup (xexp_aref_text (cat, "uri"));
+      catalogue_progress *cp = new catalogue_progress;
       const char *dist = xexp_aref_text (cat, "dist");
-      const char *comp_element = xexp_aref_text (cat, "components");
-      gchar **comps = (comp_element
-		       ? g_strsplit_set (comp_element, " \t\n", 0)
-		       : NULL);
-      char *pfx = NULL;
-
-      if (dist == NULL)
-	dist = default_distribution;
 
-      while (uri[0] && uri[strlen(uri)-1] == '/')
-	uri[strlen(uri)-1] = '\0';
+      cp->cat = cat;
+      cp->index = index;
+      cp->name = g_strdup_printf ("%s %s", xexp_aref_text (cat, "uri"),
+				  dist? dist : default_distribution);
+      cp->n_items = cp->n_done = cp->n_failed = 0;
+      cp->timer = NULL;
+      g_ptr_array_add (map->catalogues, cp);
 
-      if (dist[0] && dist[strlen(dist)-1] == '/')
+      for (pkgSourceList::const_iterator I = List.begin();
+	   I != List.end(); I++)
 	{
-	  /* A simple repository without components
-	   */
+	  if (strcmp ((*I)->GetType(), "deb") != 0
+	      || !catalogue_is_for_source (cat, *I))
+	    continue;
 
-	  if (dist[0] != '/')
-	    pfx = g_strconcat (uri, "/", dist, NULL);
-	  else /* dist can be only '/' */
-	    pfx = g_strconcat (uri, dist, NULL);
+	  debReleaseIndex *meta = (debReleaseIndex *)(*I);
+	  add_catalogue_item (map, meta->MetaIndexInfo ("InRelease"), cp);
+	  add_catalogue_item (map, meta->MetaIndexInfo ("Release"), cp);
+	  add_catalogue_item (map, meta->MetaIndexInfo ("Release.gpg"), cp);
 
-	  if (g_str_has_prefix (match_uri, pfx))
-	    goto found_it;
+	  std::vector<IndexTarget> targets = meta->GetIndexTargets ();
+	  for (std::vector<IndexTarget>::const_iterator T = targets.begin();
+	       T != targets.end(); T++)
+	    {
+	      if (catalogue_has_component (cat,
+					   T->Option (IndexTarget::COMPONENT)))
+		add_catalogue_item (map, T->Description, cp);
+	    }
 	}
-      else
-	{
-	  /* A repository with components
-	   */
+    }
+}
+
+static void
+catalogue_map_free (catalogue_map *map)
+{
+  g_hash_table_destroy (map->items);
+  g_hash_table_destroy (map->states);
+  g_ptr_array_foreach (map->catalogues, free_catalogue_progress, NULL);
+  g_ptr_array_free (map->catalogues, TRUE);
+}
 
-	  pfx = g_strconcat (uri, "/dists/", dist, "/", NULL);
-	  if (!g_str_has_prefix (match_uri, pfx))
-	    goto try_next;
+/* Return the catalogues of the item with description DESC.  The diffs
+   for an index are described as "<index> <patch>.pdiff" and
+   "<index>.diff/Index".
+*/
+static GList *
+catalogue_map_lookup (catalogue_map *map, string desc)
+{
+  GList *cps = (GList *) g_hash_table_lookup (map->items, desc.c_str ());
+  if (cps)
+    return cps;
 
-	  const char *rest = match_uri + strlen (pfx);
+  const string diff_index = ".diff/Index";
+  if (desc.size () > diff_index.size ()
+      && desc.compare (desc.size () - diff_index.size (),
+		       diff_index.size (), diff_index) == 0)
+    desc.erase (desc.size () - diff_index.size ());
+  else
+    {
+      const string pdiff = ".pdiff";
+      size_t space = desc.rfind (' ');
+      if (space == string::npos
+	  || desc.size () <= pdiff.size ()
+	  || desc.compare (desc.size () - pdiff.size (),
+			   pdiff.size (), pdiff) != 0)
+	return NULL;
+      desc.erase (space);
+    }
 
-	  if (!strchr (rest, '/'))
-	    goto found_it;
+  return (GList *) g_hash_table_lookup (map->items, desc.c_str ());
+}
 
-	  if (comps)
-	    {
-	      for (int i = 0; comps[i]; i++)
-		{
-		  gchar *comp = comps[i];
+static void
+send_catalogue_status (catalogue_progress *cp, bool finished)
+{
+  static apt_proto_encoder status_response;
 
-		  if (comp[0] == '\0')
-		    continue;
+  status_response.reset ();
+  status_response.encode_int (op_catalogue);
+  status_response.encode_int (cp->n_done + cp->n_failed);
+  status_response.encode_int (cp->n_items);
+  status_response.encode_int (cp->index);
+  status_response.encode_int (cp->n_failed);
+  status_response.encode_int ((int) (g_timer_elapsed (cp->timer, NULL)
+				     * 1000));
+  status_response.encode_int (finished);
+  status_response.encode_string (cp->name);
+  send_response_raw (APTCMD_STATUS, -1, 0,
+		     status_response.get_buf (),
+		     status_response.get_len ());
+}
+
+/* Account for EVENT of the item described by ITM in the catalogues
+   of MAP that it belongs to.  The state of each item is remembered so
+   that every item is counted only once, no matter how many times it
+   is fetched.
+*/
+static void
+report_catalogue_item (catalogue_map *map, pkgAcquire::ItemDesc &Itm,
+		       catalogue_item_event event)
+{
+  if (map == NULL)
+    return;
 
-		  if (g_str_has_prefix (rest, comp)
-		      && rest[strlen(comp)] == '/')
-		    goto found_it;
-		}
-	    }
-	}
+  GList *cps = catalogue_map_lookup (map, Itm.Description);
+  if (cps == NULL)
+    return;
 
-    try_next:
-      g_strfreev (comps);
-      g_free (pfx);
-      g_free (uri);
-      continue;
+  gpointer key = Itm.Owner;
+  gpointer old_state;
+  bool known = g_hash_table_lookup_extended (map->states, key,
+					     NULL, &old_state);
+  if (known && GPOINTER_TO_INT (old_state) == event)
+    return;
+
+  g_hash_table_insert (map->states, key, GINT_TO_POINTER (event));
+
+  for (GList *l = cps; l; l = l->next)
+    {
+      catalogue_progress *cp = (catalogue_progress *)l->data;
+
+      if (cp->timer == NULL)
+	cp->timer = g_timer_new ();
+
+      if (!known)
+	cp->n_items++;
+      else if (GPOINTER_TO_INT (old_state) == catalogue_item_done)
+	cp->n_done--;
+      else if (GPOINTER_TO_INT (old_state) == catalogue_item_fail)
+	cp->n_failed--;
 
-    found_it:
-      g_strfreev (comps);
-      g_free (pfx);
-      g_free (uri);
+      if (event == catalogue_item_done)
+	cp->n_done++;
+      else if (event == catalogue_item_fail)
+	cp->n_failed++;
 
-      /* Append found item to the list */
-      cat_glist = g_list_append (cat_glist, cat);
+      send_catalogue_status (cp, false);
     }
+}
+
+/* Stop the clocks of all catalogues and report them as finished.
+ */
+static void
+finish_catalogue_map (catalogue_map *map, bool with_status)
+{
+  for (guint i = 0; i < map->catalogues->len; i++)
+    {
+      catalogue_progress *cp =
+	(catalogue_progress *) g_ptr_array_index (map->catalogues, i);
+
+      if (cp->timer == NULL)
+	continue;
 
-  return cat_glist;
+      g_timer_stop (cp->timer);
+      DBG ("%s: %d items, %d failed, %.3fs", cp->name,
+	   cp->n_items, cp->n_failed, g_timer_elapsed (cp->timer, NULL));
+      if (with_status)
+	send_catalogue_status (cp, true);
+    }
 }
 
 static bool
@@ -4023,17 +6173,39 @@ download_lists (xexp *catalogues_for_report,
 	}
     }
    
+  // Fetch from different hosts in parallel, so that a slow host
+  // doesn't hold up the others.
+  _config->CndSet ("Acquire::Queue-Mode", "host");
+  _config->CndSet ("Acquire::QueueHost::Limit", DOWNLOAD_LISTS_MAX_HOSTS);
+  _config->CndSet ("Acquire::http::Pipeline-Depth",
+		   DOWNLOAD_LISTS_PIPELINE_DEPTH);
+
   // Create the download object
+  catalogue_map catalogues;
+  catalogue_map_init (&catalogues, List, catalogues_for_report);
+
   DownloadStatus Stat;
+  Stat.catalogues = &catalogues;
   pkgAcquire Fetcher (with_status ? &Stat : NULL);
 
   // Populate it with the source selection
   if (List.GetIndexes(&Fetcher) == false)
-    return false;
+    {
+      catalogue_map_free (&catalogues);
+      return false;
+    }
    
   // Run it
-  if (Fetcher.Run() != pkgAcquire::Continue)
-    return false;
+  trace_begin ("Fetcher.Run");
+  pkgAcquire::RunResult res = Fetcher.Run();
+  trace_end ("Fetcher.Run");
+  if (res != pkgAcquire::Continue)
+    {
+      catalogue_map_free (&catalogues);
+      return false;
+    }
+
+  finish_catalogue_map (&catalogues, with_status);
 
   bool some_failed = false;
   for (pkgAcquire::ItemIterator I = Fetcher.ItemsBegin();
@@ -4044,14 +6216,14 @@ download_lists (xexp *catalogues_for_report,
 
       (*I)->Finished();
 
-      GList *cat_glist = find_catalogues_for_item_desc (catalogues_for_report,
-                                                        (*I)->DescURI());
+      GList *cat_glist =
+	catalogue_map_lookup (&catalogues, (*I)->GetItemDesc().Description);
 
       for (GList *iter = cat_glist; iter; iter = g_list_next (iter))
 	{
 	  if (iter->data != NULL)
 	    {
-	      xexp *cat = (xexp *) (iter->data);
+	      xexp *cat = ((catalogue_progress *) (iter->data))->cat;
 
 	      xexp *errors = xexp_aref (cat, "errors");
 	      if (errors == NULL)
@@ -4068,9 +6240,6 @@ download_lists (xexp *catalogues_for_report,
 	    }
 	}
 
-      if (cat_glist != NULL)
-	g_list_free (cat_glist);
-
       _error->Error ("Failed to fetch %s  %s", (*I)->DescURI().c_str(),
                      (*I)->ErrorText.c_str());
       some_failed = true;
@@ -4083,6 +6252,8 @@ download_lists (xexp *catalogues_for_report,
       Fetcher.Clean (_config->FindDir("Dir::State::lists") + "partial/");
     }
 
+  catalogue_map_free (&catalogues);
+
   if (some_failed)
     *result = rescode_partial_success;
   else
@@ -4206,7 +6377,7 @@ update_package_cache (xexp *catalogues_for_report,
       unlink_file_tree (lists_dir_old.c_str());
       _config->Set ("Dir::State::Lists", lists_val);
 
-      cache_init (with_status);
+      need_cache_init ();
     }
   else
     {
@@ -4308,6 +6479,9 @@ cmdline_check_updates (char **argv)
   request.reset (NULL, 0);
   result_code = cmd_check_updates (false);
 
+  if (awc->init_cache_after_request)
+    cache_init (false);
+
   _error->DumpErrors ();
 
   if (result_code == rescode_success
@@ -4600,14 +6774,24 @@ cmd_install_check ()
   const char *package = request.decode_string_in_place ();
   bool found = false;
   int result_code = rescode_failure;
+  int start = response.get_len ();
   
   if (ensure_cache (true))
     {
+      if (replay_simulation_result (sim_install_check, package, NULL))
+	return;
+
       found = mark_named_package_for_install (package);
       result_code = operation (true, NULL, false);
     }
 
   response.encode_int (found && result_code == rescode_success);
+
+  /* Failures are not remembered so that their error messages are
+     produced again.
+  */
+  if (found && result_code == rescode_success)
+    remember_simulation_response (sim_install_check, package, NULL, start);
 }
 
 /* APTCMD_DOWNLOAD_PACKAGE
@@ -5023,6 +7207,8 @@ cmd_autoremove ()
 
   int result_code = rescode_failure;
 
+  mark_all_dirty ();
+
   // look over the cache to see what can be removed
   for (pkgCache::PkgIterator Pkg = cache.PkgBegin (); ! Pkg.end (); ++Pkg)
     {
@@ -5095,10 +7281,63 @@ cmd_autoremove ()
 
 static const pkgSourceList *cur_sources;
 
+/* Computing the domain of an index file involves a linear search
+   through the sources and possibly parsing its InRelease file.  Since
+   get_domain is called for every package file and every VerFile when
+   the cache is opened, the results are remembered in DOMAIN_CACHE,
+   keyed by the pkgIndexFile pointer.
+
+   The table only lives as long as CUR_SOURCES: the pkgIndexFile
+   objects belong to the pkgSourceList.  When the domain came from the
+   signing key, the entry also remembers the modification time of the
+   InRelease file and is recomputed when that changes.
+*/
+
+struct domain_cache_entry {
+  domain_t domain;
+  char *inrelease_file;
+  time_t inrelease_mtime;
+};
+
+static GHashTable *domain_cache = NULL;
+static int domain_cache_hits, domain_cache_misses;
+
+static time_t
+inrelease_mtime (const char *file)
+{
+  struct stat buf;
+
+  if (stat (file, &buf) == -1)
+    return -1;
+
+  return buf.st_mtime;
+}
+
+static void
+free_domain_cache_entry (gpointer data)
+{
+  domain_cache_entry *e = (domain_cache_entry *)data;
+  g_free (e->inrelease_file);
+  delete e;
+}
+
 static void
 set_sources_for_get_domain (const pkgSourceList *sources)
 {
+  if (domain_cache)
+    {
+      DBG ("domain cache: %d hits, %d misses",
+	   domain_cache_hits, domain_cache_misses);
+      g_hash_table_destroy (domain_cache);
+      domain_cache = NULL;
+    }
+
+  domain_cache_hits = domain_cache_misses = 0;
   cur_sources = sources;
+
+  if (sources)
+    domain_cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					  NULL, free_domain_cache_entry);
 }
 
 static debReleaseIndex *
@@ -5209,9 +7448,15 @@ get_meta_info_key (debReleaseIndex *meta)
   return key;
 }
 
-static int
-get_domain (pkgIndexFile *index)
+/* When the result depends on the signing key, *INRELEASE_FILE is set
+   to the name of the InRelease file that has been consulted.  It
+   needs to be freed with g_free.
+*/
+static domain_t
+get_domain_1 (pkgIndexFile *index, char **inrelease_file)
 {
+  *inrelease_file = NULL;
+
   if (index->IsTrusted ())
     {
       debReleaseIndex *meta = find_deb_meta_index (index);
@@ -5221,6 +7466,8 @@ get_domain (pkgIndexFile *index)
 	  if (d != DOMAIN_SIGNED)
 	    return d;
 
+	  *inrelease_file =
+	    g_strdup (MetaIndexFile (meta, "InRelease").c_str ());
 	  char *key = get_meta_info_key (meta);
 	  if (key)
 	    {
@@ -5236,6 +7483,41 @@ get_domain (pkgIndexFile *index)
     return DOMAIN_UNSIGNED;
 }
 
+static int
+get_domain (pkgIndexFile *index)
+{
+  domain_cache_entry *e = NULL;
+  char *file;
+  domain_t d;
+
+  if (domain_cache)
+    {
+      e = (domain_cache_entry *) g_hash_table_lookup (domain_cache, index);
+      if (e && (e->inrelease_file == NULL
+		|| inrelease_mtime (e->inrelease_file) == e->inrelease_mtime))
+	{
+	  domain_cache_hits++;
+	  return e->domain;
+	}
+    }
+
+  domain_cache_misses++;
+  d = get_domain_1 (index, &file);
+
+  if (domain_cache)
+    {
+      e = new domain_cache_entry;
+      e->domain = d;
+      e->inrelease_file = file;
+      e->inrelease_mtime = file ? inrelease_mtime (file) : -1;
+      g_hash_table_replace (domain_cache, index, e);
+    }
+  else
+    g_free (file);
+
+  return d;
+}
+
 static bool
 domain_dominates_or_is_equal (int a, int b)
 {
@@ -5460,7 +7742,7 @@ class myDPkgPM : public pkgDPkgPM
 {
 public:
 
-  bool CheckDownloadedPkgs (bool clear_corrupted);
+  bool CheckDownloadedPkgs (bool clear_corrupted, pkgAcquire *Fetcher);
 
   bool CreateOrderList ();
 
@@ -5550,75 +7832,205 @@ myDPkgPM::CreateOrderList ()
   return true;
 }
 
+/* Checking the downloaded archives.
+
+   Only the strongest hash that the package record has is computed
+   for each archive, and the archives are checked in parallel by one
+   thread per processor.  The threads only read the files and compute
+   hashes; they don't touch any apt state.
+
+   Archives that FETCHER has just downloaded are not checked at all:
+   the acquire methods have checked their hashes while they were
+   streaming in.  Only the ones that were found on disk already need
+   to be read again.
+*/
+
+struct archive_check {
+  string file;
+  Hashes::SupportedHashes hash;
+  const char *hash_name;
+  string expected;
+  bool ok;
+};
+
+struct archive_check_queue {
+  vector<archive_check> *checks;
+  size_t next;
+  pthread_mutex_t mutex;
+};
+
+static void
+check_archive (archive_check &check)
+{
+  struct stat buf;
+  int fd = open (check.file.c_str (), O_RDONLY);
+
+  /* Archives that are missing are left to dpkg to complain about.
+     Any other failure to read an archive counts as a mismatch, so
+     that a bad read can't let a broken archive through.
+  */
+  check.ok = false;
+  if (fd < 0)
+    {
+      if (errno == ENOENT)
+	check.ok = true;
+      return;
+    }
+
+  if (fstat (fd, &buf) == 0)
+    {
+      Hashes hashes (check.hash);
+      if (hashes.AddFD (fd, buf.st_size))
+	check.ok = (hashes.GetHashString (check.hash).HashValue ()
+		    == check.expected);
+    }
+  close (fd);
+}
+
+static void *
+check_archives_thread (void *data)
+{
+  archive_check_queue *queue = (archive_check_queue *)data;
+
+  while (true)
+    {
+      pthread_mutex_lock (&queue->mutex);
+      size_t i = queue->next++;
+      pthread_mutex_unlock (&queue->mutex);
+
+      if (i >= queue->checks->size ())
+	break;
+      check_archive ((*queue->checks)[i]);
+    }
+
+  return NULL;
+}
+
+static void
+send_verify_status (int already, int total, int elapsed, bool finished)
+{
+  static apt_proto_encoder status_response;
+
+  status_response.reset ();
+  status_response.encode_int (op_verifying);
+  status_response.encode_int (already);
+  status_response.encode_int (total);
+  status_response.encode_int (elapsed);
+  status_response.encode_int (finished);
+  send_response_raw (APTCMD_STATUS, -1, 0,
+		     status_response.get_buf (),
+		     status_response.get_len ());
+}
+
 bool
-myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
+myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted, pkgAcquire *Fetcher)
 {
   bool result = true;
   package_record rec;
+  set<string> fetched;
+  vector<archive_check> checks;
+
+  for (pkgAcquire::ItemIterator I = Fetcher->ItemsBegin();
+       I != Fetcher->ItemsEnd(); I++)
+    {
+      if ((*I)->Status == pkgAcquire::Item::StatDone
+	  && (*I)->Complete && !(*I)->Local)
+	fetched.insert ((*I)->DestFile);
+    }
 
   for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
        I != pkgPackageManager::List->end(); I++)
     {
-      bool partial_result = true;
       PkgIterator Pkg(Cache,*I);
       pkgCache::VerIterator cand_ver = Cache[Pkg].CandidateVerIter(Cache);
+      archive_check check;
 
-      rec.lookup(cand_ver);
       string File = FileNames[Pkg->ID];
-      if (File.empty())
-        continue;
-      FileFd Fd (File, FileFd::ReadOnly);
-      if (_error->PendingError() == true) // return false?
+      if (File.empty() || fetched.count (File) > 0)
         continue;
 
-      Hashes hashes = Hashes();
-      hashes.AddFD(Fd.Fd(), Fd.Size());
+      rec.lookup(cand_ver);
+      if (!rec.valid)
+	continue;
+
+      check.file = File;
+      if (!(check.expected = rec.get_string("SHA256")).empty())
+	{
+	  check.hash = Hashes::SHA256SUM;
+	  check.hash_name = "SHA256";
+	}
+      else if (!(check.expected = rec.get_string("SHA1")).empty())
+	{
+	  check.hash = Hashes::SHA1SUM;
+	  check.hash_name = "SHA1";
+	}
+      else if (!(check.expected = rec.get_string("MD5sum")).empty())
+	{
+	  check.hash = Hashes::MD5SUM;
+	  check.hash_name = "MD5sum";
+	}
+      else
+	continue;
+
+      checks.push_back (check);
+    }
 
-      string file_sha256 = hashes.GetHashString(Hashes::SHA256SUM).HashValue();
-      string file_sha1 = hashes.GetHashString(Hashes::SHA1SUM).HashValue();
-      string MD5 = hashes.GetHashString(Hashes::MD5SUM).HashValue();
+  if (checks.empty ())
+    return true;
 
-      string ExpectedSHA256 = rec.get_string("SHA256");
+  GTimer *timer = g_timer_new ();
+  send_verify_status (0, checks.size (), 0, false);
 
-      if (!ExpectedSHA256.empty())
-        {
-          if (file_sha256 != ExpectedSHA256)
-            {
-              log_stderr ("File %s is corrupted (SHA256).", File.c_str());
-              partial_result = false;
-            }
-        }
-      else
-        {
-          string ExpectedSHA1 = rec.get_string("SHA1");
+  /* Making a Hashes object initializes the crypto library that
+     libapt-pkg uses, which must not happen in several threads at
+     once.
+  */
+  {
+    Hashes init (checks[0].hash);
+  }
 
-          if (!ExpectedSHA1.empty())
-            {
-              if (file_sha1 != ExpectedSHA1)
-                {
-                  log_stderr ("File %s is corrupted (SHA1).", File.c_str());
-                  partial_result = false;
-                }
-            }
-          else
-            {
-              string ExpectedMD5 = rec.get_string("MD5sum");
+  archive_check_queue queue;
+  queue.checks = &checks;
+  queue.next = 0;
+  pthread_mutex_init (&queue.mutex, NULL);
 
-              if (!ExpectedMD5.empty())
-                {
-                  if (MD5 != ExpectedMD5)
-                    {
-                      log_stderr ("File %s is corrupted (MD5sum).", File.c_str());
-                      partial_result = false;
-                    }
-                }
-            }
-        }
-      Fd.Close();
-      result = result && partial_result;
-      if (clean_corrupted && !partial_result)
-        unlink (File.c_str());
+  /* This thread does its share of the work, too.
+   */
+  long n_threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (n_threads > (long) checks.size ())
+    n_threads = checks.size ();
+
+  vector<pthread_t> threads;
+  for (long i = 1; i < n_threads; i++)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, check_archives_thread, &queue) == 0)
+	threads.push_back (thread);
+    }
+
+  check_archives_thread (&queue);
+
+  for (size_t i = 0; i < threads.size (); i++)
+    pthread_join (threads[i], NULL);
+  pthread_mutex_destroy (&queue.mutex);
+
+  for (size_t i = 0; i < checks.size (); i++)
+    {
+      if (checks[i].ok)
+	continue;
+
+      log_stderr ("File %s is corrupted (%s).",
+		  checks[i].file.c_str(), checks[i].hash_name);
+      result = false;
+      if (clean_corrupted)
+        unlink (checks[i].file.c_str());
     }
+
+  int elapsed = (int) (g_timer_elapsed (timer, NULL) * 1000);
+  g_timer_destroy (timer);
+
+  send_verify_status (checks.size (), checks.size (), elapsed, true);
+
   return result;
 }
 
@@ -5698,9 +8110,13 @@ get_pkg_required_free_space ()
   pkgDepCache &cache = *(awc->cache);
   package_record rec;
   int64_t retval = 0;
+  std::vector<pkgCache::PkgIterator> pkgs;
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin (); pkg.end () != true; pkg++)
+  get_dirty_packages (pkgs);
+  for (std::vector<pkgCache::PkgIterator>::iterator I = pkgs.begin();
+       I != pkgs.end(); I++)
     { 
+      pkgCache::PkgIterator &pkg = *I;
       if (is_related (pkg) &&
           (cache[pkg].Upgrade ()
            || pkg.State () != pkgCache::PkgIterator::NeedsNothing))
@@ -5773,6 +8189,7 @@ operation (bool check_only,
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgCacheFile &Cache = *(awc->cache);
   std::unique_ptr<myDPkgPM> Pm;
+  trace_span span ("operation");
 
   if (_config->FindB("APT::Get::Purge",false) == true)
     {
@@ -5901,7 +8318,10 @@ operation (bool check_only,
 	send_status (op_downloading, 0, (int)(FetchBytes - FetchPBytes), 0);
     }
 
-  if (Fetcher.Run() == pkgAcquire::Failed)
+  trace_begin ("Fetcher.Run");
+  pkgAcquire::RunResult fetch_result = Fetcher.Run();
+  trace_end ("Fetcher.Run");
+  if (fetch_result == pkgAcquire::Failed)
     return rescode_failure;
 
   /* Print out errors and distill the failure reasons into a
@@ -5956,16 +8376,23 @@ operation (bool check_only,
       if (with_status)
 	send_status (op_general, -1, 0, 0);
 
-      if (Pm->CheckDownloadedPkgs (true) == false)
+      trace_begin ("CheckDownloadedPkgs");
+      bool pkgs_ok = Pm->CheckDownloadedPkgs (true, &Fetcher);
+      trace_end ("CheckDownloadedPkgs");
+      if (pkgs_ok == false)
         return rescode_package_corrupted;
 
       // sync before installing
+      trace_begin ("sync");
       sync ();
+      trace_end ("sync");
 
       /* Do install */
       _system->UnLock();
       APT::Progress::PackageManagerProgressFd progress_mgr(status_fd);
+      trace_begin ("DoInstall");
       pkgPackageManager::OrderResult Res = Pm->DoInstall (&progress_mgr);
+      trace_end ("DoInstall");
       _system->Lock();
 
       awc->cache->save_extra_info ();
@@ -6069,61 +8496,6 @@ escape_for_shell (const char *str)
   return g_strdup (buf);
 }
 
-// XXX - interpret status codes
-
-static char *
-get_deb_record (const char *filename)
-{
-  char *esc_filename = escape_for_shell (filename);
-  if (esc_filename == NULL)
-    return NULL;
-
-  char *cmd = g_strdup_printf ("/usr/bin/dpkg-deb -f %s", esc_filename);
-  fprintf (stderr, "%s\n", cmd);
-  FILE *f = popen (cmd, "r");
-
-  g_free (cmd);
-  g_free (esc_filename);
-
-  if (f)
-    {
-      const size_t incr = 2000;
-      char *record = NULL;
-      size_t size = 0;
-
-      do
-	{
-	  // increase buffer and try to fill it, leaving room for the
-	  // trailing newlines and nul.
-	  // XXX - do it properly.
-
-	  char *new_record = new char[size + incr + 3];
-	  if (record)
-	    {
-	      memcpy (new_record, record, size);
-	      delete [] record;
-	    }
-	  record = new_record;
-
-	  size += fread (record + size, 1, incr, f);
-	}
-      while (!feof (f));
-
-      int status = pclose (f);
-      if (status != 0)
-	{
-	  delete [] record;
-	  return NULL;
-	}
-
-      record[size] = '\n';
-      record[size + 1] = '\n';
-      record[size + 2] = '\0';
-      return record;
-    }
-  return NULL;
-}
-
 static bool
 check_dependency (string &package, string &version, unsigned int op)
 {
@@ -6363,9 +8735,15 @@ cmd_get_file_details ()
   bool only_user = request.decode_int ();
   const char *filename = request.decode_string_in_place ();
 
-  char *record = get_deb_record (filename);
-  pkgTagSection section;
-  if (record == NULL || !section.Scan (record, strlen (record)))
+  debDebFile::MemControlExtract control ("control");
+  int fd = open (filename, O_RDONLY);
+  bool valid = fd >= 0 && read_deb_control (fd, control);
+  if (fd >= 0)
+    close (fd);
+  _error->DumpErrors ();
+
+  pkgTagSection &section = control.Section;
+  if (!valid)
     {
       response.encode_string (basename (filename));
       response.encode_string (basename (filename));
@@ -6419,8 +8797,6 @@ cmd_get_file_details ()
   if (installable_status != status_able)
     encode_missing_dependencies (section);
   response.encode_int (sumtype_end);
-
-  delete[] record;
 }
 
 void
@@ -6590,16 +8966,78 @@ clean_temp_catalogues ()
     log_stderr ("error unlinking %s: %m", TEMP_APT_SOURCE_LIST);
 }
 
+/* The entries of AVAILABLE_UPDATES_FILE are remembered across cache
+   reconstructions, keyed by package name, candidate version, whether
+   the package is in a certified domain, and the language of the
+   pretty name, so that the package records only need to be consulted
+   for new candidates.  Entries that have not been seen in the last
+   pass are dropped.
+
+   The file is only rewritten when the set of entries has changed.
+   Rewriting it wakes up the status bar plugin.
+*/
+
+struct available_update {
+  const char *cls;
+  char *name;
+  int generation;
+};
+
+static GHashTable *available_updates = NULL;
+static bool available_updates_hash_valid = false;
+static guint64 available_updates_hash;
+
+static void
+free_available_update (gpointer data)
+{
+  available_update *u = (available_update *)data;
+  g_free (u->name);
+  delete u;
+}
+
+static gboolean
+available_update_is_old (gpointer key, gpointer value, gpointer data)
+{
+  return ((available_update *)value)->generation != *(int *)data;
+}
+
+/* The hash does not depend on the order of the entries.
+ */
+static guint64
+available_update_hash (const char *cls, const char *name)
+{
+  char *str = g_strdup_printf ("%s %s", cls, name);
+  guint64 h = package_state_hash (str);
+  g_free (str);
+  return h;
+}
+
+static guint64
+available_updates_file_hash (xexp *x_updates)
+{
+  guint64 h = 0;
+
+  for (xexp *x = xexp_first (x_updates); x; x = xexp_rest (x))
+    if (xexp_is_text (x))
+      h += available_update_hash (xexp_tag (x), xexp_text (x));
+
+  return h;
+}
+
 static void
 write_available_updates_file ()
 {
   if (!ensure_cache (false))
     return;
 
-  xexp *x_updates = xexp_list_new ("updates");
-  package_record rec;
+  package_record *rec = NULL;
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
+  guint64 hash = 0;
+
+  if (available_updates == NULL)
+    available_updates = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, free_available_update);
 
   for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
     {
@@ -6633,34 +9071,92 @@ write_available_updates_file ()
 	  && is_user_package (candidate)
           && !broken)
 	{
-	  xexp *x_pkg = NULL;
-
-	  rec.lookup(candidate);
-	  int flags = get_flags (rec);
 	  int domain_index = awc->cache->extra_info[pkg->ID].cur_domain;
+	  bool is_certified = domains[domain_index].is_certified;
+	  char *key = g_strdup_printf ("%s %s %d %s", pkg.Name (),
+				       candidate.VerStr (), is_certified,
+				       lc_messages ? lc_messages : "");
+	  available_update *u =
+	    (available_update *) g_hash_table_lookup (available_updates, key);
+
+	  if (u == NULL)
+	    {
+	      if (rec == NULL)
+		rec = new package_record;
 
-          const char *pkg_name;
-          string pretty_name = get_pretty_name (rec);
-          if (!pretty_name.empty ())
-            pkg_name = pretty_name.c_str ();
-          else
-            pkg_name = pkg.Name ();
+	      rec->lookup(candidate);
+	      int flags = get_flags (*rec);
+
+	      string pretty_name = get_pretty_name (*rec);
+
+	      u = new available_update;
+	      if (!pretty_name.empty ())
+		u->name = g_strdup (pretty_name.c_str ());
+	      else
+		u->name = g_strdup (pkg.Name ());
+
+	      if (flags & pkgflag_system_update)
+		u->cls = "os";
+	      else if (is_certified)
+		u->cls = "certified";
+	      else
+		u->cls = "other";
 
-	  if (flags & pkgflag_system_update)
-	    x_pkg = xexp_text_new ("os", pkg_name);
-	  else if (domains[domain_index].is_certified)
-	    x_pkg = xexp_text_new ("certified", pkg_name);
+	      g_hash_table_insert (available_updates, key, u);
+	    }
 	  else
-	    x_pkg = xexp_text_new ("other", pkg_name);
+	    g_free (key);
+
+	  u->generation = cache_generation;
+	  hash += available_update_hash (u->cls, u->name);
+	}
+    }
+
+  delete rec;
 
-	  xexp_cons (x_updates, x_pkg);
+  g_hash_table_foreach_remove (available_updates, available_update_is_old,
+			       &cache_generation);
+
+  /* Find out what the file contains when we get here for the first
+     time.
+  */
+  if (!available_updates_hash_valid)
+    {
+      xexp *x_old = xexp_read_file (AVAILABLE_UPDATES_FILE);
+      if (x_old)
+	{
+	  available_updates_hash = available_updates_file_hash (x_old);
+	  available_updates_hash_valid = true;
+	  xexp_free (x_old);
 	}
     }
 
-  xexp_write_file (AVAILABLE_UPDATES_FILE, x_updates);
+  if (available_updates_hash_valid && hash == available_updates_hash)
+    {
+      DBG ("available updates unchanged");
+      return;
+    }
+
+  xexp *x_updates = xexp_list_new ("updates");
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init (&iter, available_updates);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    {
+      available_update *u = (available_update *)value;
+      xexp_cons (x_updates, xexp_text_new (u->cls, u->name));
+    }
+
+  if (xexp_write_file (AVAILABLE_UPDATES_FILE, x_updates))
+    {
+      available_updates_hash = hash;
+      available_updates_hash_valid = true;
+    }
+  else
+    available_updates_hash_valid = false;
 
-  if (x_updates)
-    xexp_free (x_updates);
+  xexp_free (x_updates);
 }
 
 static xexp *
@@ -616,10 +616,10 @@ domain_equal (xexp *a, xexp *b)
 }
 
 xexp*
-read_domains (void)
+read_domains (const char *dir)
 {
   xexp *global = xexp_list_new ("domains");
-  read_package_config_files (global, PACKAGE_DOMAINS, NULL);
+  read_package_config_files (global, dir, NULL);
 
   return global;
 }
@@ -130,9 +130,10 @@ void backup_catalogues ();
 /* Domains
  */
 
-/* Reads the package domains and merges them with the user's domains.
+/* Reads the package domains from DIR and merges them with the user's
+   domains.
  */
-xexp *read_domains (void);
+xexp *read_domains (const char *dir = PACKAGE_DOMAINS);
 
 /* Returns true if both domians are equal.
  */
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <apt-pkg/fileutl.h>
+#include <apt-pkg/error.h>
+
+#include "deb-control.h"
+
+bool
+read_deb_control (int fd, debDebFile::MemControlExtract &control)
+{
+  FileFd file;
+
+  if (!file.OpenDescriptor (fd, FileFd::ReadOnly, FileFd::None, false))
+    return false;
+
+  debDebFile deb (file);
+  if (_error->PendingError ())
+    return false;
+
+  if (!control.Read (deb) || control.Control == NULL)
+    return false;
+
+  return true;
+}
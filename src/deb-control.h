@@ -0,0 +1,44 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef DEB_CONTROL_H
+#define DEB_CONTROL_H
+
+#include <apt-pkg/debfile.h>
+
+/* Read the control record of the .deb that is open on FD into
+   CONTROL.  CONTROL.Section is the parsed record and points into
+   CONTROL.Control.  FD must be positioned at the start of the file
+   and is not closed.
+
+   This uses the ar and tar readers of libapt-pkg.  They stream the
+   control.tar member through the right decompressor, whether it is
+   gzip, xz or zstd, and stop as soon as the control file has been
+   read, so the data.tar member is never touched.
+
+   Returns false when FD is not a .deb or its control file can't be
+   parsed.  The reasons are in _error.
+*/
+bool read_deb_control (int fd, debDebFile::MemControlExtract &control);
+
+#endif /* !DEB_CONTROL_H */
@@ -403,6 +403,15 @@ spd_get_details (void *data)
 				  c->kind, spd_get_details_reply, c);
 }
 
+static void
+spd_get_details_again (void *data)
+{
+  /* The dialog might have been closed in the meantime.
+   */
+  if (current_spd_clos == data)
+    spd_get_details (data);
+}
+
 static void
 spd_get_details_reply (int cmd, apt_proto_decoder *dec, void *data)
 {
@@ -413,6 +422,14 @@ spd_get_details_reply (int cmd, apt_proto_decoder *dec, void *data)
   if ((c == NULL) || (c != current_spd_clos) || c->showing_details)
     return;
 
+  /* Ask again when the apt-worker has its new cache.
+   */
+  if (dec && apt_worker_reply_is_stale ())
+    {
+      apt_worker_when_cache_changed (spd_get_details_again, c);
+      return;
+    }
+
   if ((dec == NULL) || (c->pi->have_detail_kind == c->kind))
     {
       spd_end (c);
@@ -33,6 +33,7 @@
 #include "util.h"
 #include "main.h"
 #include "settings.h"
+#include "apt-worker-client.h"
 
 #define _(x) gettext (x)
 
@@ -41,9 +42,14 @@ static gchar *last_save_log_dir = NULL;
 
 enum {
   RESPONSE_SAVE = 1,
-  RESPONSE_CLEAR = 2
+  RESPONSE_CLEAR = 2,
+  RESPONSE_STATS = 3
 };
 
+/* The text view of the log dialog while it is open.
+ */
+static GtkWidget *log_text_view = NULL;
+
 static void
 save_log_do_nothing (void *data)
 {
@@ -182,6 +188,66 @@ clear_log ()
   set_log_start ();
 }
 
+/* Append the statistics from the apt-worker to the log.  They are
+   only available in red pill mode and are thus not translated.
+*/
+static void
+get_stats_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  if (dec == NULL)
+    return;
+
+  int cache_inits = dec->decode_int ();
+  int64_t cache_init_time = dec->decode_int64 ();
+  int64_t cache_init_max_time = dec->decode_int64 ();
+  int64_t record_lookups = dec->decode_int64 ();
+  int n_buckets = dec->decode_int ();
+
+  add_log ("\n-----\nStatistics:\n");
+  add_log ("cache opened %d times, %.1f ms total, %.1f ms max\n",
+	   cache_inits, cache_init_time / 1000.0,
+	   cache_init_max_time / 1000.0);
+  add_log ("%lld package records looked up\n\n",
+	   (long long) record_lookups);
+  add_log ("%-26s %6s %10s %10s %9s %10s %9s\n",
+	   "command", "count", "wall ms", "cpu ms", "max ms",
+	   "bytes", "records");
+
+  GString *histograms = g_string_new ("");
+
+  while (!dec->corrupted ())
+    {
+      int c = dec->decode_int ();
+      if (c < 0)
+	break;
+
+      int count = dec->decode_int ();
+      int64_t wall_time = dec->decode_int64 ();
+      int64_t cpu_time = dec->decode_int64 ();
+      int64_t max_wall_time = dec->decode_int64 ();
+      int64_t response_bytes = dec->decode_int64 ();
+      int64_t lookups = dec->decode_int64 ();
+      const char *name = apt_proto_command_name (c);
+
+      add_log ("%-26s %6d %10.1f %10.1f %9.1f %10lld %9lld\n",
+	       name, count, wall_time / 1000.0, cpu_time / 1000.0,
+	       max_wall_time / 1000.0,
+	       (long long) response_bytes, (long long) lookups);
+
+      g_string_append_printf (histograms, "%-26s", name);
+      for (int i = 0; i < n_buckets; i++)
+	g_string_append_printf (histograms, " %d", dec->decode_int ());
+      g_string_append (histograms, "\n");
+    }
+
+  add_log ("\nWall time histogram (< 1 ms, < 2 ms, < 4 ms, ...):\n%s",
+	   histograms->str);
+  g_string_free (histograms, TRUE);
+
+  if (log_text_view)
+    set_small_text_view_text (log_text_view, log_text->str);
+}
+
 static void
 log_response (GtkDialog *dialog, gint response, gpointer clos)
 {
@@ -193,6 +259,8 @@ log_response (GtkDialog *dialog, gint response, gpointer clos)
       if (log_text && text_view)
 	set_small_text_view_text (text_view, log_text->str);
     }
+  else if (response == RESPONSE_STATS)
+    apt_worker_get_stats (get_stats_reply, NULL);
   else if (response == RESPONSE_SAVE)
     {
       /* We should ignore delete-event when save dialog is shown... */
@@ -267,7 +335,14 @@ show_log_dialog_flow ()
 
       gtk_dialog_set_has_separator (GTK_DIALOG (dialog), FALSE);
 
+      if (red_pill_mode)
+	gtk_dialog_add_button (GTK_DIALOG (dialog), "Statistics",
+			       RESPONSE_STATS);
+
       text_view = make_small_text_view (log_text? log_text->str : "");
+      log_text_view = text_view;
+      g_object_add_weak_pointer (G_OBJECT (text_view),
+				 (gpointer *) &log_text_view);
 
       gtk_container_add (GTK_CONTAINER (GTK_DIALOG (dialog)->vbox), text_view);
 
@@ -30,6 +30,10 @@
 #include <libintl.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
@@ -182,16 +186,38 @@ static GList *upgradeable_packages = NULL;
 static GList *installed_packages = NULL;
 static GList *search_result_packages = NULL;
 
+/* These map package names to the package_infos in the lists above,
+   for looking them up by name.  INSTALL_TABLE has the packages of
+   all sections in INSTALL_SECTIONS.  They are filled together with
+   the lists by make_package_lists and don't hold references of their
+   own.
+*/
+static GHashTable *install_table = NULL;
+static GHashTable *upgradeable_table = NULL;
+static GHashTable *installed_table = NULL;
+
 
+/* While the state is PKG_LIST_SNAPSHOT, the lists come from the
+   snapshot and the apt-worker has not confirmed them yet.  They are
+   shown, but nothing is done with their packages.
+*/
 enum package_list_state {
   pkg_list_unknown,
   pkg_list_retrieving,
+  pkg_list_snapshot,
   pkg_list_ready,
 };
 
 static package_list_state pkg_list_state = pkg_list_unknown;
 
+/* The number of package list requests that have not been answered
+   yet.  See package_cache_changed.
+*/
+static int package_list_requests = 0;
+
 #define package_list_ready (pkg_list_state == pkg_list_ready)
+#define package_list_shown (pkg_list_state == pkg_list_ready \
+			    || pkg_list_state == pkg_list_snapshot)
 
 
 static int cur_section_rank;
@@ -411,6 +437,7 @@ package_info::package_info ()
   available_short_description = NULL;
   installed_icon = NULL;
   available_icon = NULL;
+  strings = NULL;
 
   have_info = false;
   third_party_policy = third_party_unknown;
@@ -425,19 +452,30 @@ package_info::package_info ()
   dependencies = NULL;
 
   model = NULL;
+
+  search_keys[0] = search_keys[1] = NULL;
+  name_sort_keys[0] = name_sort_keys[1] = NULL;
+  version_sort_keys[0] = version_sort_keys[1] = NULL;
+  live_search_serial = 0;
+  live_search_match = false;
 }
 
 package_info::~package_info ()
 {
-  g_free (name);
-  g_free (installed_version);
-  g_free (installed_section);
-  g_free (installed_pretty_name);
-  g_free (available_version);
-  g_free (available_section);
-  g_free (available_pretty_name);
-  g_free (installed_short_description);
-  g_free (available_short_description);
+  if (strings)
+    strings->unref ();
+  else
+    {
+      g_free (name);
+      g_free (installed_version);
+      g_free (installed_section);
+      g_free (installed_pretty_name);
+      g_free (available_version);
+      g_free (available_section);
+      g_free (available_pretty_name);
+      g_free (installed_short_description);
+      g_free (available_short_description);
+    }
   if (installed_icon)
     g_object_unref (installed_icon);
   if (available_icon)
@@ -453,6 +491,13 @@ package_info::~package_info ()
       g_list_free (summary_packages[i]);
     }
   g_free (dependencies);
+  g_strfreev (search_keys[0]);
+  g_strfreev (search_keys[1]);
+  for (int i = 0; i < 2; i++)
+    {
+      g_free (name_sort_keys[i]);
+      g_free (version_sort_keys[i]);
+    }
 }
 
 const char *
@@ -484,6 +529,64 @@ package_info::get_display_version (bool installed)
   return v;
 }
 
+/* The keys are computed when they are first needed, which is usually
+   when the package list is decoded, and then kept as long as the
+   package_info.
+*/
+char **
+package_info::get_search_keys (bool installed)
+{
+  char ***keys = &search_keys[installed? 1 : 0];
+
+  if (*keys == NULL)
+    {
+      const char *desc = (installed
+			  ? installed_short_description
+			  : available_short_description);
+      char *text = g_strconcat (get_display_name (installed), " ",
+				desc, NULL);
+      char *folded = g_utf8_casefold (text, -1);
+      *keys = g_strsplit (folded, " ", -1);
+      g_free (folded);
+      g_free (text);
+    }
+
+  return *keys;
+}
+
+/* The sort keys are made like the search keys, but when sorting for
+   the first time.
+*/
+const char *
+package_info::get_name_sort_key (bool installed)
+{
+  char **key = &name_sort_keys[installed? 1 : 0];
+
+  if (*key == NULL)
+    {
+      char *folded = g_utf8_casefold (get_display_name (installed), -1);
+      *key = g_utf8_collate_key (folded, -1);
+      g_free (folded);
+    }
+
+  return *key;
+}
+
+/* Returns NULL when there is no such version.
+ */
+const char *
+package_info::get_version_sort_key (bool installed)
+{
+  char **key = &version_sort_keys[installed? 1 : 0];
+
+  if (*key == NULL)
+    *key = deb_version_sort_key (installed
+				 ? installed_version
+				 : available_version);
+
+  return *key;
+}
+
 void
 package_info::ref ()
 {
@@ -498,6 +601,39 @@ package_info::unref ()
     delete this;
 }
 
+package_strings::package_strings ()
+{
+  ref_count = 1;
+  chunk = g_string_chunk_new (16 * 1024);
+}
+
+package_strings::~package_strings ()
+{
+  g_string_chunk_free (chunk);
+}
+
+void
+package_strings::ref ()
+{
+  ref_count += 1;
+}
+
+void
+package_strings::unref ()
+{
+  ref_count -= 1;
+  if (ref_count == 0)
+    delete this;
+}
+
+char *
+package_strings::insert (const char *str)
+{
+  if (str == NULL)
+    return NULL;
+  return g_string_chunk_insert (chunk, str);
+}
+
 static void
 free_packages (GList *list)
 {
@@ -571,6 +707,13 @@ free_all_packages ()
       free_packages (search_result_packages);
       search_result_packages = NULL;
     }
+
+  if (install_table)
+    {
+      g_hash_table_remove_all (install_table);
+      g_hash_table_remove_all (upgradeable_table);
+      g_hash_table_remove_all (installed_table);
+    }
 }
 
 static const char *
@@ -643,38 +786,159 @@ find_section_info (GList **list_ptr,
   return NULL;
 }
 
-static section_info *
-create_section_info (GList **list_ptr,
-		     int rank, const char *name)
+/* Work out the rank and name of a section, and its name without
+   prefixes.  NAME is the section of a package, and RANK is the rank
+   that the caller would like.
+*/
+static void
+resolve_section_name (int *rank, const char **name,
+		      const char **untranslated_name)
 {
-  const char *untranslated_name = NULL;
+  *untranslated_name = NULL;
 
-  if (name)
+  if (*name)
     {
-      untranslated_name = canonicalize_section_name (name);
-      name = nicify_section_name (name);
+      *untranslated_name = canonicalize_section_name (*name);
+      *name = nicify_section_name (*name);
     }
 
-  if (!name)
+  if (!*name)
     {
       /* If we don't have a name for the section, it can't be a
 	 "normal" section.  Move it to the "other" rank in that case.
       */
-      if (rank == SECTION_RANK_NORMAL)
+      if (*rank == SECTION_RANK_NORMAL)
         {
-          if (untranslated_name && !strcmp (untranslated_name, "hidden"))
-            rank = SECTION_RANK_HIDDEN;
+          if (*untranslated_name && !strcmp (*untranslated_name, "hidden"))
+            *rank = SECTION_RANK_HIDDEN;
           else
-            rank = SECTION_RANK_OTHER;
+            *rank = SECTION_RANK_OTHER;
         }
 
-      if (rank == SECTION_RANK_ALL)
-	name = _("ai_category_all");
-      else if (rank == SECTION_RANK_HIDDEN)
-        name = "hidden";
-      else if (rank == SECTION_RANK_OTHER)
-	name = _("ai_category_other");
+      if (*rank == SECTION_RANK_ALL)
+	*name = _("ai_category_all");
+      else if (*rank == SECTION_RANK_HIDDEN)
+        *name = "hidden";
+      else if (*rank == SECTION_RANK_OTHER)
+	*name = _("ai_category_other");
+    }
+}
+
+/* SECTION_NAMES maps the sections of packages, such as "user/games",
+   to what resolve_section_name makes of them as a normal section.
+   There are only a few dozen different sections, so the entries are
+   kept for as long as the program runs, and the strings in them stay
+   valid for that long.
+
+   The names depend on the locale and on the red pill settings.  When
+   these change, the entries are resolved again the next time they
+   are used.
+*/
+struct section_name {
+  int rank;
+  const char *name;
+  const char *untranslated_name;
+  int names_serial;
+
+  // The section in INSTALL_SECTIONS for this entry, while
+  // SECTIONS_SERIAL is the same as SECTION_NAMES_SECTIONS_SERIAL.
+  // Entries that are new or have been resolved again have a
+  // SECTIONS_SERIAL of zero.
+  section_info *si;
+  int sections_serial;
+};
+
+static GHashTable *section_names = NULL;
+static int section_names_serial = 0;
+static char *section_names_locale = NULL;
+static bool section_names_show_all = false;
+
+/* Incremented whenever INSTALL_SECTIONS is built anew.
+ */
+static int section_names_sections_serial = 0;
+
+static void
+free_section_name (gpointer data)
+{
+  delete (section_name *)data;
+}
+
+/* Prepare SECTION_NAMES for building INSTALL_SECTIONS anew.
+ */
+static void
+start_section_names ()
+{
+  const char *locale = setlocale (LC_MESSAGES, NULL);
+  bool show_all = red_pill_mode && red_pill_show_all;
+
+  if (section_names == NULL)
+    section_names = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   g_free, free_section_name);
+
+  if (g_strcmp0 (locale, section_names_locale)
+      || show_all != section_names_show_all)
+    {
+      g_free (section_names_locale);
+      section_names_locale = g_strdup (locale);
+      section_names_show_all = show_all;
+      section_names_serial++;
+    }
+
+  section_names_sections_serial++;
+}
+
+static section_name *
+lookup_section_name (const char *section)
+{
+  gpointer key, value;
+  section_name *sn;
+
+  if (g_hash_table_lookup_extended (section_names, section, &key, &value))
+    sn = (section_name *) value;
+  else
+    {
+      sn = new section_name;
+      sn->names_serial = section_names_serial - 1;
+      sn->si = NULL;
+      sn->sections_serial = 0;
+      key = g_strdup (section);
+      g_hash_table_insert (section_names, key, sn);
+    }
+
+  if (sn->names_serial != section_names_serial)
+    {
+      /* Resolve the key of the entry, which lives as long as the
+	 entry, instead of SECTION.
+      */
+      sn->rank = SECTION_RANK_NORMAL;
+      sn->name = (const char *) key;
+      resolve_section_name (&sn->rank, &sn->name, &sn->untranslated_name);
+      sn->names_serial = section_names_serial;
+      sn->sections_serial = 0;
+    }
+
+  return sn;
+}
+
+static section_info *
+create_section_info (GList **list_ptr,
+		     int rank, const char *name)
+{
+  const char *untranslated_name;
+  section_name *sn = NULL;
+
+  if (list_ptr == &install_sections && name && rank == SECTION_RANK_NORMAL)
+    {
+      sn = lookup_section_name (name);
+      if (sn->sections_serial == section_names_sections_serial)
+	return sn->si;
+
+      rank = sn->rank;
+      name = sn->name;
+      untranslated_name = sn->untranslated_name;
     }
+  else
+    resolve_section_name (&rank, &name, &untranslated_name);
 
   section_info *si = find_section_info (list_ptr, rank, name);
 
@@ -689,6 +953,12 @@ create_section_info (GList **list_ptr,
 	*list_ptr = g_list_prepend (*list_ptr, si);
     }
 
+  if (sn)
+    {
+      sn->si = si;
+      sn->sections_serial = section_names_sections_serial;
+    }
+
   return si;
 }
 
@@ -731,8 +1001,8 @@ compare_package_installed_names (gconstpointer a, gconstpointer b)
   package_info *pi_b = (package_info *)b;
 
   return package_sort_sign *
-    g_ascii_strcasecmp (pi_a->get_display_name (true),
-			pi_b->get_display_name (true));
+    strcmp (pi_a->get_name_sort_key (true),
+	    pi_b->get_name_sort_key (true));
 }
 
 static gint
@@ -747,17 +1017,25 @@ compare_package_available_names (gconstpointer a, gconstpointer b)
   if (!result)
     {
       result = package_sort_sign *
-	g_ascii_strcasecmp (pi_a->get_display_name (false),
-			    pi_b->get_display_name (false));
+	strcmp (pi_a->get_name_sort_key (false),
+		pi_b->get_name_sort_key (false));
     }
 
   return result;
 }
 
+/* A and B are version sort keys.  Missing versions sort last, like
+   with compare_deb_versions.
+*/
 static gint
 compare_versions (const gchar *a, const gchar *b)
 {
-  return package_sort_sign * compare_deb_versions (a, b);
+  if (a == NULL)
+    return package_sort_sign;
+  if (b == NULL)
+    return -package_sort_sign;
+
+  return package_sort_sign * strcmp (a, b);
 }
 
 static gint
@@ -766,7 +1044,8 @@ compare_package_installed_versions (gconstpointer a, gconstpointer b)
   package_info *pi_a = (package_info *)a;
   package_info *pi_b = (package_info *)b;
 
-  return compare_versions (pi_a->installed_version, pi_b->installed_version);
+  return compare_versions (pi_a->get_version_sort_key (true),
+			   pi_b->get_version_sort_key (true));
 }
 
 static gint
@@ -781,7 +1060,8 @@ compare_package_available_versions (gconstpointer a, gconstpointer b)
   if (!result)
     {
       result =
-	compare_versions (pi_a->available_version, pi_b->available_version);
+	compare_versions (pi_a->get_version_sort_key (false),
+			  pi_b->get_version_sort_key (false));
     }
 
   return result;
@@ -824,6 +1104,75 @@ compare_package_download_sizes (gconstpointer a, gconstpointer b)
   return result;
 }
 
+static gint
+compare_package_pointers (gconstpointer a, gconstpointer b, gpointer data)
+{
+  GCompareFunc compare = (GCompareFunc) data;
+  return compare (*(package_info **)a, *(package_info **)b);
+}
+
+/* Sort LIST in place, without allocating new list nodes.
+
+   The lists are usually sorted already, or only a few packages have
+   moved, for example because their download size has become known.
+   So we first take out the packages that are out of order, and then
+   put each of them back into the rest of the list with a binary
+   search.  When too many packages have moved, the whole list is
+   sorted instead.  Both ways keep packages that compare equal in
+   their order.
+*/
+static GList *
+sort_package_list (GList *list, GCompareFunc compare)
+{
+  GPtrArray *sorted = g_ptr_array_new ();
+  GPtrArray *moved = g_ptr_array_new ();
+
+  for (GList *l = list; l; l = l->next)
+    {
+      if (sorted->len > 0
+	  && compare (g_ptr_array_index (sorted, sorted->len - 1),
+		      l->data) > 0)
+	g_ptr_array_add (moved, l->data);
+      else
+	g_ptr_array_add (sorted, l->data);
+    }
+
+  if (moved->len > sorted->len / 8)
+    {
+      for (guint i = 0; i < moved->len; i++)
+	g_ptr_array_add (sorted, g_ptr_array_index (moved, i));
+      g_ptr_array_sort_with_data (sorted, compare_package_pointers,
+				  (gpointer) compare);
+    }
+  else
+    {
+      for (guint i = 0; i < moved->len; i++)
+	{
+	  gpointer pi = g_ptr_array_index (moved, i);
+
+	  // Find the first package that sorts after PI.
+	  guint lo = 0, hi = sorted->len;
+	  while (lo < hi)
+	    {
+	      guint mid = lo + (hi - lo) / 2;
+	      if (compare (g_ptr_array_index (sorted, mid), pi) > 0)
+		hi = mid;
+	      else
+		lo = mid + 1;
+	    }
+	  g_ptr_array_insert (sorted, lo, pi);
+	}
+    }
+
+  guint i = 0;
+  for (GList *l = list; l; l = l->next)
+    l->data = g_ptr_array_index (sorted, i++);
+
+  g_ptr_array_free (moved, TRUE);
+  g_ptr_array_free (sorted, TRUE);
+  return list;
+}
+
 void
 sort_all_packages (bool refresh_view)
 {
@@ -855,23 +1204,23 @@ sort_all_packages (bool refresh_view)
   for (GList *s = install_sections; s; s = s->next)
     {
       section_info *si = (section_info *)s->data;
-      si->packages = g_list_sort (si->packages,
-				  compare_packages_avail);
+      si->packages = sort_package_list (si->packages,
+					compare_packages_avail);
     }
 
-  installed_packages = g_list_sort (installed_packages,
-				    compare_packages_inst);
+  installed_packages = sort_package_list (installed_packages,
+					  compare_packages_inst);
 
-  upgradeable_packages = g_list_sort (upgradeable_packages,
-				      compare_packages_avail);
+  upgradeable_packages = sort_package_list (upgradeable_packages,
+					    compare_packages_avail);
 
   if (search_results_view.parent == &install_applications_view
       || search_results_view.parent == &upgrade_applications_view)
-    search_result_packages = g_list_sort (search_result_packages,
-					  compare_packages_avail);
+    search_result_packages = sort_package_list (search_result_packages,
+						compare_packages_avail);
   else
-    search_result_packages = g_list_sort (search_result_packages,
-					  compare_packages_inst);
+    search_result_packages = sort_package_list (search_result_packages,
+						compare_packages_inst);
 
   if (refresh_view)
     show_view (cur_view_struct);
@@ -884,30 +1233,46 @@ struct gpl_closure {
   void *data;
 };
 
+static void request_package_list (gpl_closure *c);
+
+/* Decode the rest of a package list entry whose NAME has already
+   been decoded.  The strings are copied into STRINGS.
+*/
 static package_info *
-get_package_list_entry (apt_proto_decoder *dec)
+get_package_list_entry_1 (apt_proto_decoder *dec, const char *name,
+			  package_strings *strings)
 {
-  const char *installed_icon, *available_icon;
+  apt_proto_package_list_entry entry;
   package_info *info = new package_info;
+
+  apt_proto_decode_package_list_entry (dec, name, &entry);
+
+  strings->ref ();
+  info->strings = strings;
+
+  info->name = strings->insert (entry.name);
+  info->broken = entry.broken;
+  info->installed_version = strings->insert (entry.installed_version);
+  info->installed_size = entry.installed_size;
+  info->installed_section = strings->insert (entry.installed_section);
+  info->installed_pretty_name = strings->insert (entry.installed_pretty_name);
+  info->installed_short_description =
+    strings->insert (entry.installed_short_description);
+  info->available_version = strings->insert (entry.available_version);
+  info->available_section = strings->insert (entry.available_section);
+  info->available_pretty_name = strings->insert (entry.available_pretty_name);
+  info->available_short_description =
+    strings->insert (entry.available_short_description);
+  info->flags = entry.flags;
+
+  if (info->installed_version)
+    info->get_search_keys (true);
+  if (info->available_version)
+    info->get_search_keys (false);
   
-  info->name = dec->decode_string_dup ();
-  info->broken = dec->decode_int ();
-  info->installed_version = dec->decode_string_dup ();
-  info->installed_size = dec->decode_int64 ();
-  info->installed_section = dec->decode_string_dup ();
-  info->installed_pretty_name = dec->decode_string_dup ();
-  info->installed_short_description = dec->decode_string_dup ();
-  installed_icon = dec->decode_string_in_place ();
-  info->available_version = dec->decode_string_dup ();
-  info->available_section = dec->decode_string_dup ();
-  info->available_pretty_name = dec->decode_string_dup ();
-  info->available_short_description = dec->decode_string_dup ();
-  available_icon = dec->decode_string_in_place ();
-  info->flags = dec->decode_int ();
-  
-  info->installed_icon = pixbuf_from_base64 (installed_icon);
-  if (available_icon)
-    info->available_icon = pixbuf_from_base64 (available_icon);
+  info->installed_icon = pixbuf_from_base64 (entry.installed_icon);
+  if (entry.available_icon)
+    info->available_icon = pixbuf_from_base64 (entry.available_icon);
   else
     {
       info->available_icon = info->installed_icon;
@@ -918,6 +1283,13 @@ get_package_list_entry (apt_proto_decoder *dec)
   return info;
 }
 
+static package_info *
+get_package_list_entry (apt_proto_decoder *dec, package_strings *strings)
+{
+  return get_package_list_entry_1 (dec, dec->decode_string_in_place (),
+				   strings);
+}
+
 static bool
 is_user_section (const char *section)
 {
@@ -949,70 +1321,231 @@ package_visible (package_info *pi, bool installed)
   return is_user_section (sect) && !is_debug_section(sect);
 }
 
+/* PACKAGE_TABLE is our copy of the complete package list as sent by
+   the apt-worker, for PACKAGE_TABLE_GENERATION.  It maps package
+   names to package_info structs and is updated from the deltas sent
+   in reply to GET_PACKAGE_LIST_DELTA.  The lists shown in the views
+   are then derived from it.
+*/
+
+static GHashTable *package_table = NULL;
+static int package_table_generation = 0;
+
+static void
+unref_package_info (gpointer data)
+{
+  ((package_info *)data)->unref ();
+}
+
+static void
+forget_package_table ()
+{
+  if (package_table)
+    g_hash_table_remove_all (package_table);
+  else
+    package_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   NULL, unref_package_info);
+  package_table_generation = 0;
+}
+
+static void
+add_package_to_lists (gpointer key, gpointer value, gpointer data)
+{
+  package_info *info = (package_info *)value;
+  section_info *all_si = (section_info *)data;
+
+  /* The apt-worker cache has changed since INFO has been received,
+     so everything that has been computed from it has to be asked for
+     again.
+  */
+  info->have_info = false;
+  info->have_detail_kind = no_details;
+  info->third_party_policy = third_party_unknown;
+
+  if (info->available_version
+      && package_visible (info, false))
+    {
+      if (info->installed_version)
+	{
+	  info->ref ();
+	  upgradeable_packages = g_list_prepend (upgradeable_packages,
+						 info);
+	  g_hash_table_replace (upgradeable_table, info->name, info);
+	}
+      else
+	{
+	  section_info *sec =
+	    create_section_info (&install_sections,
+				 SECTION_RANK_NORMAL,
+				 info->available_section);
+	  info->ref ();
+	  sec->packages = g_list_prepend (sec->packages, info);
+
+	  info->ref ();
+	  all_si->packages = g_list_prepend (all_si->packages, info);
+	  g_hash_table_replace (install_table, info->name, info);
+	}
+    }
+
+  if (info->installed_version
+      && package_visible (info, true))
+    {
+      info->ref ();
+      installed_packages = g_list_prepend (installed_packages,
+					   info);
+      g_hash_table_replace (installed_table, info->name, info);
+    }
+}
+
+/* Derive the lists shown in the views from PACKAGE_TABLE.  The lists
+   must be empty.
+*/
+static void
+make_package_lists ()
+{
+  section_info *all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
+
+  start_section_names ();
+
+  if (install_table == NULL)
+    {
+      install_table = g_hash_table_new (g_str_hash, g_str_equal);
+      upgradeable_table = g_hash_table_new (g_str_hash, g_str_equal);
+      installed_table = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+  g_hash_table_foreach (package_table, add_package_to_lists, all_si);
+
+  if (g_list_length (all_si->packages) <= MAX_PACKAGES_NO_CATEGORIES)
+    {
+      free_sections (install_sections);
+      install_sections = g_list_prepend (NULL, all_si);
+    }
+  else  if (g_list_length (install_sections) >= 2)
+    install_sections = g_list_prepend (install_sections, all_si);
+  else
+    all_si->unref ();
+}
+
+static int
+package_list_filter ()
+{
+  return apt_proto_package_list_filter
+    (!(red_pill_mode && red_pill_show_all), false, false,
+     red_pill_mode && red_pill_show_magic_sys);
+}
+
+/* Fill PACKAGE_TABLE from the snapshot that the apt-worker has left
+   behind, if there is a usable one.  See apt-worker-proto.h for its
+   format.
+*/
+static bool
+load_package_list_snapshot ()
+{
+  apt_proto_snapshot_header *header;
+  struct stat buf;
+  bool success = false;
+  char *map;
+  int fd;
+
+  fd = open (PACKAGE_LIST_SNAPSHOT_FILE, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (fstat (fd, &buf) < 0 || buf.st_size < (off_t) sizeof (*header))
+    {
+      close (fd);
+      return false;
+    }
+
+  /* The mapping is private and writable since the decoder fixes up
+     invalid UTF-8 in place.
+  */
+  map = (char *) mmap (NULL, buf.st_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  header = (apt_proto_snapshot_header *) map;
+  if (!strncmp (header->magic, APT_PROTO_SNAPSHOT_MAGIC,
+		sizeof (header->magic))
+      && header->version == APT_PROTO_SNAPSHOT_VERSION
+      && header->filter == package_list_filter ()
+      && header->len >= 0
+      && header->len <= buf.st_size - (off_t) sizeof (*header))
+    {
+      apt_proto_decoder dec (map + sizeof (*header), header->len);
+      package_strings *strings = new package_strings;
+      const char *name;
+
+      forget_package_table ();
+      while ((name = dec.decode_string_in_place ()) != NULL)
+	{
+	  package_info *info = get_package_list_entry_1 (&dec, name, strings);
+	  g_hash_table_replace (package_table, info->name, info);
+	}
+      strings->unref ();
+
+      if (dec.corrupted ())
+	forget_package_table ();
+      else
+	success = true;
+    }
+
+  munmap (map, buf.st_size);
+  return success;
+}
+
 static void
 get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
 {
   gpl_closure *c = (gpl_closure *)data;
 
+  package_list_requests--;
   hide_updating ();
 
+  /* The lists are still around when we have been showing the
+     snapshot while waiting for this reply.
+  */
+  clear_global_package_list ();
+  clear_global_section_list ();
+  get_package_infos_in_background (NULL);
+  free_all_packages ();
+
   if (dec == NULL)
-    ;
+    forget_package_table ();
   else if (dec->decode_int () == 0)
-    what_the_fock_p ();
+    {
+      forget_package_table ();
+      what_the_fock_p ();
+    }
   else
     {
-      section_info *all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
-
-      while (!dec->at_end ())
-	{
-	  package_info *info = NULL;
+      int generation = dec->decode_int ();
+      bool is_delta = dec->decode_int ();
+      package_strings *strings = new package_strings;
+      const char *name;
 
-	  info = get_package_list_entry (dec);
+      if (!is_delta)
+	forget_package_table ();
 
-	  if (info->available_version
-	      && package_visible (info, false))
-	    {
-	      if (info->installed_version)
-		{
-		  info->ref ();
-		  upgradeable_packages = g_list_prepend (upgradeable_packages,
-							 info);
-		}
-	      else
-		{
-		  section_info *sec =
-		    create_section_info (&install_sections,
-					 SECTION_RANK_NORMAL,
-					 info->available_section);
-		  info->ref ();
-		  sec->packages = g_list_prepend (sec->packages, info);
-
-		  info->ref ();
-		  all_si->packages = g_list_prepend (all_si->packages, info);
-		}
-	    }
+      while ((name = dec->decode_string_in_place ()) != NULL)
+	{
+	  package_info *info = get_package_list_entry_1 (dec, name, strings);
+	  g_hash_table_replace (package_table, info->name, info);
+	}
+      strings->unref ();
 
-	  if (info->installed_version
-	      && package_visible (info, true))
-	    {
-	      info->ref ();
-	      installed_packages = g_list_prepend (installed_packages,
-						   info);
-	    }
+      const char *removed;
+      while ((removed = dec->decode_string_in_place ()) != NULL)
+	g_hash_table_remove (package_table, removed);
 
-	  info->unref ();
-	}
+      /* Ask for the full list next time if something went wrong.
+       */
+      package_table_generation = dec->corrupted () ? 0 : generation;
 
-      if (g_list_length (all_si->packages) <= MAX_PACKAGES_NO_CATEGORIES)
-	{
-	  free_sections (install_sections);
-	  install_sections = g_list_prepend (NULL, all_si);
-	}
-      else  if (g_list_length (install_sections) >= 2)
-	install_sections = g_list_prepend (install_sections, all_si);
-      else
-	all_si->unref ();
+      make_package_lists ();
     }
 
   pkg_list_state = pkg_list_ready;
@@ -1058,13 +1591,77 @@ get_package_list_with_cont (void (*cont) (void *data), void *data)
   get_package_infos_in_background (NULL);
   free_all_packages ();
 
+  if (package_table == NULL)
+    forget_package_table ();
+
   show_updating ();
-  apt_worker_get_package_list (!(red_pill_mode && red_pill_show_all),
-			       false, 
-			       false, 
-			       NULL,
-			       red_pill_mode && red_pill_show_magic_sys,
-			       get_package_list_reply, c);
+  request_package_list (c);
+}
+
+static void
+request_package_list (gpl_closure *c)
+{
+  package_list_requests++;
+  apt_worker_get_package_list_delta (!(red_pill_mode && red_pill_show_all),
+				     false,
+				     false,
+				     red_pill_mode && red_pill_show_magic_sys,
+				     package_table_generation,
+				     get_package_list_reply, c);
+}
+
+/* Called when the apt-worker has rebuilt its package cache in the
+   background, after an operation has changed the installed packages
+   or the catalogues.  The current lists are kept until the new ones
+   have arrived.
+
+   Nothing needs to be done while a list request is outstanding: the
+   apt-worker answers it after sending the op_cache_changed status,
+   from the new cache.  A list that has been answered from the old
+   cache has arrived before the status and is replaced here.
+*/
+void
+package_cache_changed ()
+{
+  if (!package_list_ready || package_list_requests > 0)
+    return;
+
+  gpl_closure *c = new gpl_closure;
+  c->cont = NULL;
+  c->data = NULL;
+
+  show_updating ();
+  request_package_list (c);
+}
+
+/* Show the package list from the snapshot, if there is one, and then
+   replace it with the real one.  The snapshot is never newer than
+   what the apt-worker will send, so the views can only get more
+   accurate.  Until the real list has arrived, the packages in the
+   views can't be installed or removed.
+*/
+static void
+get_initial_package_list_with_cont (void (*cont) (void *data), void *data)
+{
+  if (!load_package_list_snapshot ())
+    {
+      get_package_list_with_cont (cont, data);
+      return;
+    }
+
+  /* The generations of the snapshot and of the running apt-worker
+     have nothing to do with each other, so ask for a full list.
+  */
+  package_table_generation = 0;
+  make_package_lists ();
+  pkg_list_state = pkg_list_snapshot;
+  sort_all_packages (cur_view_struct != &main_view);
+
+  gpl_closure *c = new gpl_closure;
+  c->cont = cont;
+  c->data = data;
+  show_updating ();
+  request_package_list (c);
 }
 
 void
@@ -1080,8 +1677,10 @@ struct gpi_closure {
   void (*cont) (package_info *, void *, bool);
   void *data;
   package_info *pi;
+  bool only_basic_info;
 };
 
+static void gpi_request (void *clos);
 static void gpi_reply  (int cmd, apt_proto_decoder *dec, void *clos);
 
 void
@@ -1098,16 +1697,35 @@ get_package_info (package_info *pi,
       c->cont = cont;
       c->data = data;
       c->pi = pi;
+      c->only_basic_info = only_basic_info;
       pi->ref ();
-      apt_worker_get_package_info (pi->name, only_basic_info,
-				   gpi_reply, c);
+      gpi_request (c);
     }
 }
 
+static void
+gpi_request (void *clos)
+{
+  gpi_closure *c = (gpi_closure *)clos;
+
+  apt_worker_get_package_info (c->pi->name, c->only_basic_info,
+			       gpi_reply, c);
+}
+
 static void
 gpi_reply  (int cmd, apt_proto_decoder *dec, void *clos)
 {
   gpi_closure *c = (gpi_closure *)clos;
+
+  /* The info might be about to change, and our callers go on to
+     install or remove the package, so wait for the new cache.
+  */
+  if (dec && apt_worker_reply_is_stale ())
+    {
+      apt_worker_when_cache_changed (gpi_request, c);
+      return;
+    }
+
   void (*cont) (package_info *, void *, bool) = c->cont;
   void *data = c->data;
   package_info *pi = c->pi;
@@ -1129,18 +1747,133 @@ gpi_reply  (int cmd, apt_proto_decoder *dec, void *clos)
 }
 
 /* GET_PACKAGE_INFOS
+
+   Package infos are requested in batches of up to GPI_BATCH_SIZE
+   packages.  This keeps the number of round trips to the apt-worker
+   low while still letting the views update as each batch comes in.
  */
 
+#define GPI_BATCH_SIZE 32
+
+struct gpib_closure {
+  void (*cont) (bool, void *);
+  void *data;
+  bool only_basic_info;
+  int priority;
+  int n_packages;
+  package_info *packages[GPI_BATCH_SIZE];
+};
+
+static void gpib_request (void *clos);
+static void gpib_reply (int cmd, apt_proto_decoder *dec, void *clos);
+
+/* Take up to GPI_BATCH_SIZE packages from *NODE, advancing it, and
+   request their infos with PRIORITY.  Packages whose basic info is
+   already known are skipped when ONLY_BASIC_INFO is true.  Packages
+   that are missing from a cancelled reply are left without info.
+   CONT is called with CHANGED set when some infos have been
+   received.  Returns false without calling CONT when there was
+   nothing left to request.
+*/
+static bool
+get_package_info_batch (GList **node,
+			bool only_basic_info,
+			int priority,
+			void (*cont) (bool changed, void *data),
+			void *data)
+{
+  gpib_closure *c = new gpib_closure;
+
+  c->cont = cont;
+  c->data = data;
+  c->only_basic_info = only_basic_info;
+  c->priority = priority;
+  c->n_packages = 0;
+
+  while (*node && c->n_packages < GPI_BATCH_SIZE)
+    {
+      package_info *pi = (package_info *) (*node)->data;
+      *node = (*node)->next;
+
+      if (pi->have_info && only_basic_info)
+	continue;
+
+      pi->ref ();
+      c->packages[c->n_packages++] = pi;
+    }
+
+  if (c->n_packages == 0)
+    {
+      delete c;
+      return false;
+    }
+
+  gpib_request (c);
+  return true;
+}
+
+static void
+gpib_request (void *clos)
+{
+  gpib_closure *c = (gpib_closure *)clos;
+  const char *names[GPI_BATCH_SIZE + 1];
+
+  for (int i = 0; i < c->n_packages; i++)
+    names[i] = c->packages[i]->name;
+  names[c->n_packages] = NULL;
+
+  apt_worker_get_package_infos (names, c->only_basic_info, c->priority,
+				gpib_reply, c);
+}
+
+static void
+gpib_reply (int cmd, apt_proto_decoder *dec, void *clos)
+{
+  gpib_closure *c = (gpib_closure *)clos;
+
+  /* Stale infos are good enough for the views, which get new ones
+     anyway when the package list is refreshed after the cache has
+     changed.  Everybody else waits for the new cache.
+  */
+  if (dec && apt_worker_reply_is_stale ()
+      && c->priority != APT_PRIORITY_BULK)
+    {
+      apt_worker_when_cache_changed (gpib_request, c);
+      return;
+    }
+
+  for (int i = 0; i < c->n_packages; i++)
+    {
+      package_info *pi = c->packages[i];
+
+      pi->have_info = false;
+      if (dec)
+	{
+	  dec->decode_mem (&(pi->info), sizeof (pi->info));
+	  if (!dec->corrupted ())
+	    {
+	      pi->have_info = true;
+	      global_package_info_changed (pi);
+	    }
+	}
+    }
+
+  c->cont (true, c->data);
+
+  for (int i = 0; i < c->n_packages; i++)
+    c->packages[i]->unref ();
+  delete c;
+}
+
 struct gpis_closure
 {
-  GList *package_list;
   GList *current_node;
   bool only_basic_info;
   void (*cont) (void *);
   void *data;
 };
 
-static void gpis_loop (package_info *pi, void *data, bool unused);
+static void gpis_loop (bool unused, void *data);
 
 void
 get_package_infos (GList *package_list,
@@ -1149,73 +1882,75 @@ get_package_infos (GList *package_list,
 		   void *data)
 {
   gpis_closure *clos = new gpis_closure;
-  clos->package_list = package_list;
   clos->current_node = package_list;
   clos->only_basic_info = only_basic_info;
   clos->cont = cont;
   clos->data = data;
 
-  gpis_loop (NULL, clos, TRUE);
+  gpis_loop (false, clos);
 }
 
 static void
-gpis_loop (package_info *pi, void *data, bool unused)
+gpis_loop (bool unused, void *data)
 {
   gpis_closure *clos = (gpis_closure *)data;
 
-  if (clos->current_node == NULL)
+  if (!get_package_info_batch (&clos->current_node,
+			       clos->only_basic_info,
+			       APT_PRIORITY_BACKGROUND,
+			       gpis_loop, clos))
     {
       clos->cont (clos->data);
       delete clos;
     }
-  else
-    {
-      GList *current_package_node = clos->current_node;
-      clos->current_node = g_list_next (clos->current_node);
-      get_package_info ((package_info *) current_package_node->data,
-			clos->only_basic_info,
-			gpis_loop, clos);
-    }
 }
 
 /* GET_PACKAGE_INFOS_IN_BACKGROUND
  */
 
 static void gpiib_trigger ();
-static void gpiib_done (package_info *pi, void *unused, bool changed);
+static void gpiib_done (bool changed, void *unused);
 
 static GList *gpiib_next;
+static bool gpiib_running = false;
+static bool gpiib_changed = false;
 
 static void
 get_package_infos_in_background (GList *packages)
 {
   gpiib_next = packages;
-  gpiib_trigger ();
+  gpiib_changed = false;
+
+  /* If a batch is still on its way, gpiib_done will pick up the new
+     list when it arrives.
+  */
+  if (!gpiib_running)
+    gpiib_trigger ();
 }
 
 static void
 gpiib_trigger ()
 {
-  GList *n = gpiib_next;
-  if (n)
+  gpiib_running = get_package_info_batch (&gpiib_next, true,
+					  APT_PRIORITY_BULK,
+					  gpiib_done, NULL);
+
+  /* Resort & refresh view
+   * only needed when we are sorting by size */
+  if (!gpiib_running && gpiib_changed)
     {
-      package_info *pi = (package_info *)n->data;
-      gpiib_next = n->next;
-      get_package_info (pi, true,
-			gpiib_done, NULL);
+      gpiib_changed = false;
+      if (package_sort_key == SORT_BY_SIZE)
+	sort_all_packages (true);
     }
 }
 
-static void 
-gpiib_done (package_info *pi, void *data, bool changed)
+static void
+gpiib_done (bool changed, void *data)
 {
+  if (changed)
+    gpiib_changed = true;
   gpiib_trigger ();
-
-  /* Resort & refresh view
-   * only needed when we are sorting by size */
-  if (!gpiib_next && changed &&
-      (package_sort_key == SORT_BY_SIZE))
-    sort_all_packages (true);
 }
 
 /* CHECK_THIRD_PARTY_POLICY
@@ -1545,7 +2280,8 @@ available_package_selected (package_info *pi)
 static void
 available_package_activated (package_info *pi)
 {
-  install_package_flow (pi);
+  if (package_list_ready)
+    install_package_flow (pi);
 }
 
 static void
@@ -1585,6 +2321,9 @@ installed_package_selected (package_info *pi)
 static void
 installed_package_activated (package_info *pi)
 {
+  if (!package_list_ready)
+    return;
+
   if (pi->flags & pkgflag_system_update)
     show_package_details_flow (pi, remove_details);
   else
@@ -1601,10 +2340,10 @@ make_install_section_view (view *v)
 
   view = make_install_apps_package_list (v->window,
                                          si? si->packages : NULL,
-                                         package_list_ready,
+                                         package_list_shown,
                                          available_package_selected,
                                          available_package_activated);
-  if (package_list_ready)
+  if (package_list_shown)
     gtk_widget_show (view);
 
   if (si)
@@ -1756,7 +2495,7 @@ make_install_applications_view (view *v)
                                         ((si->rank == SECTION_RANK_HIDDEN)
                                          ? NULL
                                          : si->packages),
-                                        package_list_ready,
+                                        package_list_shown,
                                         available_package_selected,
                                         available_package_activated);
 
@@ -1767,7 +2506,7 @@ make_install_applications_view (view *v)
       view = make_global_section_list (install_sections, view_section);
     }
 
-  if (package_list_ready)
+  if (package_list_shown)
     gtk_widget_show (view);
 
   maybe_refresh_package_cache_without_user ();
@@ -1834,11 +2573,11 @@ make_upgrade_applications_view (view *v)
 
   view = make_upgrade_apps_package_list (v->window,
                                          upgradeable_packages,
-                                         package_list_ready,
+                                         package_list_shown,
                                          package_list_ready && upgradeable_packages,
                                          available_package_selected,
                                          available_package_activated);
-  if (package_list_ready)
+  if (package_list_shown)
     gtk_widget_show (view);
 
   get_package_infos_in_background (upgradeable_packages);
@@ -1860,10 +2599,10 @@ make_uninstall_applications_view (view *v)
   GtkWidget *view;
   view = make_uninstall_apps_package_list (v->window,
                                            installed_packages,
-                                           package_list_ready,
+                                           package_list_shown,
                                            installed_package_selected,
                                            installed_package_activated);
-  if (package_list_ready)
+  if (package_list_shown)
     gtk_widget_show (view);
 
   enable_refresh (false);
@@ -1958,33 +2697,18 @@ search_package_list (GList **result,
 }
 
 static void
-find_in_package_list (GList **result,
-		      GList *packages, const char *name)
+find_in_package_table (GList **result,
+		       GHashTable *table, const char *name)
 {
-  while (packages)
-    {
-      package_info *pi = (package_info *)packages->data;
-      
-      if (!strcmp (pi->name, name))
-	{
-	  pi->ref ();
-	  *result = g_list_append (*result, pi);
-	}
+  package_info *pi = NULL;
 
-      packages = packages->next;
-    }
-}
+  if (table)
+    pi = (package_info *) g_hash_table_lookup (table, name);
 
-static void
-find_in_section_list (GList **result,
-		      GList *sections, const char *name)
-{
-  while (sections)
+  if (pi)
     {
-      section_info *si = (section_info *)sections->data;
-      find_in_package_list (result, si->packages, name);
-
-      sections = sections->next;
+      pi->ref ();
+      *result = g_list_append (*result, pi);
     }
 }
 
@@ -1992,9 +2716,9 @@ static void
 find_package_in_lists (GList **result,
                        const char *package_name)
 {
-      find_in_section_list (result, install_sections, package_name);
-      find_in_package_list (result, upgradeable_packages, package_name);
-      find_in_package_list (result, installed_packages, package_name);
+      find_in_package_table (result, install_table, package_name);
+      find_in_package_table (result, upgradeable_table, package_name);
+      find_in_package_table (result, installed_table, package_name);
 }
 
 static void
@@ -2016,13 +2740,14 @@ search_packages_reply (int cmd, apt_proto_decoder *dec, void *data)
     }
 
   GList *result = NULL;
+  package_strings *strings = new package_strings;
 
   while (!dec->at_end ())
     {
       const char *name = NULL;
       package_info *info = NULL;
 
-      info = get_package_list_entry (dec);
+      info = get_package_list_entry (dec, strings);
       name = info->name;
 
       if (parent == &install_applications_view)
@@ -2044,18 +2769,18 @@ search_packages_reply (int cmd, apt_proto_decoder *dec, void *data)
                       && (!info->installed_version && package_is_hidden (info))))
                 ;
               else
-                find_in_package_list (&result, si->packages, name);
+                find_in_package_table (&result, install_table, name);
 	    }
 	}
       else if (parent == &upgrade_applications_view)
-	find_in_package_list (&result,
-			      upgradeable_packages, name);
+	find_in_package_table (&result, upgradeable_table, name);
       else if (parent == &uninstall_applications_view)
-	find_in_package_list (&result,
-			      installed_packages, name);
+	find_in_package_table (&result, installed_table, name);
       info->unref();
     }
 
+  strings->unref ();
+
   clear_global_package_list ();
   free_packages (search_result_packages);
   search_result_packages = result;
@@ -2835,7 +3560,8 @@ void maybe_init_packages_list (void)
   if (initial_packages_available || (pkg_list_state != pkg_list_unknown))
     return;
 
-  get_package_list_with_cont (notice_initial_packages_available, NULL);
+  get_initial_package_list_with_cont (notice_initial_packages_available,
+				      NULL);
   save_backup_data ();
 }
 
@@ -50,6 +50,25 @@ enum view_id {
   SEARCH_RESULTS_VIEW
 };
 
+/* A reference counted block of strings.  The package_info structs
+   that are decoded from one package list reply keep their strings in
+   a common block, so that decoding them needs only a few big
+   allocations and freeing them is one operation.
+*/
+struct package_strings {
+
+  package_strings ();
+  ~package_strings ();
+
+  void ref ();
+  void unref ();
+
+  int ref_count;
+  GStringChunk *chunk;
+
+  char *insert (const char *str);
+};
+
 struct package_info {
 
   package_info ();
@@ -75,6 +94,10 @@ struct package_info {
   GdkPixbuf *available_icon;
   int flags;
 
+  // When STRINGS is non-NULL, the strings above are stored in it and
+  // must not be freed individually.
+  package_strings *strings;
+
   bool have_info;
   apt_proto_package_info info;
   third_party_policy_status third_party_policy;
@@ -87,11 +110,33 @@ struct package_info {
   GList *summary_packages[sumtype_max];  // GList of strings.
   char *dependencies;
 
+  // The row of this package in the global package list, see
+  // package-list-model.h.
   GtkTreeModel *model;
   GtkTreeIter iter;
 
+  // The casefolded words of the display name and short description,
+  // for the live search.  The first is for the available version,
+  // the second for the installed one.  Use get_search_keys.
+  char **search_keys[2];
+
+  // Keys for sorting by display name and by version, compared with
+  // strcmp.  The first of each is for the available version, the
+  // second for the installed one.  Use get_name_sort_key and
+  // get_version_sort_key.
+  char *name_sort_keys[2];
+  char *version_sort_keys[2];
+
+  // Whether this package matched the live search with the given
+  // serial number.
+  unsigned int live_search_serial;
+  bool live_search_match;
+
   const char *get_display_name (bool installed);
   const char *get_display_version (bool installed);
+  char **get_search_keys (bool installed);
+  const char *get_name_sort_key (bool installed);
+  const char *get_version_sort_key (bool installed);
 };
 
 view_id get_current_view_id ();
@@ -134,6 +179,7 @@ struct section_info {
 
 void get_package_list ();
 void get_package_list_with_cont (void (*cont) (void *data), void *data);
+void package_cache_changed ();
 
 void show_current_details ();
 
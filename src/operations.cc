@@ -43,6 +43,7 @@
 #include "details.h"
 #include "dbus.h"
 #include "user_files.h"
+#include "trace.h"
 
 #define _(x) gettext (x)
 
@@ -375,6 +376,8 @@ install_packages (GList *packages,
   c->refresh_needed = false;
   c->mode = DEVICE_MODE_UNKNOWN; /* Not known yet (SSU only) */
 
+  trace_async_begin ("install", c, title);
+
   get_package_infos (packages,
 		     true,
 		     ip_install_with_info,
@@ -607,7 +610,10 @@ ip_check_cert_loop (ip_clos *c)
 	  ip_check_cert_loop (c);
 	}
       else
-	apt_worker_install_check (pi->name, ip_check_cert_reply, c);
+	{
+	  trace_async_begin ("check certificates", c, pi->name);
+	  apt_worker_install_check (pi->name, ip_check_cert_reply, c);
+	}
     }
   else
     {
@@ -632,6 +638,8 @@ ip_check_cert_reply (int cmd, apt_proto_decoder *dec, void *data)
 {
   ip_clos *c = (ip_clos *)data;
 
+  trace_async_end ("check certificates", c);
+
   if (dec == NULL)
     {
       ip_end (c);
@@ -1328,6 +1336,7 @@ ip_download_cur (void *data)
   g_free (title);
 
   set_log_start ();
+  trace_async_begin ("download", c, pi->name);
   apt_worker_download_package (pi->name, ip_download_cur_reply, c);
 }
 
@@ -1418,6 +1427,8 @@ ip_download_cur_reply (int cmd, apt_proto_decoder *dec, void *data)
   ip_clos *c = (ip_clos *)data;
   static int failure_count = 0;
 
+  trace_async_end ("download", c);
+
   if (dec == NULL)
     {
       ip_end (c);
@@ -1486,6 +1497,7 @@ ip_kill_all_and_install_delayed (gpointer data)
       kill_processes_for_SSU ();
 
       /* Continue the process */
+      trace_async_begin ("install package", c, pi->name);
       apt_worker_install_package (pi->name,
                                   c->alt_download_root,
                                   ip_install_cur_reply, c);
@@ -1551,6 +1563,7 @@ ip_install_cur_with_space_checked (int cmd, apt_proto_decoder *dec, void *data)
         {
           /* Proceed to install if there's enough free space and no
              SSU package is being installed */
+          trace_async_begin ("install package", c, pi->name);
           apt_worker_install_package (pi->name,
                                       c->alt_download_root,
                                       ip_install_cur_reply, c);
@@ -1569,6 +1582,8 @@ ip_install_cur_reply (int cmd, apt_proto_decoder *dec, void *data)
   ip_clos *c = (ip_clos *)data;
   package_info *pi = (package_info *)(c->cur->data);
 
+  trace_async_end ("install package", c);
+
   bool needs_reboot = package_needs_reboot (pi);
 
   if (dec == NULL)
@@ -1819,6 +1834,8 @@ ip_end (void *data)
   if (c->packages != NULL)
     g_list_free (c->packages);
 
+  trace_async_end ("install", c);
+
   c->cont (c->n_successful, c->data);
 
   g_free (c->title);
@@ -0,0 +1,270 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "package-list-model.h"
+
+static void package_list_model_tree_model_init (GtkTreeModelIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (PackageListModel, package_list_model, G_TYPE_OBJECT,
+			 G_IMPLEMENT_INTERFACE (GTK_TYPE_TREE_MODEL,
+						package_list_model_tree_model_init));
+
+static void
+set_iter (PackageListModel *model, GtkTreeIter *iter, guint index)
+{
+  iter->stamp = model->stamp;
+  iter->user_data = GUINT_TO_POINTER (index);
+  iter->user_data2 = NULL;
+  iter->user_data3 = NULL;
+}
+
+static guint
+iter_index (GtkTreeIter *iter)
+{
+  return GPOINTER_TO_UINT (iter->user_data);
+}
+
+static void
+release_row (PackageListModel *model, package_info *pi)
+{
+  if (pi->model == GTK_TREE_MODEL (model))
+    pi->model = NULL;
+  pi->unref ();
+}
+
+static GtkTreeModelFlags
+package_list_model_get_flags (GtkTreeModel *tree_model)
+{
+  return GtkTreeModelFlags (GTK_TREE_MODEL_ITERS_PERSIST
+			    | GTK_TREE_MODEL_LIST_ONLY);
+}
+
+static gint
+package_list_model_get_n_columns (GtkTreeModel *tree_model)
+{
+  return 1;
+}
+
+static GType
+package_list_model_get_column_type (GtkTreeModel *tree_model, gint index)
+{
+  g_return_val_if_fail (index == 0, G_TYPE_INVALID);
+  return G_TYPE_POINTER;
+}
+
+static gboolean
+package_list_model_iter_nth_child (GtkTreeModel *tree_model,
+				   GtkTreeIter *iter,
+				   GtkTreeIter *parent,
+				   gint n)
+{
+  PackageListModel *model = PACKAGE_LIST_MODEL (tree_model);
+
+  if (parent || n < 0 || (guint) n >= model->rows->len)
+    {
+      iter->stamp = 0;
+      return FALSE;
+    }
+
+  set_iter (model, iter, n);
+  return TRUE;
+}
+
+static gboolean
+package_list_model_get_iter (GtkTreeModel *tree_model,
+			     GtkTreeIter *iter,
+			     GtkTreePath *path)
+{
+  if (gtk_tree_path_get_depth (path) != 1)
+    {
+      iter->stamp = 0;
+      return FALSE;
+    }
+
+  return package_list_model_iter_nth_child (tree_model, iter, NULL,
+					    gtk_tree_path_get_indices (path)[0]);
+}
+
+static GtkTreePath *
+package_list_model_get_path (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+  PackageListModel *model = PACKAGE_LIST_MODEL (tree_model);
+
+  g_return_val_if_fail (iter->stamp == model->stamp, NULL);
+  return gtk_tree_path_new_from_indices (iter_index (iter), -1);
+}
+
+static void
+package_list_model_get_value (GtkTreeModel *tree_model,
+			      GtkTreeIter *iter,
+			      gint column,
+			      GValue *value)
+{
+  PackageListModel *model = PACKAGE_LIST_MODEL (tree_model);
+
+  g_return_if_fail (column == 0);
+  g_return_if_fail (iter->stamp == model->stamp);
+  g_return_if_fail (iter_index (iter) < model->rows->len);
+
+  g_value_init (value, G_TYPE_POINTER);
+  g_value_set_pointer (value, g_ptr_array_index (model->rows,
+						 iter_index (iter)));
+}
+
+static gboolean
+package_list_model_iter_next (GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+  PackageListModel *model = PACKAGE_LIST_MODEL (tree_model);
+  guint next = iter_index (iter) + 1;
+
+  if (iter->stamp != model->stamp || next >= model->rows->len)
+    {
+      iter->stamp = 0;
+      return FALSE;
+    }
+
+  set_iter (model, iter, next);
+  return TRUE;
+}
+
+static gboolean
+package_list_model_iter_children (GtkTreeModel *tree_model,
+				  GtkTreeIter *iter,
+				  GtkTreeIter *parent)
+{
+  return package_list_model_iter_nth_child (tree_model, iter, parent, 0);
+}
+
+static gboolean
+package_list_model_iter_has_child (GtkTreeModel *tree_model,
+				   GtkTreeIter *iter)
+{
+  return FALSE;
+}
+
+static gint
+package_list_model_iter_n_children (GtkTreeModel *tree_model,
+				    GtkTreeIter *iter)
+{
+  if (iter)
+    return 0;
+
+  return PACKAGE_LIST_MODEL (tree_model)->rows->len;
+}
+
+static gboolean
+package_list_model_iter_parent (GtkTreeModel *tree_model,
+				GtkTreeIter *iter,
+				GtkTreeIter *child)
+{
+  iter->stamp = 0;
+  return FALSE;
+}
+
+static void
+package_list_model_tree_model_init (GtkTreeModelIface *iface)
+{
+  iface->get_flags = package_list_model_get_flags;
+  iface->get_n_columns = package_list_model_get_n_columns;
+  iface->get_column_type = package_list_model_get_column_type;
+  iface->get_iter = package_list_model_get_iter;
+  iface->get_path = package_list_model_get_path;
+  iface->get_value = package_list_model_get_value;
+  iface->iter_next = package_list_model_iter_next;
+  iface->iter_children = package_list_model_iter_children;
+  iface->iter_has_child = package_list_model_iter_has_child;
+  iface->iter_n_children = package_list_model_iter_n_children;
+  iface->iter_nth_child = package_list_model_iter_nth_child;
+  iface->iter_parent = package_list_model_iter_parent;
+}
+
+static void
+package_list_model_init (PackageListModel *model)
+{
+  /* Iters from other models are unlikely to carry this stamp.
+   */
+  model->stamp = g_random_int ();
+  model->rows = g_ptr_array_new ();
+}
+
+static void
+package_list_model_finalize (GObject *object)
+{
+  PackageListModel *model = PACKAGE_LIST_MODEL (object);
+
+  for (guint i = 0; i < model->rows->len; i++)
+    release_row (model, (package_info *) g_ptr_array_index (model->rows, i));
+  g_ptr_array_free (model->rows, TRUE);
+
+  G_OBJECT_CLASS (package_list_model_parent_class)->finalize (object);
+}
+
+static void
+package_list_model_class_init (PackageListModelClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = package_list_model_finalize;
+}
+
+PackageListModel *
+package_list_model_new (GList *packages, bool (*visible) (package_info *pi))
+{
+  PackageListModel *model =
+    PACKAGE_LIST_MODEL (g_object_new (TYPE_PACKAGE_LIST_MODEL, NULL));
+
+  for (GList *p = packages; p; p = p->next)
+    {
+      package_info *pi = (package_info *) p->data;
+
+      if (visible && !visible (pi))
+	continue;
+
+      pi->ref ();
+      pi->model = GTK_TREE_MODEL (model);
+      set_iter (model, &pi->iter, model->rows->len);
+      g_ptr_array_add (model->rows, pi);
+    }
+
+  return model;
+}
+
+void
+package_list_model_clear (PackageListModel *model)
+{
+  /* Deleting from the end keeps the iters of the remaining rows
+     valid, as promised by GTK_TREE_MODEL_ITERS_PERSIST.
+  */
+  while (model->rows->len > 0)
+    {
+      guint last = model->rows->len - 1;
+      package_info *pi =
+	(package_info *) g_ptr_array_index (model->rows, last);
+      GtkTreePath *path = gtk_tree_path_new_from_indices (last, -1);
+
+      g_ptr_array_remove_index (model->rows, last);
+      release_row (model, pi);
+      gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
+      gtk_tree_path_free (path);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef PACKAGE_LIST_MODEL_H
+#define PACKAGE_LIST_MODEL_H
+
+#include <gtk/gtk.h>
+
+#include "main.h"
+
+/* A flat GtkTreeModel with a single G_TYPE_POINTER column that holds
+   a package_info.  The rows are kept in an array of pointers, so
+   making a model for a list of packages does not emit any signals,
+   and finding the path of a row is just a matter of looking at its
+   iter.
+
+   The model holds a reference to each of its packages.  While a
+   package is in a model, pi->model and pi->iter point to its row.
+*/
+
+#define TYPE_PACKAGE_LIST_MODEL             (package_list_model_get_type ())
+#define PACKAGE_LIST_MODEL(obj)             (G_TYPE_CHECK_INSTANCE_CAST ((obj), TYPE_PACKAGE_LIST_MODEL, PackageListModel))
+#define IS_PACKAGE_LIST_MODEL(obj)          (G_TYPE_CHECK_INSTANCE_TYPE ((obj), TYPE_PACKAGE_LIST_MODEL))
+
+typedef struct _PackageListModel PackageListModel;
+typedef struct _PackageListModelClass PackageListModelClass;
+
+struct _PackageListModel
+{
+  GObject parent;
+
+  gint stamp;
+  GPtrArray *rows;
+};
+
+struct _PackageListModelClass
+{
+  GObjectClass parent_class;
+};
+
+GType package_list_model_get_type (void);
+
+/* Make a model with the packages in PACKAGES for which VISIBLE
+   returns true, in the same order.  When VISIBLE is NULL, all
+   packages are included.
+*/
+PackageListModel *package_list_model_new (GList *packages,
+					  bool (*visible) (package_info *pi));
+
+/* Remove all rows, emitting "row-deleted" for each of them.
+ */
+void package_list_model_clear (PackageListModel *model);
+
+#endif /* !PACKAGE_LIST_MODEL_H */
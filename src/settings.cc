@@ -34,6 +34,7 @@
 #include "apt-worker-client.h"
 #include "menu.h"
 #include "user_files.h"
+#include "trace.h"
 
 #define _(x) gettext (x)
 
@@ -54,9 +55,12 @@ bool red_pill_check_always = false;
 bool red_pill_ignore_wrong_domains = true;
 bool red_pill_ignore_thirdparty_policy = false;
 bool red_pill_permanent = false;
+char *red_pill_trace_file = NULL;
 
 #define SETTINGS_FILE ".osso/hildon-application-manager"
 
+static void update_trace_file ();
+
 static FILE *
 open_user_file (const char *file, const char *mode)
 {
@@ -120,6 +124,12 @@ load_settings ()
 	    red_pill_ignore_thirdparty_policy = val;
 	  else if (sscanf (line, "red-pill-permanent %d", &val) == 1)
 	    red_pill_permanent = val;
+	  else if (g_str_has_prefix (line, "red-pill-trace-file "))
+	    {
+	      g_free (red_pill_trace_file);
+	      red_pill_trace_file =
+		g_strdup (line + strlen ("red-pill-trace-file "));
+	    }
 	  else
 	    add_log ("Unrecognized configuration line: '%s'\n", line);
 	}
@@ -133,6 +143,8 @@ load_settings ()
   if (running_in_scratchbox ())
     assume_connection = true;
 
+  update_trace_file ();
+
   /* XML - only kidding.
    */
 }
@@ -161,6 +173,8 @@ save_settings ()
       fprintf (f, "red-pill-ignore-thirdparty-policy %d\n",
 	       red_pill_ignore_thirdparty_policy);
       fprintf (f, "red-pill-permanent %d\n", red_pill_permanent);
+      if (red_pill_trace_file)
+	fprintf (f, "red-pill-trace-file %s\n", red_pill_trace_file);
       fprintf (f, "assume-connection %d\n", assume_connection);
       fflush (f);
       fsync (fileno (f));
@@ -188,6 +202,7 @@ enum boolean_options {
 
 struct settings_closure {
   GtkWidget *update_combo;
+  GtkWidget *trace_file_entry;
 
   GtkWidget *boolean_btn[NUM_BOOLEAN_OPTIONS];
   bool *boolean_var[NUM_BOOLEAN_OPTIONS];
@@ -215,7 +230,7 @@ make_boolean_option (settings_closure *c,
 static GtkWidget *
 make_settings_tab (settings_closure *c)
 {
-  GtkWidget *scrolled_window, *vbox;
+  GtkWidget *scrolled_window, *vbox, *hbox;
   GtkSizeGroup *group;
 
   group = GTK_SIZE_GROUP (gtk_size_group_new (GTK_SIZE_GROUP_HORIZONTAL));
@@ -258,6 +273,21 @@ make_settings_tab (settings_closure *c)
   make_boolean_option (c, vbox, group, OPT_PERMANENT,
  		       "Red pill is permanent",
  		       &red_pill_permanent);
+
+  /* The GUI and the apt-worker write trace events to this file, see
+     trace.h.
+  */
+  hbox = gtk_hbox_new (FALSE, 0);
+  gtk_box_pack_start (GTK_BOX (hbox), gtk_label_new ("Trace file"),
+		      FALSE, FALSE, 10);
+  c->trace_file_entry = hildon_entry_new (HILDON_SIZE_FINGER_HEIGHT);
+  hildon_entry_set_placeholder (HILDON_ENTRY (c->trace_file_entry),
+				"Not tracing");
+  if (red_pill_trace_file)
+    gtk_entry_set_text (GTK_ENTRY (c->trace_file_entry),
+			red_pill_trace_file);
+  gtk_box_pack_start (GTK_BOX (hbox), c->trace_file_entry, TRUE, TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (vbox), hbox, FALSE, FALSE, 0);
   g_object_unref (group);
 
   hildon_pannable_area_add_with_viewport (HILDON_PANNABLE_AREA (scrolled_window),
@@ -287,6 +317,11 @@ settings_dialog_response (GtkDialog *dialog, gint response, gpointer clos)
 	  *(c->boolean_var[i]) = current_value;
 	}
 
+      g_free (red_pill_trace_file);
+      red_pill_trace_file =
+	g_strstrip (g_strdup (gtk_entry_get_text
+			      (GTK_ENTRY (c->trace_file_entry))));
+
       save_settings ();
       update_backend_options ();
 
@@ -370,8 +405,21 @@ set_options_reply (int cmd, apt_proto_decoder *dec, void *data)
   return;
 }
 
+/* Trace to RED_PILL_TRACE_FILE while in red pill mode.
+ */
+static void
+update_trace_file ()
+{
+  const char *file = red_pill_mode ? red_pill_trace_file : NULL;
+
+  if (!trace_open (file, "hildon-application-manager", true))
+    add_log ("Can't write trace to %s\n", file);
+}
+
 void
 update_backend_options ()
 {
+  update_trace_file ();
   apt_worker_set_options (backend_options (), set_options_reply, NULL);
+  apt_worker_set_trace_file (trace_file (), set_options_reply, NULL);
 }
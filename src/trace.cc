@@ -0,0 +1,243 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "trace.h"
+
+static int trace_fd = -1;
+static char *trace_file_name = NULL;
+
+/* Both processes use the same clock, so that their events line up.
+ */
+static long long
+trace_timestamp ()
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+append_escaped (GString *str, const char *text)
+{
+  for (const char *p = text; *p; p++)
+    {
+      if (*p == '"' || *p == '\\')
+	g_string_append_c (str, '\\');
+      if ((unsigned char) *p < 0x20)
+	g_string_append_printf (str, "\\u%04x", *p);
+      else
+	g_string_append_c (str, *p);
+    }
+}
+
+/* Each event is written with a single write so that the events of
+   the two processes don't get mixed up.
+*/
+static void
+trace_event (const char *name, const char *cat, char ph,
+	     const char *id, int seq, const char *detail)
+{
+  if (trace_fd < 0)
+    return;
+
+  GString *str = g_string_new ("{\"name\":\"");
+  append_escaped (str, name);
+  g_string_append_printf (str,
+			  "\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,"
+			  "\"pid\":%d,\"tid\":%d",
+			  cat, ph, trace_timestamp (),
+			  (int) getpid (), (int) getpid ());
+  if (id)
+    g_string_append_printf (str, ",\"id\":\"%s\"", id);
+  if (ph == 'f')
+    g_string_append (str, ",\"bp\":\"e\"");
+  if (seq >= 0 || detail)
+    {
+      g_string_append (str, ",\"args\":{");
+      if (seq >= 0)
+	g_string_append_printf (str, "\"seq\":%d%s", seq, detail? "," : "");
+      if (detail)
+	{
+	  /* Metadata events have their value in "name".
+	   */
+	  g_string_append_printf (str, "\"%s\":\"",
+				  ph == 'M'? "name" : "detail");
+	  append_escaped (str, detail);
+	  g_string_append (str, "\"");
+	}
+      g_string_append (str, "}");
+    }
+  g_string_append (str, "},\n");
+
+  if (write (trace_fd, str->str, str->len) != (ssize_t) str->len)
+    {
+      fprintf (stderr, "%s: %s\n", trace_file_name, strerror (errno));
+      trace_open (NULL, NULL, false);
+    }
+
+  g_string_free (str, TRUE);
+}
+
+bool
+trace_open (const char *file, const char *process, bool create, int owner)
+{
+  if (file && *file == '\0')
+    file = NULL;
+
+  if (file && trace_file_name && !strcmp (file, trace_file_name))
+    return true;
+
+  if (trace_fd >= 0)
+    {
+      close (trace_fd);
+      trace_fd = -1;
+    }
+  g_free (trace_file_name);
+  trace_file_name = NULL;
+
+  if (file == NULL)
+    return true;
+
+  int flags = O_WRONLY | O_APPEND | O_NOFOLLOW | O_NOCTTY;
+  if (create)
+    flags |= O_CREAT | O_TRUNC;
+
+  trace_fd = open (file, flags, 0644);
+  if (trace_fd < 0)
+    {
+      fprintf (stderr, "%s: %s\n", file, strerror (errno));
+      return false;
+    }
+
+  struct stat buf;
+  if (owner != -1
+      && (fstat (trace_fd, &buf) < 0
+	  || !S_ISREG (buf.st_mode)
+	  || buf.st_uid != (uid_t) owner))
+    {
+      fprintf (stderr, "%s: not a regular file of user %d\n", file, owner);
+      close (trace_fd);
+      trace_fd = -1;
+      return false;
+    }
+  fcntl (trace_fd, F_SETFD, FD_CLOEXEC);
+  trace_file_name = g_strdup (file);
+
+  if (create && write (trace_fd, "[\n", 2) != 2)
+    {
+      trace_open (NULL, NULL, false);
+      return false;
+    }
+
+  trace_event ("process_name", "__metadata", 'M', NULL, -1, process);
+  return true;
+}
+
+const char *
+trace_file ()
+{
+  return trace_file_name;
+}
+
+void
+trace_begin (const char *name, int seq)
+{
+  trace_event (name, "ham", 'B', NULL, seq, NULL);
+}
+
+void
+trace_end (const char *name)
+{
+  trace_event (name, "ham", 'E', NULL, -1, NULL);
+}
+
+void
+trace_async_begin (const char *name, const void *id, const char *detail)
+{
+  char buf[32];
+
+  if (trace_fd < 0)
+    return;
+
+  g_snprintf (buf, sizeof (buf), "%p", id);
+  trace_event (name, "ham", 'b', buf, -1, detail);
+}
+
+void
+trace_async_end (const char *name, const void *id)
+{
+  char buf[32];
+
+  if (trace_fd < 0)
+    return;
+
+  g_snprintf (buf, sizeof (buf), "%p", id);
+  trace_event (name, "ham", 'e', buf, -1, NULL);
+}
+
+static void
+trace_flow (const char *name, char ph, int seq)
+{
+  char buf[32];
+
+  if (trace_fd < 0)
+    return;
+
+  g_snprintf (buf, sizeof (buf), "%d", seq);
+  trace_event (name, "ham", ph, buf, -1, NULL);
+}
+
+void
+trace_request_sent (int seq)
+{
+  trace_flow ("request", 's', seq);
+}
+
+void
+trace_request_received (int seq)
+{
+  trace_flow ("request", 'f', seq);
+}
+
+void
+trace_reply_sent (int seq)
+{
+  trace_flow ("reply", 's', seq);
+}
+
+void
+trace_reply_received (int seq)
+{
+  trace_flow ("reply", 'f', seq);
+}
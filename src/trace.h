@@ -0,0 +1,103 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Tracing in the Chrome trace event format.
+
+   The GUI and the apt-worker both write their events to the same
+   file, which can then be loaded into chrome://tracing or Perfetto to
+   see both processes on one timeline.  The sequence number of a
+   request connects the span in the GUI that sends it, the span in
+   the apt-worker that handles it, and the span in the GUI that
+   handles the reply.
+
+   The file is a JSON array that is never closed.  The viewers accept
+   that.
+
+   Tracing is off until trace_open has been called, and all the
+   functions below do nothing then.
+*/
+
+/* Start writing events to FILE, which is created, and emptied when
+   CREATE is true.  Otherwise it must exist already.  PROCESS is the
+   name shown for the events of this process.  When FILE is NULL or
+   empty, tracing is stopped.  When FILE is already being written to,
+   nothing happens.
+
+   Symbolic links are not followed.  When OWNER is not -1, FILE must
+   be a regular file owned by that user.
+
+   Returns false when FILE can not be opened or is refused.
+*/
+bool trace_open (const char *file, const char *process, bool create,
+		 int owner = -1);
+
+/* The file that is being written to, or NULL.
+ */
+const char *trace_file ();
+
+/* Spans on the timeline of the calling process.  They must be
+   properly nested.  SEQ is the sequence number of the request that
+   the span belongs to, or -1.
+*/
+void trace_begin (const char *name, int seq = -1);
+void trace_end (const char *name);
+
+/* Spans that are not nested, such as a whole installation in the
+   GUI, which is made up of many callbacks.  ID must be unique among
+   the spans with the same NAME that are open at the same time.
+*/
+void trace_async_begin (const char *name, const void *id,
+			const char *detail = NULL);
+void trace_async_end (const char *name, const void *id);
+
+/* Arrows from a request to its handling, and from the reply to its
+   handling.  They must be made inside a span.
+*/
+void trace_request_sent (int seq);
+void trace_request_received (int seq);
+void trace_reply_sent (int seq);
+void trace_reply_received (int seq);
+
+/* A span that ends when this object goes out of scope.
+ */
+class trace_span {
+public:
+  trace_span (const char *name, int seq = -1)
+    : name (name)
+  {
+    trace_begin (name, seq);
+  }
+
+  ~trace_span ()
+  {
+    trace_end (name);
+  }
+
+private:
+  const char *name;
+};
+
+#endif /* !TRACE_H */
@@ -50,6 +50,7 @@
 #include "user_files.h"
 #include "update-notifier-conf.h"
 #include "package-info-cell-renderer.h"
+#include "package-list-model.h"
 #include "confutils.h"
 
 #define _(x) gettext (x)
@@ -1599,7 +1600,7 @@ make_small_label (const char *text)
 }
 
 static GtkTreeModelFilter *global_tree_model_filter = NULL;
-static GtkListStore *global_list_store = NULL;
+static PackageListModel *global_list_model = NULL;
 static bool global_installed;
 
 static bool global_icons_initialized = false;
@@ -1866,31 +1867,62 @@ button_press_cb (GtkWidget *treeview, GdkEventButton *event, gpointer data)
 static gboolean
 live_search_look_for_prefix (gchar **tokens, const gchar *prefix)
 {
-  gchar *needle = NULL;
-  gboolean found = false;
-  gint i = 0;
-
   /* We need something to look for first of all */
   if (!tokens)
     return FALSE;
 
-  /* Casefold needle for ease of comparison */
-  needle = g_utf8_casefold (prefix, -1);
-
   /* Look through the tokens */
-  for (i = 0; tokens[i] != NULL; i++)
-    {
-      found = g_str_has_prefix (tokens[i], needle);
+  for (gint i = 0; tokens[i] != NULL; i++)
+    if (g_str_has_prefix (tokens[i], prefix))
+      return TRUE;
 
-      /* Don't keep on looking if already found */
-      if (found)
-        break;
-    }
+  return FALSE;
+}
 
-  /* Free */
-  g_free (needle);
+/* The state of the live search.  The query is casefolded and split
+   into words only when it changes, not for every row.
+
+   Each query gets a new serial number, and the result for each
+   package is remembered in its package_info together with that
+   serial.  When the new query merely extends the previous one, a
+   package that didn't match before can't match now, and we don't
+   need to look at its keys again.
+*/
+static gchar *live_search_text = NULL;
+static gchar **live_search_tokens = NULL;
+static guint live_search_serial = 0;
+static guint live_search_narrowed_serial = 0;
+static bool live_search_installed = false;
 
-  return found;
+static void
+live_search_set_text (const gchar *text)
+{
+  if (live_search_text
+      && live_search_installed == global_installed
+      && !strcmp (text, live_search_text))
+    return;
+
+  /* The previous matches are a superset of the new ones only when the
+     new query starts with the previous one and the same keys are
+     used.  The keys of a package never change.
+  */
+  if (live_search_text
+      && live_search_installed == global_installed
+      && g_str_has_prefix (text, live_search_text))
+    live_search_narrowed_serial = live_search_serial;
+  else
+    live_search_narrowed_serial = 0;
+
+  live_search_serial++;
+  live_search_installed = global_installed;
+
+  g_free (live_search_text);
+  live_search_text = g_strdup (text);
+
+  gchar *folded = g_utf8_casefold (text, -1);
+  g_strfreev (live_search_tokens);
+  live_search_tokens = g_strsplit (folded, " ", -1);
+  g_free (folded);
 }
 
 static gboolean
@@ -1900,15 +1932,8 @@ live_search_filter_func (GtkTreeModel *model,
                          gpointer      data)
 {
     package_info *pi = NULL;
-    gchar *text_utf8 = NULL;
-    gchar *name = NULL;
-    gchar *desc = NULL;
-    gchar **text_tokens = NULL;
-    gchar **name_tokens = NULL;
-    gchar **desc_tokens = NULL;
-    gboolean retvalue = FALSE;
+    gboolean retvalue = TRUE;
     GtkWidget *live = GTK_WIDGET (data);
-    gint i = 0;
 
     if (global_packages == NULL)
       return FALSE;
@@ -1925,41 +1950,30 @@ live_search_filter_func (GtkTreeModel *model,
         return FALSE;
       }
 
-    /* Casefold name, description and text for ease of comparison */
-    text_utf8 = g_utf8_casefold (text, -1);
-    name = g_utf8_casefold (pi->get_display_name(global_installed), -1);
-    desc = g_utf8_casefold (global_installed
-                            ? pi->installed_short_description
-                            : pi->available_short_description,
-                            -1);
-
-    /* Tokenize name and description */
-    name_tokens = g_strsplit (name, " ", -1);
-    desc_tokens = g_strsplit (desc, " ", -1);
-
-    /* Tokenize and search for *all* the tokens */
-    text_tokens = g_strsplit (text, " ", -1);
-    for (i = 0; text_tokens[i] != NULL; i++)
-      {
-        /* Check package name */
-        retvalue = live_search_look_for_prefix (name_tokens, text_tokens[i]);
+    live_search_set_text (text);
 
-        /* Check short description if not found yet */
-        if (!retvalue)
-          retvalue = live_search_look_for_prefix (desc_tokens, text_tokens[i]);
+    if (pi->live_search_serial == live_search_serial)
+      return pi->live_search_match;
 
-        /* If not found reached this point, don't keep on looking */
-        if (!retvalue)
-          break;
+    if (live_search_narrowed_serial != 0
+        && pi->live_search_serial == live_search_narrowed_serial
+        && !pi->live_search_match)
+      retvalue = FALSE;
+    else
+      {
+        gchar **keys = pi->get_search_keys (global_installed);
+
+        /* Search for *all* the tokens */
+        for (gint i = 0; live_search_tokens[i] != NULL; i++)
+          if (!live_search_look_for_prefix (keys, live_search_tokens[i]))
+            {
+              retvalue = FALSE;
+              break;
+            }
       }
 
-    /* Free */
-    g_strfreev (text_tokens);
-    g_strfreev (name_tokens);
-    g_strfreev (desc_tokens);
-    g_free (text_utf8);
-    g_free (name);
-    g_free (desc);
+    pi->live_search_serial = live_search_serial;
+    pi->live_search_match = retvalue;
 
     return retvalue;
 }
@@ -2013,16 +2027,19 @@ make_global_package_list (GtkWidget *window,
       return label;
     }
 
-  /* Just create a new model for the first time */
-  if (global_list_store == NULL)
-    global_list_store = gtk_list_store_new (1, G_TYPE_POINTER);
+  /* Each list gets its own model, so that switching views does not
+     need to touch the rows of the previous one.
+  */
+  set_global_package_list (packages, installed, selected, activated);
 
   if (global_tree_model_filter != NULL)
     g_object_unref (global_tree_model_filter);
 
-  /* Create a tree model filter with the actual model inside */
+  /* Create a tree model filter with the actual model inside.  It is
+     only there for the live search, which needs a GtkTreeModelFilter.
+  */
   global_tree_model_filter =
-    GTK_TREE_MODEL_FILTER (gtk_tree_model_filter_new (GTK_TREE_MODEL (global_list_store), NULL));
+    GTK_TREE_MODEL_FILTER (gtk_tree_model_filter_new (GTK_TREE_MODEL (global_list_model), NULL));
 
   /* Insert the filter into the treeview */
   tree = gtk_tree_view_new_with_model (GTK_TREE_MODEL (global_tree_model_filter));
@@ -2101,8 +2118,6 @@ make_global_package_list (GtkWidget *window,
   gtk_widget_show_all (menu);
 #endif /* TAP_AND_HOLD && MAEMO_CHANGES */
 
-  set_global_package_list (packages, installed, selected, activated);
-
   grab_focus_on_map (tree);
 
   /* Scroll to desired cell, if needed */
@@ -2241,31 +2256,28 @@ package_is_hidden (package_info *pi)
   return strlen (section) == len && !strncmp (section, hidden, len);
 }
 
+/* Packages that are not installed and in the section "user/hidden"
+   are not shown.
+*/
+static bool
+package_is_listed (package_info *pi)
+{
+  return pi->installed_version || !package_is_hidden (pi);
+}
+
 static void
 set_global_package_list (GList *packages,
 			 bool installed,
 			 package_info_callback *selected,
 			 package_info_callback *activated)
 {
-  if (global_list_store)
-    {
-      /* @FIXME:
-         Gotta set entries to NULL first, because some bug in maemo-gtk/hildon
-         is causing calls to cat_icon_func/cat_text_func with garbage data
-      */
-      GtkTreeIter itr;
-      if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (global_list_store), &itr))
-        do
-          {
-            gtk_list_store_set(global_list_store, &itr, 0, NULL, -1);
-          } while (gtk_tree_model_iter_next (GTK_TREE_MODEL (global_list_store), &itr));
-      gtk_list_store_clear (global_list_store);
-    }
-
-  for (GList *p = global_packages; p; p = p->next)
+  /* Views that still show the old model keep it alive, and it keeps
+     its packages alive.
+  */
+  if (global_list_model)
     {
-      package_info *pi = (package_info *)p->data;
-      pi->model = NULL;
+      g_object_unref (global_list_model);
+      global_list_model = NULL;
     }
 
   global_installed = installed;
@@ -2273,29 +2285,19 @@ set_global_package_list (GList *packages,
   global_activation_callback = activated;
   global_packages = packages;
 
-  int pos = 0;
-  for (GList *p = global_packages; p; p = p->next)
-    {
-      package_info *pi = (package_info *)p->data;
-
-      /* don't insert the package if it isn't installed
-       * and it's in the section "user/hidden"
-       */
-      if (!pi->installed_version && package_is_hidden (pi))
-        continue;
-
-      pi->model = GTK_TREE_MODEL (global_list_store);
-      gtk_list_store_insert_with_values (global_list_store, &pi->iter,
-                                         pos,
-                                         0, pi,
-                                         -1);
-      pos++;
-    }
+  if (packages)
+    global_list_model = package_list_model_new (packages, package_is_listed);
 }
 
 void
 clear_global_package_list ()
 {
+  /* The packages are about to go away, so empty the view that is
+     showing them.
+  */
+  if (global_list_model)
+    package_list_model_clear (global_list_model);
+
   set_global_package_list (NULL, false, NULL, NULL);
 }
 
@@ -3233,12 +3235,9 @@ double fit_rect_inside_rect (double width, double height,
   return scale;
 }
 
-GdkPixbuf *
-pixbuf_from_base64 (const char *base64)
+static GdkPixbuf *
+decode_pixbuf_from_base64 (const char *base64)
 {
-  if (base64 == NULL)
-    return NULL;
-
   GError *error = NULL;
 
   GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
@@ -3316,6 +3315,92 @@ pixbuf_from_base64 (const char *base64)
   return pixbuf;
 }
 
+/* The icon cache.
+
+   Most icons are identical from one refresh of the package lists to
+   the next, and many packages share the same icon.  Decoded icons are
+   therefore kept in a cache keyed by a checksum of their base64
+   encoded data, so that identical icons share one GdkPixbuf.  The
+   cache holds a reference to each pixbuf and drops the least recently
+   used ones when it holds more than ICON_CACHE_MAX_BYTES of pixel
+   data.
+*/
+
+#define ICON_CACHE_MAX_BYTES (2 * 1024 * 1024)
+
+struct icon_cache_entry {
+  char *key;
+  GdkPixbuf *pixbuf;
+  int size;
+  GList *lru_link;
+};
+
+static GHashTable *icon_cache = NULL;
+static GQueue icon_cache_lru = G_QUEUE_INIT;   // most recently used first
+static int icon_cache_bytes = 0;
+
+static void
+icon_cache_entry_free (gpointer data)
+{
+  icon_cache_entry *e = (icon_cache_entry *)data;
+
+  icon_cache_bytes -= e->size;
+  g_queue_delete_link (&icon_cache_lru, e->lru_link);
+  g_object_unref (e->pixbuf);
+  g_free (e->key);
+  delete e;
+}
+
+GdkPixbuf *
+pixbuf_from_base64 (const char *base64)
+{
+  if (base64 == NULL)
+    return NULL;
+
+  if (icon_cache == NULL)
+    icon_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+					NULL, icon_cache_entry_free);
+
+  char *key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, base64, -1);
+  icon_cache_entry *e =
+    (icon_cache_entry *) g_hash_table_lookup (icon_cache, key);
+
+  if (e)
+    {
+      g_free (key);
+      g_queue_unlink (&icon_cache_lru, e->lru_link);
+      g_queue_push_head_link (&icon_cache_lru, e->lru_link);
+      return GDK_PIXBUF (g_object_ref (e->pixbuf));
+    }
+
+  GdkPixbuf *pixbuf = decode_pixbuf_from_base64 (base64);
+  if (pixbuf == NULL)
+    {
+      g_free (key);
+      return NULL;
+    }
+
+  e = new icon_cache_entry;
+  e->key = key;
+  e->pixbuf = GDK_PIXBUF (g_object_ref (pixbuf));
+  e->size = (gdk_pixbuf_get_rowstride (pixbuf)
+	     * gdk_pixbuf_get_height (pixbuf));
+  g_queue_push_head (&icon_cache_lru, e);
+  e->lru_link = icon_cache_lru.head;
+  icon_cache_bytes += e->size;
+  g_hash_table_insert (icon_cache, e->key, e);
+
+  while (icon_cache_bytes > ICON_CACHE_MAX_BYTES
+	 && icon_cache_lru.length > 1)
+    {
+      icon_cache_entry *lru =
+	(icon_cache_entry *) g_queue_peek_tail (&icon_cache_lru);
+      g_hash_table_remove (icon_cache, lru->key);
+    }
+
+  return pixbuf;
+}
+
 /* XXX - there seems to be no good way to really stop copy_progress
          from being called; I just can not tame gnome_vfs_async_xfer,
          at least not in its ovu_async_xfer costume.  Thus, I simple
@@ -513,6 +513,9 @@ void show_file_chooser_for_save (const char *title,
 
    When BASE64 is NULL or when the image data is invalid, NULL is
    returned.
+
+   Decoded images are cached, and the same pixbuf is returned (with a
+   new reference) for identical BASE64 data.  Don't modify it.
 */
 GdkPixbuf *pixbuf_from_base64 (const char *base64);
 
@@ -61,6 +61,7 @@
 #define STATUSBAR_ICON_SIZE      16
 
 #define BLINK_INTERVAL           500 /* milliseconds */
+#define INOTIFY_COALESCE_DELAY   300 /* milliseconds */
 
 #define HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE(o) \
   (G_TYPE_INSTANCE_GET_PRIVATE ((o), HAM_UPDATES_STATUS_MENU_ITEM_TYPE, HamUpdatesStatusMenuItemPrivate))
@@ -119,6 +120,8 @@ struct _HamUpdatesStatusMenuItemPrivate
   guint blinker_id;
   /* alarm setup timeout */
   guint setup_alarm_id;
+  /* update_state timeout after file changes */
+  guint update_state_id;
 
   /* updates object */
   HamUpdates *updates;
@@ -205,6 +208,9 @@ ham_updates_status_menu_item_finalize (GObject *object)
   if (priv->setup_alarm_id > 0)
     g_source_remove (priv->setup_alarm_id);
 
+  if (priv->update_state_id > 0)
+    g_source_remove (priv->update_state_id);
+
   close_inotify (self);
 
   if (priv->updates != NULL)
@@ -260,7 +266,7 @@ ham_updates_status_menu_item_init (HamUpdatesStatusMenuItem *self)
 
   priv->display_state = -1;
 
-  priv->blinker_id = priv->setup_alarm_id = 0;
+  priv->blinker_id = priv->setup_alarm_id = priv->update_state_id = 0;
 
   priv->map_connected = FALSE;
   priv->wid_ancestor = NULL;
@@ -606,6 +612,40 @@ setup_gconf (HamUpdatesStatusMenuItem *self)
 
 #define BUF_LEN 4096
 
+static gboolean
+update_state_after_changes_cb (gpointer data)
+{
+  HamUpdatesStatusMenuItemPrivate *priv;
+
+  g_return_val_if_fail (IS_HAM_UPDATES_STATUS_MENU_ITEM (data), FALSE);
+
+  priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (data);
+  priv->update_state_id = 0;
+
+  update_state (HAM_UPDATES_STATUS_MENU_ITEM (data));
+
+  return FALSE;
+}
+
+/* The watched files tend to be changed in bursts, for example the
+   seen-updates file together with the available-updates file, so we
+   wait for things to settle down before calling update_state.
+*/
+static void
+update_state_after_changes (HamUpdatesStatusMenuItem *self)
+{
+  HamUpdatesStatusMenuItemPrivate *priv;
+
+  priv = HAM_UPDATES_STATUS_MENU_ITEM_GET_PRIVATE (self);
+
+  if (priv->update_state_id > 0)
+    g_source_remove (priv->update_state_id);
+
+  priv->update_state_id = g_timeout_add (INOTIFY_COALESCE_DELAY,
+                                         update_state_after_changes_cb,
+                                         self);
+}
+
 static gboolean
 ham_updates_status_menu_item_inotify_cb (GIOChannel *source,
                                          GIOCondition condition,
@@ -653,7 +693,7 @@ ham_updates_status_menu_item_inotify_cb (GIOChannel *source,
           || is_file_modified (event, priv->wd[HOME], UFILE_SEEN_UPDATES)
           || is_file_modified (event, priv->wd[HOME], UFILE_SEEN_NOTIFICATIONS))
         {
-          update_state (HAM_UPDATES_STATUS_MENU_ITEM (data));
+          update_state_after_changes (HAM_UPDATES_STATUS_MENU_ITEM (data));
         }
 
       i += sizeof (struct inotify_event) + event->len;